@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#define BENCH_FILE "csum_bench"
+#define ROUNDS 20
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throughput in MB/s of a checksum kernel over 4 KiB blocks */
+static double kernel_rate(uint32_t (*kernel)(uint32_t, const void *, size_t), const char *block)
+{
+	const int iterations = 200000;
+	volatile uint32_t sink = 0;
+	double start = now();
+
+	for (int i = 0; i < iterations; ++i)
+		sink ^= kernel(sink, block, BLOCK_SIZE);
+
+	return (double)iterations * BLOCK_SIZE / (now() - start) / 1e6;
+}
+
+/* Read the whole benchmark file ROUNDS times and return the throughput in MB/s */
+static double read_rate(char *buf, size_t size)
+{
+	int fd = fs_open(BENCH_FILE);
+	ASSERT(fd >= 0, "fs_open");
+
+	double start = now();
+	for (int i = 0; i < ROUNDS; ++i) {
+		ASSERT(!fs_lseek(fd, 0), "fs_lseek");
+		ASSERT(fs_read(fd, buf, size) == (int)size, "fs_read");
+	}
+	double elapsed = now() - start;
+
+	fs_close(fd);
+
+	return (double)size * ROUNDS / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	char *diskname, *buf;
+	size_t size;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage> [size in KiB]\n", argv[0]);
+		exit(1);
+	}
+
+	diskname = argv[1];
+	size = (argc > 2 ? strtoul(argv[2], NULL, 0) : 1024) * 1024;
+
+	buf = malloc(size);
+	ASSERT(buf, "malloc");
+	for (size_t i = 0; i < size; ++i)
+		buf[i] = 'a' + (i * 31 + i / BLOCK_SIZE) % 26;
+
+	/* Raw kernels */
+	printf("crc32c kernel (%s): %.0f MB/s\n", crc32c_hw_available() ? "sse4.2" : "slice-by-8",
+	       kernel_rate(crc32c, buf));
+	printf("crc32c slice-by-8: %.0f MB/s\n", kernel_rate(crc32c_sw, buf));
+
+	/* Whole read path, without then with verification */
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	ASSERT(!fs_create(BENCH_FILE), "fs_create");
+	fd = fs_open(BENCH_FILE);
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, buf, size) == (int)size, "fs_write");
+	fs_close(fd);
+
+	double plain = read_rate(buf, size);
+	ASSERT(!fs_csum_enable(), "fs_csum_enable");
+	double verified = read_rate(buf, size);
+	ASSERT(!fs_csum_disable(), "fs_csum_disable");
+
+	ASSERT(!fs_delete(BENCH_FILE), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	printf("fs_read without checksums: %.0f MB/s\n", plain);
+	printf("fs_read with checksums: %.0f MB/s\n", verified);
+	printf("verification overhead: %.1f%%\n", (plain / verified - 1) * 100);
+
+	free(buf);
+
+	return 0;
+}
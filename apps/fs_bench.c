@@ -0,0 +1,425 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <stream.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define MAX_SIZES 16
+#define STORM_BATCH 100			// Files alive at once during a create/delete storm
+#define STORM_FILE_SIZE 256		// Bytes written to each file of a storm
+#define BENCH_FILE "bench"
+
+/* Parameters of the run */
+struct config {
+	const char *diskname;
+	const char *workload;		// Workload to run, NULL for all of them
+	size_t sizes[MAX_SIZES];	// Request sizes
+	int size_count;
+	size_t file_size;		// Bytes per file for read and write workloads
+	size_t ops;			// Operations for create/delete storms and mount cycles
+	int json;
+	int ram;			// Whether the image is loaded in memory
+	struct block_sim_config sim;	// Simulated storage, if any parameter is set
+};
+
+/* Outcome of a workload */
+struct result {
+	const char *name;
+	size_t size;			// Request size, 0 if not relevant
+	uint64_t ops;
+	uint64_t bytes;
+	double seconds;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	double io_per_op;		// Block-layer calls (FS_OP_BLOCK_*) per operation
+};
+
+static struct config config = {
+	.sizes = { 512, 4096, 65536 },
+	.size_count = 3,
+	.file_size = 4 << 20,
+	.ops = 1000,
+};
+
+/* Latency of each operation of the workload being run */
+static uint64_t *latencies;
+static size_t latency_count;
+
+static int first_result = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t block_calls(void)
+{
+	struct fs_stats stats;
+	uint64_t calls = 0;
+
+	ASSERT(!fs_get_stats(&stats), "fs_get_stats");
+	for (int op = FS_OP_BLOCK_READ; op <= FS_OP_BLOCK_WRITE_MULTI; op++)
+		calls += stats.ops[op].calls;
+
+	return calls;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Measurement */
+
+static uint64_t start_ns, start_calls;
+
+static void begin(void)
+{
+	latency_count = 0;
+	start_calls = block_calls();
+	start_ns = now_ns();
+}
+
+static void end(struct result *result, const char *name, size_t size, uint64_t bytes)
+{
+	result->seconds = (now_ns() - start_ns) / 1e9;
+	result->name = name;
+	result->size = size;
+	result->ops = latency_count;
+	result->bytes = bytes;
+	result->io_per_op = latency_count ? (double)(block_calls() - start_calls) / latency_count : 0;
+
+	qsort(latencies, latency_count, sizeof(*latencies), compare_u64);
+	result->p50_ns = latency_count ? latencies[latency_count / 2] : 0;
+	result->p99_ns = latency_count ? latencies[latency_count * 99 / 100] : 0;
+}
+
+static void report(const struct result *result)
+{
+	double mb_per_s = result->seconds > 0 ? result->bytes / result->seconds / 1e6 : 0;
+	double ops_per_s = result->seconds > 0 ? result->ops / result->seconds : 0;
+
+	if (config.json) {
+		printf("%s\n    {\"workload\": \"%s\", \"size\": %zu, \"ops\": %" PRIu64 ", \"bytes\": %" PRIu64
+		       ", \"seconds\": %.6f, \"mb_per_s\": %.2f, \"ops_per_s\": %.1f, \"p50_ns\": %" PRIu64
+		       ", \"p99_ns\": %" PRIu64 ", \"io_per_op\": %.3f}",
+		       first_result ? "" : ",", result->name, result->size, result->ops, result->bytes, result->seconds,
+		       mb_per_s, ops_per_s, result->p50_ns, result->p99_ns, result->io_per_op);
+	} else {
+		printf("%-14s %8zu %10.2f %12.1f %10" PRIu64 " %10" PRIu64 " %9.3f\n", result->name, result->size,
+		       mb_per_s, ops_per_s, result->p50_ns, result->p99_ns, result->io_per_op);
+	}
+	first_result = 0;
+}
+
+#define TIMED(call)					\
+({							\
+	uint64_t op_start = now_ns();			\
+	int op_ret = (call);				\
+	latencies[latency_count++] = now_ns() - op_start;	\
+	op_ret;						\
+})
+
+/* Workloads */
+
+static void run_rw(size_t size, uint8_t *buf)
+{
+	size_t count = config.file_size / size;
+	struct result result;
+	int fd;
+
+	ASSERT(!fs_create(BENCH_FILE), "fs_create");
+	fd = fs_open(BENCH_FILE);
+	ASSERT(fd >= 0, "fs_open");
+
+	begin();
+	for (size_t i = 0; i < count; i++)
+		ASSERT(TIMED(fs_write(fd, buf, size)) == (int)size, "fs_write");
+	ASSERT(!fs_sync(), "fs_sync");
+	end(&result, "seq_write", size, count * size);
+	report(&result);
+
+	ASSERT(!fs_lseek(fd, 0), "fs_lseek");
+	begin();
+	for (size_t i = 0; i < count; i++)
+		ASSERT(TIMED(fs_read(fd, buf, size)) == (int)size, "fs_read");
+	end(&result, "seq_read", size, count * size);
+	report(&result);
+
+	// Same offsets for both, so that reads hit what was written
+	srand(count);
+	begin();
+	for (size_t i = 0; i < count; i++) {
+		ASSERT(!fs_lseek(fd, (rand() % count) * size), "fs_lseek");
+		ASSERT(TIMED(fs_write(fd, buf, size)) == (int)size, "fs_write");
+	}
+	ASSERT(!fs_sync(), "fs_sync");
+	end(&result, "rand_write", size, count * size);
+	report(&result);
+
+	srand(count);
+	begin();
+	for (size_t i = 0; i < count; i++) {
+		ASSERT(!fs_lseek(fd, (rand() % count) * size), "fs_lseek");
+		ASSERT(TIMED(fs_read(fd, buf, size)) == (int)size, "fs_read");
+	}
+	end(&result, "rand_read", size, count * size);
+	report(&result);
+
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_delete(BENCH_FILE), "fs_delete");
+}
+
+static void run_append(size_t size, uint8_t *buf)
+{
+	size_t count = config.file_size / size;
+	struct result result;
+	int fd;
+
+	ASSERT(!fs_create(BENCH_FILE), "fs_create");
+	fd = fs_open_flags(BENCH_FILE, FS_O_APPEND);
+	ASSERT(fd >= 0, "fs_open_flags");
+
+	begin();
+	for (size_t i = 0; i < count; i++)
+		ASSERT(TIMED(fs_write(fd, buf, size)) == (int)size, "fs_write");
+	ASSERT(!fs_sync(), "fs_sync");
+	end(&result, "append", size, count * size);
+	report(&result);
+
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_delete(BENCH_FILE), "fs_delete");
+}
+
+/*
+ * Same sequential transfers as seq_write and seq_read, through a stream, which
+ * buffers requests smaller than a block
+ */
+static void run_stream(size_t size, uint8_t *buf)
+{
+	size_t count = config.file_size / size;
+	struct fs_stream *stream;
+	struct result result;
+
+	ASSERT(!fs_create(BENCH_FILE), "fs_create");
+	stream = fs_fopen(BENCH_FILE);
+	ASSERT(stream, "fs_fopen");
+
+	begin();
+	for (size_t i = 0; i < count; i++)
+		ASSERT(TIMED(fs_fwrite(stream, buf, size)) == (int)size, "fs_fwrite");
+	ASSERT(!fs_fflush(stream), "fs_fflush");
+	ASSERT(!fs_sync(), "fs_sync");
+	end(&result, "stream_write", size, count * size);
+	report(&result);
+
+	ASSERT(!fs_fseek(stream, 0), "fs_fseek");
+	begin();
+	for (size_t i = 0; i < count; i++)
+		ASSERT(TIMED(fs_fread(stream, buf, size)) == (int)size, "fs_fread");
+	end(&result, "stream_read", size, count * size);
+	report(&result);
+
+	ASSERT(!fs_fclose(stream), "fs_fclose");
+	ASSERT(!fs_delete(BENCH_FILE), "fs_delete");
+}
+
+/*
+ * Files are created, written and deleted in batches, since the root directory
+ * only holds FS_FILE_MAX_COUNT files. Every create and delete is an operation,
+ * timed together with the write for creates.
+ */
+static void run_storm(uint8_t *buf)
+{
+	char name[FS_FILENAME_LEN];
+	struct result result;
+	size_t done = 0;
+
+	begin();
+	while (done < config.ops) {
+		size_t batch = (config.ops - done < STORM_BATCH * 2) ? (config.ops - done + 1) / 2 : STORM_BATCH;
+
+		for (size_t i = 0; i < batch; i++) {
+			snprintf(name, sizeof(name), "storm%zu", i);
+			uint64_t op_start = now_ns();
+			ASSERT(!fs_create(name), "fs_create");
+			int fd = fs_open(name);
+			ASSERT(fd >= 0, "fs_open");
+			ASSERT(fs_write(fd, buf, STORM_FILE_SIZE) == STORM_FILE_SIZE, "fs_write");
+			ASSERT(!fs_close(fd), "fs_close");
+			latencies[latency_count++] = now_ns() - op_start;
+		}
+		for (size_t i = 0; i < batch; i++) {
+			snprintf(name, sizeof(name), "storm%zu", i);
+			ASSERT(!TIMED(fs_delete(name)), "fs_delete");
+		}
+		done += 2 * batch;
+	}
+	ASSERT(!fs_sync(), "fs_sync");
+	end(&result, "create_delete", STORM_FILE_SIZE, latency_count / 2 * STORM_FILE_SIZE);
+	report(&result);
+}
+
+static void run_mount(void)
+{
+	struct result result;
+	size_t cycles = config.ops / 10 ? config.ops / 10 : 1;
+
+	begin();
+	for (size_t i = 0; i < cycles; i++) {
+		ASSERT(!TIMED(fs_umount()), "fs_umount");
+		ASSERT(!TIMED(fs_mount(config.diskname)), "fs_mount");
+	}
+	end(&result, "mount_umount", 0, 0);
+	report(&result);
+}
+
+static int selected(const char *workload)
+{
+	return config.workload == NULL || !strcmp(config.workload, workload);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s <diskimage> [-w workload] [-s size[,size...]] [-f file KiB] [-n ops] [-r]\n"
+		"\t[-l latency us] [-b bandwidth MB/s] [-k seek ns/block] [-j]\n",
+		program);
+	fprintf(stderr, "Workloads are rw (seq_write, seq_read, rand_write, rand_read), append, stream (stream_write, "
+		"stream_read), create_delete and mount_umount, all of them by default\n");
+	fprintf(stderr, "-r runs on a RAM disk loaded from the image, to leave out host I/O\n");
+	fprintf(stderr, "-l, -b and -k simulate slower storage, with a per-I/O latency, a bandwidth limit and a seek "
+		"time per block of distance\n");
+	exit(1);
+}
+
+static void parse_sizes(char *list)
+{
+	config.size_count = 0;
+	for (char *size = strtok(list, ","); size; size = strtok(NULL, ",")) {
+		if (config.size_count == MAX_SIZES)
+			break;
+		config.sizes[config.size_count] = strtoul(size, NULL, 0);
+		if (config.sizes[config.size_count] == 0)
+			usage("fs_bench.x");
+		config.size_count++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t max_ops, max_size = 0;
+	uint8_t *buf;
+	int opt;
+
+	if (argc < 2)
+		usage(argv[0]);
+	config.diskname = argv[1];
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "w:s:f:n:rl:b:k:j")) != -1) {
+		switch (opt) {
+		case 'w':
+			config.workload = optarg;
+			break;
+		case 's':
+			parse_sizes(optarg);
+			break;
+		case 'f':
+			config.file_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'n':
+			config.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			config.ram = 1;
+			break;
+		case 'l':
+			config.sim.latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			config.sim.bandwidth_mb_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			config.sim.seek_ns_per_block = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			config.json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (config.file_size == 0 || config.ops == 0)
+		usage(argv[0]);
+
+	/* Room for the largest request and for the latencies of the longest workload */
+	max_ops = config.ops;
+	for (int i = 0; i < config.size_count; i++) {
+		if (config.sizes[i] > max_size)
+			max_size = config.sizes[i];
+		if (config.file_size / config.sizes[i] > max_ops)
+			max_ops = config.file_size / config.sizes[i];
+	}
+	buf = malloc(max_size > STORM_FILE_SIZE ? max_size : STORM_FILE_SIZE);
+	latencies = malloc((max_ops + 2 * STORM_BATCH) * sizeof(*latencies));
+	ASSERT(buf && latencies, "malloc");
+	memset(buf, 'x', max_size > STORM_FILE_SIZE ? max_size : STORM_FILE_SIZE);
+
+	if (config.ram)
+		ASSERT(!block_disk_set_device(&block_ram_device), "block_disk_set_device");
+	if (config.sim.latency_us || config.sim.bandwidth_mb_s || config.sim.seek_ns_per_block) {
+		config.sim.device = block_disk_device();
+		block_sim_configure(&config.sim);
+		ASSERT(!block_disk_set_device(&block_sim_device), "block_disk_set_device");
+	}
+	ASSERT(!fs_mount(config.diskname), "fs_mount");
+
+	if (config.json)
+		printf("{\n  \"device\": \"%s\",\n  \"file_size\": %zu,\n  \"results\": [",
+		       block_disk_device()->name, config.file_size);
+	else
+		printf("%-14s %8s %10s %12s %10s %10s %9s\n", "workload", "size", "MB/s", "ops/s", "p50_ns", "p99_ns",
+		       "io/op");
+
+	for (int i = 0; i < config.size_count; i++) {
+		if (selected("rw"))
+			run_rw(config.sizes[i], buf);
+		if (selected("append"))
+			run_append(config.sizes[i], buf);
+		if (selected("stream"))
+			run_stream(config.sizes[i], buf);
+	}
+	if (selected("create_delete"))
+		run_storm(buf);
+	if (selected("mount_umount"))
+		run_mount();
+
+	if (config.json)
+		printf("\n  ]\n}\n");
+
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(latencies);
+	free(buf);
+
+	return 0;
+}
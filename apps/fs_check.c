@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_check_report report;
+	int repair, remaining;
+
+	if (argc < 2 || (argc > 2 && strcmp(argv[2], "repair"))) {
+		printf("Usage: %s <diskimage> [repair]\n", argv[0]);
+		exit(1);
+	}
+
+	repair = argc > 2;
+
+	double start = now();
+	remaining = fs_check(argv[1], repair, &report);
+	double elapsed = now() - start;
+
+	if (remaining < 0) {
+		fprintf(stderr, "Function 'fs_check' failed\n");
+		exit(2);
+	}
+
+	printf("FS Check:\n");
+	printf("superblock_errors=%u\n", report.superblock_errors);
+	printf("fat_errors=%u\n", report.fat_errors);
+	printf("entry_errors=%u\n", report.entry_errors);
+	printf("bad_pointers=%u\n", report.bad_pointers);
+	printf("cycles=%u\n", report.cycles);
+	printf("cross_links=%u\n", report.cross_links);
+	printf("short_chains=%u\n", report.short_chains);
+	printf("leaked_blocks=%u\n", report.leaked_blocks);
+	printf("bad_refcounts=%u\n", report.bad_refcounts);
+	printf("repaired=%u\n", report.repaired);
+	printf("remaining=%d\n", remaining);
+	printf("threads=%u\n", report.threads);
+	printf("time=%.3f ms\n", elapsed * 1e3);
+
+	return remaining ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+static void print_stats(const char *title)
+{
+	struct fs_frag_stats stats;
+
+	ASSERT(!fs_frag_stats(&stats), "fs_frag_stats");
+
+	printf("%s:\n", title);
+	printf("files=%u\n", stats.files);
+	printf("fragmented_files=%u\n", stats.fragmented_files);
+	printf("blocks=%u\n", stats.blocks);
+	printf("extents=%u\n", stats.extents);
+	printf("extents_per_file=%.2f\n", stats.files ? (double)stats.extents / stats.files : 0.0);
+	printf("free_blocks=%u\n", stats.free_blocks);
+	printf("free_extents=%u\n", stats.free_extents);
+	printf("largest_free_extent=%u\n", stats.largest_free_extent);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int pass_blocks;
+	int moved, total = 0, passes = 0;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage> [blocks per pass]\n", argv[0]);
+		exit(1);
+	}
+
+	/* Without a pass size, everything is moved in a single pass */
+	pass_blocks = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0;
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+
+	print_stats("Before");
+
+	do {
+		moved = fs_defrag(pass_blocks);
+		ASSERT(moved >= 0, "fs_defrag");
+		if (moved) {
+			total += moved;
+			passes++;
+		}
+	} while (moved && pass_blocks);
+
+	printf("Moved %d blocks in %d passes\n", total, passes);
+
+	print_stats("After");
+
+	ASSERT(!fs_umount(), "fs_umount");
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define SIGNATURE 0x5346303531534345	// 'ECS150FS' in little-endian
+#define FAT_EOC 0xFFFF
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE/2)
+#define DATA_BLK_MAX_COUNT (4 * FAT_ENTRIES_PER_BLOCK)
+
+#define ZERO_BATCH_BLOCKS 256		// Blocks written at once in pre-zero mode
+
+/* Superblock fields, followed by zero padding (see fs.c for the whole format) */
+struct superblock {
+	uint64_t sig;
+	uint16_t total_blk_count;
+	uint16_t rdir_blk;
+	uint16_t data_blk;
+	uint16_t data_blk_count;
+	uint8_t  fat_blk_count;
+}__attribute__((packed));
+
+/*
+ * The image is created at its final size with ftruncate(), so that it is sparse
+ * and every block reads as zeros. Only the superblock and the first FAT block,
+ * whose entry 0 is reserved, hold anything else: they are written together, as
+ * the first two blocks. In pre-zero mode, every block is written beforehand
+ * with large multi-block writes, for an image that is fully allocated.
+ */
+int main(int argc, char *argv[])
+{
+	static uint8_t head[2 * BLOCK_SIZE];
+	struct superblock sb;
+	char *diskname;
+	size_t data_blk_count;
+	int fd, zero;
+
+	if (argc < 3 || (argc > 3 && strcmp(argv[3], "zero")))
+		die("Usage: <diskname> <data block count> [zero]");
+
+	diskname = argv[1];
+	data_blk_count = strtoul(argv[2], NULL, 0);
+	zero = argc > 3;
+
+	if (data_blk_count < 1 || data_blk_count > DATA_BLK_MAX_COUNT)
+		die("data block count invalid, range is [1, %d]", DATA_BLK_MAX_COUNT);
+
+	/* Layout: superblock, FAT, root directory, data blocks */
+	sb.sig = SIGNATURE;
+	sb.fat_blk_count = (data_blk_count + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+	sb.rdir_blk = 1 + sb.fat_blk_count;
+	sb.data_blk = sb.rdir_blk + 1;
+	sb.data_blk_count = data_blk_count;
+	sb.total_blk_count = sb.data_blk + data_blk_count;
+
+	/* Create the (sparse) image, dropping any previous content */
+	if (unlink(diskname) < 0 && access(diskname, F_OK) == 0)
+		die_perror("unlink");
+	fd = open(diskname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		die_perror("open");
+	if (ftruncate(fd, (off_t)sb.total_blk_count * BLOCK_SIZE) < 0)
+		die_perror("ftruncate");
+	if (close(fd) < 0)
+		die_perror("close");
+
+	if (block_disk_open(diskname) < 0)
+		die("Cannot create virtual disk");
+
+	if (zero) {
+		uint8_t *zeros = calloc(ZERO_BATCH_BLOCKS, BLOCK_SIZE);
+		if (!zeros)
+			die_perror("calloc");
+
+		for (size_t block = 0; block < sb.total_blk_count; block += ZERO_BATCH_BLOCKS) {
+			size_t count = sb.total_blk_count - block;
+			if (count > ZERO_BATCH_BLOCKS)
+				count = ZERO_BATCH_BLOCKS;
+			if (block_write_multi(block, count, zeros) < 0)
+				die("Cannot create virtual disk");
+		}
+		free(zeros);
+	}
+
+	/* Superblock and first FAT block */
+	uint16_t fat_eoc = FAT_EOC;
+	memcpy(head, &sb, sizeof(sb));
+	memcpy(&head[BLOCK_SIZE], &fat_eoc, sizeof(fat_eoc));
+	if (block_write_multi(0, 2, head) < 0 || block_disk_close() < 0)
+		die("Cannot create virtual disk");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname, data_blk_count);
+
+	return 0;
+}
@@ -0,0 +1,266 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define fs_runner_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_runner_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define MAX_SCRIPTS 64
+#define MAX_COMMANDS 64			// Different commands aggregated
+#define COMMAND_LEN 16
+
+/* Image and the scripts left to run on it, one at a time */
+struct image {
+	const char *name;
+	int next_script;
+	int busy;
+};
+
+/* Replay of a script on an image by a child test_fs.x */
+struct task {
+	pid_t pid;
+	struct image *image;
+	const char *script;
+	FILE *output;
+};
+
+/* Timing of a command, over every line and every task it appeared in */
+struct command {
+	char name[COMMAND_LEN];
+	uint64_t runs;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static const char *scripts[MAX_SCRIPTS];
+static int script_count;
+static struct image *images;
+static int image_count;
+static const char *test_fs;
+
+static struct command commands[MAX_COMMANDS];
+static int command_count;
+static uint64_t busy_ns, failed;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct command *find_command(const char *name)
+{
+	for (int i = 0; i < command_count; i++) {
+		if (!strcmp(commands[i].name, name))
+			return &commands[i];
+	}
+
+	if (command_count == MAX_COMMANDS)
+		die("Too many different commands");
+	snprintf(commands[command_count].name, COMMAND_LEN, "%s", name);
+
+	return &commands[command_count++];
+}
+
+/* Start a replay, its output going to a temporary file read once it exits */
+static void start_task(struct task *task, struct image *image)
+{
+	task->image = image;
+	task->script = scripts[image->next_script++];
+	task->output = tmpfile();
+	if (!task->output)
+		die_perror("tmpfile");
+	image->busy = 1;
+
+	task->pid = fork();
+	if (task->pid < 0)
+		die_perror("fork");
+
+	if (task->pid == 0) {
+		if (dup2(fileno(task->output), STDOUT_FILENO) < 0)
+			die_perror("dup2");
+		execl(test_fs, test_fs, "replay", image->name, task->script, (char *)NULL);
+		die_perror("execl");
+	}
+}
+
+/* Add the timing report of a replay, see test_fs.c */
+static void collect_task(struct task *task, int status)
+{
+	char line[1024], name[COMMAND_LEN];
+	uint64_t elapsed, runs, avg, max, total;
+	int line_number, timed = 0;
+
+	task->image->busy = 0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fs_runner_error("Replaying '%s' on '%s' failed", task->script, task->image->name);
+		failed++;
+		fclose(task->output);
+		return;
+	}
+
+	rewind(task->output);
+	while (fgets(line, sizeof(line), task->output)) {
+		if (sscanf(line, "elapsed_ns=%" SCNu64, &elapsed) == 1) {
+			busy_ns += elapsed;
+			timed = 1;
+		} else if (sscanf(line, "%d\t%" SCNu64 "\t%" SCNu64 "\t%" SCNu64 "\t%" SCNu64 "\t%15s", &line_number,
+				  &runs, &avg, &max, &total, name) == 6) {
+			struct command *command = find_command(name);
+
+			command->runs += runs;
+			command->total_ns += total;
+			if (max > command->max_ns)
+				command->max_ns = max;
+		}
+	}
+	fclose(task->output);
+
+	if (!timed) {
+		fs_runner_error("No timing from '%s' on '%s'", task->script, task->image->name);
+		failed++;
+	}
+}
+
+/* Next image with scripts left that no task is working on */
+static struct image *next_image(void)
+{
+	for (int i = 0; i < image_count; i++) {
+		if (!images[i].busy && images[i].next_script < script_count)
+			return &images[i];
+	}
+
+	return NULL;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-j workers] [-t test_fs.x] -s script [-s script...] <diskimage>...\n", program);
+	fprintf(stderr, "Every script is replayed on every image, in order, with images in parallel\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct task *tasks;
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t start, wall_ns, runs = 0;
+	int running = 0, task_count = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:t:s:")) != -1) {
+		switch (opt) {
+		case 'j':
+			workers = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			test_fs = optarg;
+			break;
+		case 's':
+			if (script_count == MAX_SCRIPTS)
+				die("Too many scripts");
+			scripts[script_count++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (script_count == 0 || optind == argc || workers < 1)
+		usage(argv[0]);
+
+	/* test_fs.x is next to this program by default */
+	if (!test_fs) {
+		const char *slash = strrchr(argv[0], '/');
+		int dir_len = slash ? slash - argv[0] + 1 : 2;
+		char *path = malloc(dir_len + sizeof("test_fs.x"));
+
+		if (!path)
+			die_perror("malloc");
+		sprintf(path, "%.*stest_fs.x", dir_len, slash ? argv[0] : "./");
+		test_fs = path;
+	}
+
+	image_count = argc - optind;
+	images = calloc(image_count, sizeof(*images));
+	tasks = calloc(workers, sizeof(*tasks));
+	if (!images || !tasks)
+		die_perror("calloc");
+	for (int i = 0; i < image_count; i++)
+		images[i].name = argv[optind + i];
+
+	/* Keep every worker busy with an image, until every script ran on every image */
+	start = now_ns();
+	for (;;) {
+		struct image *image;
+		int status;
+		pid_t pid;
+
+		for (int i = 0; i < workers && (image = next_image()); i++) {
+			if (tasks[i].pid)
+				continue;
+			start_task(&tasks[i], image);
+			running++;
+			task_count++;
+		}
+
+		if (running == 0)
+			break;
+
+		pid = wait(&status);
+		if (pid < 0)
+			die_perror("wait");
+		for (int i = 0; i < workers; i++) {
+			if (tasks[i].pid == pid) {
+				collect_task(&tasks[i], status);
+				tasks[i].pid = 0;
+				running--;
+			}
+		}
+	}
+	wall_ns = now_ns() - start;
+
+	for (int i = 0; i < command_count; i++)
+		runs += commands[i].runs;
+
+	printf("FS Runner:\n");
+	printf("workers=%ld\n", workers);
+	printf("images=%d\n", image_count);
+	printf("tasks=%d\n", task_count);
+	printf("failed=%" PRIu64 "\n", failed);
+	printf("wall_ns=%" PRIu64 "\n", wall_ns);
+	printf("busy_ns=%" PRIu64 "\n", busy_ns);
+	printf("speedup=%.2f\n", wall_ns ? (double)busy_ns / wall_ns : 0.0);
+	printf("commands=%" PRIu64 "\n", runs);
+	printf("commands_per_s=%.1f\n", wall_ns ? runs * 1e9 / wall_ns : 0.0);
+	printf("command\truns\tavg_ns\tmax_ns\n");
+	for (int i = 0; i < command_count; i++) {
+		printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", commands[i].name, commands[i].runs,
+		       commands[i].total_ns / commands[i].runs, commands[i].max_ns);
+	}
+
+	free(tasks);
+	free(images);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define fs_syscount_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_syscount_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define MAX_SYSCALLS 512
+#define MAX_THREADS 64
+
+/* Calls of a system call, and bytes moved by the ones that read or write */
+struct syscall_count {
+	uint64_t calls;
+	uint64_t bytes;
+};
+
+/* Thread of the traced program, between the entry and the exit of its system calls */
+struct thread {
+	pid_t tid;
+	long nr;			// System call entered, -1 if none
+};
+
+static struct syscall_count counts[MAX_SYSCALLS];
+static struct thread threads[MAX_THREADS];
+
+#ifdef __x86_64__
+
+/* System calls worth naming, the others are reported by number */
+static const struct {
+	long nr;
+	const char *name;
+	int moves_bytes;		// Its result is a number of bytes read or written
+} syscall_names[] = {
+	{ SYS_read,		"read",		1 },
+	{ SYS_write,		"write",	1 },
+	{ SYS_pread64,		"pread64",	1 },
+	{ SYS_pwrite64,		"pwrite64",	1 },
+	{ SYS_readv,		"readv",	1 },
+	{ SYS_writev,		"writev",	1 },
+	{ SYS_open,		"open",		0 },
+	{ SYS_openat,		"openat",	0 },
+	{ SYS_close,		"close",	0 },
+	{ SYS_fstat,		"fstat",	0 },
+	{ SYS_newfstatat,	"newfstatat",	0 },
+	{ SYS_lseek,		"lseek",	0 },
+	{ SYS_mmap,		"mmap",		0 },
+	{ SYS_munmap,		"munmap",	0 },
+	{ SYS_mprotect,		"mprotect",	0 },
+	{ SYS_brk,		"brk",		0 },
+	{ SYS_ioctl,		"ioctl",	0 },
+	{ SYS_access,		"access",	0 },
+	{ SYS_execve,		"execve",	0 },
+	{ SYS_fsync,		"fsync",	0 },
+	{ SYS_ftruncate,	"ftruncate",	0 },
+	{ SYS_fallocate,	"fallocate",	0 },
+	{ SYS_clone,		"clone",	0 },
+	{ SYS_futex,		"futex",	0 },
+};
+
+static int syscall_index(long nr)
+{
+	for (size_t i = 0; i < sizeof(syscall_names) / sizeof(syscall_names[0]); i++) {
+		if (syscall_names[i].nr == nr)
+			return i;
+	}
+
+	return -1;
+}
+
+static void syscall_entry(pid_t tid, struct thread *thread)
+{
+	struct user_regs_struct regs;
+
+	if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) < 0)
+		die_perror("ptrace");
+	thread->nr = regs.orig_rax;
+}
+
+static void syscall_exit(pid_t tid, struct thread *thread)
+{
+	struct user_regs_struct regs;
+	int index;
+
+	if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) < 0)
+		die_perror("ptrace");
+
+	if (thread->nr >= 0 && thread->nr < MAX_SYSCALLS) {
+		counts[thread->nr].calls++;
+		index = syscall_index(thread->nr);
+		if (index >= 0 && syscall_names[index].moves_bytes && (long)regs.rax > 0)
+			counts[thread->nr].bytes += regs.rax;
+	}
+	thread->nr = -1;
+}
+
+#else
+
+static int syscall_index(long nr)
+{
+	(void)nr;
+	return -1;
+}
+
+static void syscall_entry(pid_t tid, struct thread *thread)
+{
+	(void)tid;
+	(void)thread;
+	die("System calls can only be counted on x86-64");
+}
+
+static void syscall_exit(pid_t tid, struct thread *thread)
+{
+	syscall_entry(tid, thread);
+}
+
+#endif
+
+static struct thread *find_thread(pid_t tid)
+{
+	for (int i = 0; i < MAX_THREADS; i++) {
+		if (threads[i].tid == tid)
+			return &threads[i];
+	}
+
+	// New thread, in the first free slot
+	for (int i = 0; i < MAX_THREADS; i++) {
+		if (threads[i].tid == 0) {
+			threads[i].tid = tid;
+			threads[i].nr = -1;
+			return &threads[i];
+		}
+	}
+
+	die("Too many threads");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(FILE *out, uint64_t elapsed_ns, int status)
+{
+	uint64_t calls = 0, bytes_read = 0, bytes_written = 0;
+
+	for (int nr = 0; nr < MAX_SYSCALLS; nr++) {
+		int index = syscall_index(nr);
+
+		calls += counts[nr].calls;
+		if (index >= 0 && syscall_names[index].moves_bytes) {
+			if (strstr(syscall_names[index].name, "read"))
+				bytes_read += counts[nr].bytes;
+			else
+				bytes_written += counts[nr].bytes;
+		}
+	}
+
+	fprintf(out, "exit_status=%d\n", status);
+	fprintf(out, "elapsed_ns=%" PRIu64 "\n", elapsed_ns);
+	fprintf(out, "syscalls=%" PRIu64 "\n", calls);
+	fprintf(out, "bytes_read=%" PRIu64 "\n", bytes_read);
+	fprintf(out, "bytes_written=%" PRIu64 "\n", bytes_written);
+	for (int nr = 0; nr < MAX_SYSCALLS; nr++) {
+		int index = syscall_index(nr);
+
+		if (counts[nr].calls == 0)
+			continue;
+		if (index >= 0)
+			fprintf(out, "%s=%" PRIu64 "\n", syscall_names[index].name, counts[nr].calls);
+		else
+			fprintf(out, "syscall_%d=%" PRIu64 "\n", nr, counts[nr].calls);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	FILE *out = stderr;
+	uint64_t start;
+	int status, exit_status = -1;
+	pid_t child;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			optind = argc;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-o report file] <program> [<arg>...]\n", argv[0]);
+		exit(1);
+	}
+
+	if (output && !(out = fopen(output, "w")))
+		die_perror("fopen");
+
+	start = now_ns();
+	child = fork();
+	if (child < 0)
+		die_perror("fork");
+
+	if (child == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			die_perror("ptrace");
+		raise(SIGSTOP);
+		execvp(argv[optind], &argv[optind]);
+		die_perror("execvp");
+	}
+
+	/* Stop at every system call of the program and of its threads */
+	if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status))
+		die("Cannot start tracing");
+	if (ptrace(PTRACE_SETOPTIONS, child, NULL,
+		   PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0)
+		die_perror("ptrace");
+	if (ptrace(PTRACE_SYSCALL, child, NULL, NULL) < 0)
+		die_perror("ptrace");
+
+	for (;;) {
+		pid_t tid = waitpid(-1, &status, __WALL);
+		int signal = 0;
+
+		if (tid < 0) {
+			if (errno == ECHILD)
+				break;
+			die_perror("waitpid");
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == child)
+				exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			find_thread(tid)->tid = 0;
+			continue;
+		}
+
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			struct thread *thread = find_thread(tid);
+
+			if (thread->nr < 0)
+				syscall_entry(tid, thread);
+			else
+				syscall_exit(tid, thread);
+		} else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+			// Signals meant for the program are delivered
+			signal = WSTOPSIG(status);
+		}
+
+		ptrace(PTRACE_SYSCALL, tid, NULL, signal);
+	}
+
+	report(out, now_ns() - start, exit_status);
+	if (output)
+		fclose(out);
+
+	return 0;
+}
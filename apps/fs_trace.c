@@ -0,0 +1,235 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_trace_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define SIGNATURE 0x5346303531534345	// 'ECS150FS' in little-endian
+
+#define HEAT_COLUMNS 64			// Columns of the heat maps
+#define NO_FILE FS_FILE_MAX_COUNT	// Heat map row of the I/O tagged with no file
+
+/* Superblock fields, followed by zero padding (see fs.c for the whole format) */
+struct superblock {
+	uint64_t sig;
+	uint16_t total_blk_count;
+	uint16_t rdir_blk;
+	uint16_t data_blk;
+	uint16_t data_blk_count;
+	uint8_t  fat_blk_count;
+}__attribute__((packed));
+
+/* Root directory entry, whose other fields are not needed here */
+struct file_entry {
+	char     file_name[FS_FILENAME_LEN];
+	uint8_t  unused[16];
+}__attribute__((packed));
+
+/* Image the trace was taken on */
+static struct superblock sb;
+static struct file_entry root_dir[FS_FILE_MAX_COUNT];
+
+/* Figures computed from the trace */
+static uint64_t events, io, blocks_read, blocks_written;
+static uint64_t sequential, seek_distance;
+static uint64_t read_requested, read_moved, write_requested, write_moved;
+static uint64_t heat[FS_FILE_MAX_COUNT + 1][HEAT_COLUMNS];
+
+static void load_image(const char *diskname)
+{
+	static uint8_t buf[BLOCK_SIZE];
+
+	if (block_disk_open(diskname))
+		die("Cannot open disk image '%s'", diskname);
+
+	if (block_read(0, buf))
+		die("Cannot read superblock");
+	memcpy(&sb, buf, sizeof(sb));
+	if (sb.sig != SIGNATURE || sb.total_blk_count == 0)
+		die("Not a file system image");
+
+	if (block_read(sb.rdir_blk, buf))
+		die("Cannot read root directory");
+	memcpy(root_dir, buf, sizeof(root_dir));
+
+	block_disk_close();
+}
+
+static int op_of(const char *name)
+{
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		if (!strcmp(name, fs_stats_op_name(op)))
+			return op;
+	}
+
+	return FS_OP_COUNT;
+}
+
+/*
+ * Sequentiality only looks at the block numbers: an I/O is sequential when it
+ * starts right after the last block of the previous one, whatever their
+ * direction. Moved bytes are charged to the request that caused them, the
+ * writes of the flusher thread being charged to writes.
+ */
+static void account(int op, uint64_t block, uint64_t count, int caller, int file)
+{
+	static uint64_t next_block = UINT64_MAX;
+
+	if (op == FS_OP_READ) {
+		read_requested += count;
+		return;
+	}
+	if (op == FS_OP_WRITE) {
+		write_requested += count;
+		return;
+	}
+
+	io++;
+	if (op == FS_OP_BLOCK_READ || op == FS_OP_BLOCK_READ_MULTI)
+		blocks_read += count;
+	else
+		blocks_written += count;
+
+	if (block == next_block)
+		sequential++;
+	else if (next_block != UINT64_MAX)
+		seek_distance += (block > next_block) ? block - next_block : next_block - block;
+	next_block = block + count;
+
+	if (caller == FS_OP_READ)
+		read_moved += count * BLOCK_SIZE;
+	else if (caller == FS_OP_WRITE || caller == FS_OP_COUNT)
+		write_moved += count * BLOCK_SIZE;
+
+	int row = (file >= 0 && file < FS_FILE_MAX_COUNT) ? file : NO_FILE;
+	for (uint64_t b = block; b < block + count && b < sb.total_blk_count; b++)
+		heat[row][b * HEAT_COLUMNS / sb.total_blk_count]++;
+}
+
+static void load_trace(const char *filename)
+{
+	char line[256], op_name[32], caller_name[32];
+	uint64_t time_ns, block, count;
+	int file;
+	FILE *trace;
+
+	trace = fopen(filename, "r");
+	if (!trace)
+		die_perror("fopen");
+
+	while (fgets(line, sizeof(line), trace)) {
+		if (line[0] == '#') {
+			printf("%s", line + 2);
+			continue;
+		}
+
+		if (sscanf(line, "%" SCNu64 "\t%31s\t%" SCNu64 "\t%" SCNu64 "\t%31s\t%d", &time_ns, op_name, &block,
+			   &count, caller_name, &file) != 6)
+			die("Invalid trace line: %s", line);
+
+		int op = op_of(op_name);
+		if (op == FS_OP_COUNT)
+			die("Unknown operation '%s'", op_name);
+
+		events++;
+		account(op, block, count, op_of(caller_name), file);
+	}
+
+	fclose(trace);
+}
+
+static void print_heat_row(const char *name, const uint64_t *row, uint64_t max)
+{
+	static const char shades[] = " .:-=+*#%@";
+	char cells[HEAT_COLUMNS + 1];
+
+	for (int col = 0; col < HEAT_COLUMNS; col++) {
+		// Any access shows, the densest column gets the darkest shade
+		int shade = row[col] ? 1 + row[col] * (sizeof(shades) - 3) / max : 0;
+		cells[col] = shades[shade];
+	}
+	cells[HEAT_COLUMNS] = '\0';
+
+	printf("%-16s|%s|\n", name, cells);
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+	return b ? (double)a / b : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t max = 0;
+
+	if (argc < 3) {
+		printf("Usage: %s <diskimage> <trace file>\n", argv[0]);
+		exit(1);
+	}
+
+	load_image(argv[1]);
+
+	printf("FS Trace:\n");
+	load_trace(argv[2]);
+
+	printf("events=%" PRIu64 "\n", events);
+	printf("io=%" PRIu64 "\n", io);
+	printf("blocks_read=%" PRIu64 "\n", blocks_read);
+	printf("blocks_written=%" PRIu64 "\n", blocks_written);
+	printf("sequential=%.1f%%\n", 100 * ratio(sequential, io));
+	printf("avg_seek=%.1f\n", ratio(seek_distance, io - sequential - (io > 0)));
+	printf("read_requested=%" PRIu64 "\n", read_requested);
+	printf("read_moved=%" PRIu64 "\n", read_moved);
+	printf("read_amplification=%.2f\n", ratio(read_moved, read_requested));
+	printf("write_requested=%" PRIu64 "\n", write_requested);
+	printf("write_moved=%" PRIu64 "\n", write_moved);
+	printf("write_amplification=%.2f\n", ratio(write_moved, write_requested));
+
+	/* One row per file, one column per range of disk blocks */
+	for (int row = 0; row <= NO_FILE; row++) {
+		for (int col = 0; col < HEAT_COLUMNS; col++) {
+			if (heat[row][col] > max)
+				max = heat[row][col];
+		}
+	}
+
+	printf("Heat map (%u disk blocks, superblock on the left, data from column %u):\n", sb.total_blk_count,
+	       sb.data_blk * HEAT_COLUMNS / sb.total_blk_count);
+	for (int row = 0; row <= NO_FILE; row++) {
+		char name[FS_FILENAME_LEN + 8];
+		int used = 0;
+
+		for (int col = 0; col < HEAT_COLUMNS; col++)
+			used |= heat[row][col] != 0;
+		if (!used)
+			continue;
+
+		if (row == NO_FILE)
+			strcpy(name, "(no file)");
+		else if (root_dir[row].file_name[0])
+			snprintf(name, sizeof(name), "%.*s", FS_FILENAME_LEN - 1, root_dir[row].file_name);
+		else
+			snprintf(name, sizeof(name), "#%d", row);
+		print_heat_row(name, heat[row], max);
+	}
+
+	return 0;
+}
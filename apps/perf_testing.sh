@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# ./perf_testing.sh <command> <diskname> <...>
+#
+# Runs a command of test_fs.x with fs_ref.x and test_fs.x on copies of the same
+# disk, and reports side by side the best wall-clock time out of $RUNS runs
+# (5 by default), the system calls made and the bytes read and written. The
+# disk images they leave are compared as in testing.sh.
+
+disk=$2
+runs=${RUNS:-5}
+
+if [ "$#" -lt 2 ]; then
+	printf "Usage: <command> <diskname> <...>\n"
+	printf "Possible commands are those of testing.sh\n"
+	exit 1
+fi
+
+# measure <binary> <suffix>: leaves the disk image and the system call counts
+# in ${disk}_<suffix> and ${disk}_<suffix>.count, and the best time in $best_us
+measure() {
+	local binary=$1 image="${disk}_$2"
+	local start end elapsed
+
+	best_us=
+	for ((run = 0; run < runs; run++)); do
+		cp "$disk" "$image"
+		start=$(date +%s%N)
+		$binary $command "$image" "${args[@]}" > /dev/null 2>&1
+		end=$(date +%s%N)
+		elapsed=$(( (end - start) / 1000 ))
+		if [ -z "$best_us" ] || [ "$elapsed" -lt "$best_us" ]; then
+			best_us=$elapsed
+		fi
+	done
+
+	cp "$disk" "$image"
+	./fs_syscount.x -o "${image}.count" $binary $command "$image" "${args[@]}" > /dev/null 2>&1
+}
+
+command=$1
+args=("${@:3}")
+
+declare -A ref cur
+
+measure ./fs_ref.x REF
+ref[wall_us]=$best_us
+measure ./test_fs.x CUR
+cur[wall_us]=$best_us
+
+while IFS='=' read -r key value; do ref[$key]=$value; done < "${disk}_REF.count"
+while IFS='=' read -r key value; do cur[$key]=$value; done < "${disk}_CUR.count"
+
+# Totals first, then every system call either of them made
+keys="wall_us syscalls bytes_read bytes_written"
+keys+=" $(cut -d= -f1 "${disk}_REF.count" "${disk}_CUR.count" | sort -u |
+	grep -v -x -e exit_status -e elapsed_ns -e syscalls -e bytes_read -e bytes_written | tr '\n' ' ')"
+
+printf "%-16s %14s %14s\n" "" "fs_ref" "current"
+for key in $keys; do
+	printf "%-16s %14s %14s\n" "$key" "${ref[$key]:-0}" "${cur[$key]:-0}"
+done
+
+if cmp -s "${disk}_REF" "${disk}_CUR"; then
+	printf "\nImages are identical\n"
+else
+	printf "\n** DIFF REF CUR **\n"
+	cmp -b "${disk}_REF" "${disk}_CUR"
+fi
+
+rm "${disk}_REF" "${disk}_REF.count"
+rm "${disk}_CUR" "${disk}_CUR.count"
@@ -0,0 +1,168 @@
+#!/bin/bash
+
+# ./regression.sh [<script>...]
+#
+# Runs each regression script (all of them by default) with test_fs.x on a
+# freshly made disk. A script passes if it runs to its end, if every read
+# compares correctly, and if fs_check.x then finds the image consistent. Run on
+# a RAM disk, each script must then leave the same image.
+# test_share.x also checks deduplication and fs_copy_range() against the
+# expected content of every file, test_stream.x checks that streams read and
+# write the same data as descriptors, and test_dir.x checks the listing of the
+# root directory and batches of creations and deletions. Last, fs_check.x must
+# find and repair a cycle, a cross-link and a leaked block written into the FAT
+# of a disk, and the damage left by crashes while writing the FAT and the root
+# directory.
+
+blocks=256
+disk=$(mktemp -u /tmp/regression.XXXXXX.fs)
+failed=0
+
+if [ "$#" -gt 0 ]; then
+	scripts=("$@")
+else
+	scripts=(scripts/sparse.script scripts/clone.script
+		 scripts/compress.script scripts/fallocate.script
+		 scripts/append.script scripts/defrag.script
+		 scripts/copy.script)
+fi
+
+# run <name> <command> <args...>: runs the command on a fresh disk, which
+# must then pass fs_check.x
+run() {
+	local name=$1 output
+	shift
+
+	rm -f "$disk"
+	./fs_make.x "$disk" $blocks > /dev/null || exit 1
+
+	if ! output=$("$@" 2>&1) || grep -q "unexpected" <<< "$output"; then
+		printf "FAIL\t%s\n" "$name"
+		grep -v "successful\|Compared\|^Wrote" <<< "$output"
+		failed=1
+	elif ! output=$(./fs_check.x "$disk" 2>&1); then
+		printf "FAIL\t%s (fs_check)\n" "$name"
+		printf "%s\n" "$output"
+		failed=1
+	else
+		printf "PASS\t%s\n" "$name"
+	fi
+}
+
+# run_ram <script>: runs the script on a RAM disk as well, whose image saved at
+# unmount must be the same as the one written in place
+run_ram() {
+	local script=$1 output
+
+	rm -f "$disk" "$disk.ram"
+	./fs_make.x "$disk" $blocks > /dev/null || exit 1
+	cp "$disk" "$disk.ram"
+
+	./test_fs.x script "$disk" "$script" > /dev/null 2>&1
+	if ! output=$(./test_fs.x ram "$disk.ram" "$script" 2>&1) || grep -q "unexpected" <<< "$output"; then
+		printf "FAIL\t%s (RAM disk)\n" "$script"
+		grep -v "successful\|Compared\|^Wrote" <<< "$output"
+		failed=1
+	elif ! cmp -s "$disk" "$disk.ram"; then
+		printf "FAIL\t%s (RAM disk image differs)\n" "$script"
+		failed=1
+	else
+		printf "PASS\t%s (RAM disk)\n" "$script"
+	fi
+}
+
+# run_crash <block> <bytes>: cuts the power while fsck_write.script writes the
+# block, of which only the first bytes reach the disk. fs_check.x must find the
+# damage, then repair it into an image that it finds consistent and that mounts.
+run_crash() {
+	local name="crash (block $1, $2 bytes)" output
+
+	rm -f "$disk"
+	./fs_make.x "$disk" $blocks > /dev/null || exit 1
+
+	output=$(./test_fs.x crash "$disk" scripts/fsck_write.script "$1" "$2" 2>&1)
+	if ! grep -q "^Crashed writing block $1," <<< "$output"; then
+		printf "FAIL\t%s\n" "$name"
+		printf "%s\n" "$output"
+		failed=1
+	elif ./fs_check.x "$disk" > /dev/null 2>&1 || [ $? -ne 1 ]; then
+		printf "FAIL\t%s (nothing found)\n" "$name"
+		failed=1
+	elif ! output=$(./fs_check.x "$disk" repair 2>&1) || ! output=$(./fs_check.x "$disk" 2>&1) ||
+	     ! output=$(./test_fs.x ls "$disk" 2>&1); then
+		printf "FAIL\t%s (repair)\n" "$name"
+		printf "%s\n" "$output"
+		failed=1
+	else
+		printf "PASS\t%s\n" "$name"
+	fi
+}
+
+# set_fat <block> <value>: overwrites the FAT entry of a data block
+set_fat() {
+	printf "$(printf '\\x%02x\\x%02x' $(($2 & 0xFF)) $(($2 >> 8)))" |
+		dd of="$disk" bs=1 seek=$((4096 + 2 * $1)) conv=notrunc status=none
+}
+
+# get_fat <block>: prints the FAT entry of a data block
+get_fat() {
+	od -An -tu2 --endian=little -j $((4096 + 2 * $1)) -N2 "$disk" | tr -d ' '
+}
+
+# The files of fsck_write.script get the first data blocks: 'loop' has blocks
+# 1 to 3, 'left' 4 and 5, 'right' 6 and 7
+run_fsck() {
+	local output
+
+	rm -f "$disk"
+	./fs_make.x "$disk" $blocks > /dev/null || exit 1
+	./test_fs.x script "$disk" scripts/fsck_write.script > /dev/null || exit 1
+
+	set_fat 3 1		# 'loop' goes back to its first block
+	set_fat 5 6		# 'left' goes on into 'right'
+	set_fat 40 0xFFFF	# Used, but in no chain
+
+	output=$(./fs_check.x "$disk" 2>&1)
+	if [ $? -ne 1 ] || ! grep -q "^cycles=1$" <<< "$output" ||
+	   ! grep -q "^cross_links=1$" <<< "$output" || ! grep -q "^leaked_blocks=1$" <<< "$output"; then
+		printf "FAIL\tfs_check (finding)\n"
+		printf "%s\n" "$output"
+		failed=1
+	elif ! output=$(./fs_check.x "$disk" repair 2>&1) || ! output=$(./fs_check.x "$disk" 2>&1); then
+		printf "FAIL\tfs_check (repair)\n"
+		printf "%s\n" "$output"
+		failed=1
+	# 'left' is listed before 'right' in the root directory, so it keeps the
+	# cross-linked blocks 6 and 7 while 'right' is emptied
+	elif ! output=$(./test_fs.x ls "$disk" 2>&1) ||
+	     ! grep -q "^file: right, size: 0, data_blk: 65535$" <<< "$output" ||
+	     [ "$(get_fat 5) $(get_fat 6) $(get_fat 7)" != "6 7 65535" ]; then
+		printf "FAIL\tfs_check (cross-link)\n"
+		printf "%s\n" "$output"
+		failed=1
+	elif ! output=$(./test_fs.x script "$disk" scripts/fsck_read.script 2>&1) ||
+	     grep -q "unexpected" <<< "$output"; then
+		printf "FAIL\tfs_check (data)\n"
+		grep -v "successful\|Compared" <<< "$output"
+		failed=1
+	else
+		printf "PASS\tfs_check\n"
+	fi
+}
+
+for script in "${scripts[@]}"; do
+	run "$script" ./test_fs.x script "$disk" "$script"
+	run_ram "$script"
+done
+if [ "$#" -eq 0 ]; then
+	run test_share.x ./test_share.x "$disk"
+	run test_stream.x ./test_stream.x "$disk"
+	run test_dir.x ./test_dir.x "$disk"
+	run_fsck
+	# With 256 blocks, the FAT takes block 1 and the root directory block 2
+	run_crash 1 100
+	run_crash 2 20
+fi
+
+rm -f "$disk" "$disk.ram"
+exit $failed
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define FAT_EOC 0xFFFF
+
+static struct fs_dirent list[FS_FILE_MAX_COUNT];
+
+/* The root directory must hold exactly the files named, in this order */
+static void check_list(const char **names, int count)
+{
+	ASSERT(fs_list(list, FS_FILE_MAX_COUNT) == count, "fs_list");
+	for (int i = 0; i < count; i++) {
+		if (strcmp(list[i].name, names[i])) {
+			fprintf(stderr, "File %d is '%s' instead of '%s'\n", i, list[i].name, names[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Files are listed in root directory order, with their size and chain */
+static void test_list(void)
+{
+	const char *names[] = { "empty", "small", "large" };
+	char buf[2 * BLOCK_SIZE + 1] = { 0 };
+	int fd;
+
+	ASSERT(fs_list(list, FS_FILE_MAX_COUNT) == 0, "fs_list");
+	ASSERT(fs_list(NULL, 0) == 0, "fs_list");
+	ASSERT(fs_list(NULL, 1) == -1, "fs_list");
+
+	for (int i = 0; i < 3; i++)
+		ASSERT(!fs_create(names[i]), "fs_create");
+	fd = fs_open("small");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, buf, 10) == 10, "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+	fd = fs_open("large");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_write(fd, buf, sizeof(buf)) == sizeof(buf), "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	check_list(names, 3);
+	ASSERT(list[0].size == 0 && list[0].data_blk == FAT_EOC && list[0].blocks == 0, "fs_list empty");
+	ASSERT(list[1].size == 10 && list[1].data_blk != FAT_EOC && list[1].blocks == 1, "fs_list small");
+	ASSERT(list[2].size == sizeof(buf) && list[2].blocks == 3, "fs_list large");
+
+	// Only as many entries as asked for, the first ones
+	memset(list, 0, sizeof(list));
+	ASSERT(fs_list(list, 2) == 2, "fs_list");
+	ASSERT(!strcmp(list[1].name, "small") && list[2].name[0] == '\0', "fs_list max");
+
+	// A deleted file leaves its slot, which the next file takes
+	ASSERT(!fs_delete("empty"), "fs_delete");
+	check_list(names + 1, 2);
+	ASSERT(!fs_create("new"), "fs_create");
+	names[0] = "new";
+	check_list(names, 3);
+}
+
+static void check_status(const int *status, const int *expected, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (status[i] != expected[i]) {
+			fprintf(stderr, "Name %zu got status %d instead of %d\n", i, status[i], expected[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Names that fail leave the others alone, and each gets its own status */
+static void test_many(void)
+{
+	static char names[FS_FILE_MAX_COUNT + 2][FS_FILENAME_LEN];
+	const char *filenames[FS_FILE_MAX_COUNT + 2];
+	const char *create[] = { "one", "two", "one", "", "name_is_too_long", NULL, "three" };
+	const int create_status[] = { 0, 0, -1, -1, -1, -1, 0 };
+	const char *remove[] = { "two", "none", "one", "one", "three", NULL };
+	const int remove_status[] = { 0, -1, -1, -1, 0, -1 };
+	const char *listed[FS_FILE_MAX_COUNT];
+	int status[FS_FILE_MAX_COUNT + 2], fd;
+	size_t count;
+
+	ASSERT(fs_create_many(NULL, 0, NULL) == 0, "fs_create_many");
+	ASSERT(fs_create_many(NULL, 1, NULL) == -1, "fs_create_many");
+	ASSERT(fs_delete_many(NULL, 1, NULL) == -1, "fs_delete_many");
+
+	/* Duplicates, in the directory or in the batch, and invalid names */
+	ASSERT(fs_create_many(create, 7, status) == 3, "fs_create_many");
+	check_status(status, create_status, 7);
+	check_list((const char *[]){ "new", "small", "large", "one", "two", "three" }, 6);
+
+	/* The root directory fills up in the middle of the batch */
+	count = FS_FILE_MAX_COUNT - 6 + 2;
+	for (size_t i = 0; i < count; i++) {
+		snprintf(names[i], FS_FILENAME_LEN, "file%zu", i);
+		filenames[i] = names[i];
+	}
+	ASSERT(fs_create_many(filenames, count, status) == (int)count - 2, "fs_create_many");
+	for (size_t i = 0; i < count; i++)
+		ASSERT(status[i] == ((i < count - 2) ? 0 : -1), "fs_create_many full");
+	ASSERT(fs_list(list, FS_FILE_MAX_COUNT) == FS_FILE_MAX_COUNT, "fs_list");
+	ASSERT(!strcmp(list[6].name, "file0") && !strcmp(list[FS_FILE_MAX_COUNT - 1].name, names[count - 3]),
+	       "fs_create_many order");
+
+	/* Missing files, files deleted earlier in the batch and open files */
+	fd = fs_open("one");
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_delete_many(remove, 6, status) == 2, "fs_delete_many");
+	check_status(status, remove_status, 6);
+	ASSERT(!fs_close(fd), "fs_close");
+
+	/* New files take the first free slots */
+	ASSERT(fs_create_many((const char *[]){ "five", "four" }, 2, NULL) == 2, "fs_create_many");
+	listed[0] = "new";
+	listed[1] = "small";
+	listed[2] = "large";
+	listed[3] = "one";
+	listed[4] = "five";
+	listed[5] = "four";
+	for (size_t i = 0; i < count - 2; i++)
+		listed[6 + i] = names[i];
+	check_list(listed, FS_FILE_MAX_COUNT);
+
+	/* Everything goes, and the blocks of the files are freed */
+	ASSERT(fs_delete_many(listed, FS_FILE_MAX_COUNT, status) == FS_FILE_MAX_COUNT, "fs_delete_many");
+	ASSERT(fs_list(list, FS_FILE_MAX_COUNT) == 0, "fs_list");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_check_report report;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		printf("The disk image should be freshly made\n");
+		exit(1);
+	}
+
+	ASSERT(fs_list(list, FS_FILE_MAX_COUNT) == -1, "fs_list");
+	ASSERT(fs_create_many((const char *[]){ "file" }, 1, NULL) == -1, "fs_create_many");
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	test_list();
+	test_many();
+	ASSERT(!fs_umount(), "fs_umount");
+
+	ASSERT(fs_check(argv[1], 0, &report) == 0, "fs_check");
+	printf("Directory operations are correct\n");
+
+	return 0;
+}
@@ -1,14 +1,19 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,239 +39,615 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+#define SCRIPT_PARTS 5			// Command and arguments of a script line
+#define SCRIPT_MAX_DEPTH 16		// Nesting of REPEAT blocks
+#define SCRIPT_NAME_LEN 32		// Length of descriptor names
+
+/* Line of a script, split into its tab-separated parts */
+struct script_line {
+	char *text;
+	char *args[SCRIPT_PARTS];
+	/* Time spent running the line */
+	uint64_t runs;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+/* Descriptor opened by a script, named so that several can be used at once */
+struct script_fd {
+	char name[SCRIPT_NAME_LEN];
+	int fd;
+};
+
+/* Script being run */
+struct script {
+	const char *diskname;
+	struct script_line *lines;
+	int line_count;
+	char mounted;
+	struct script_fd fds[FS_OPEN_MAX_COUNT];
+	int current;			// Index in fds of the descriptor used, -1 if none
+	int timing;			// Time every line and only report errors
+	uint64_t start_ns;		// Time the script started
+	uint64_t random_state;		// Generator of RANDOM data
+	char *scratch;			// Buffer of synthetic data
+	size_t scratch_size;
+};
+
+/* Report the outcome of a command, unless the script is timed */
+#define say(script, ...)			\
+do {							\
+	if (!(script)->timing)		\
+		printf(__VA_ARGS__);	\
+} while (0)
+
+static uint64_t now_ns(void)
 {
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+	struct timespec ts;
 
-	char line_buffer[1024];
-	int command_index = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* The script ends with its first empty line */
+static void load_script(struct script *script, const char *filename)
+{
+	char line_buffer[1024];
+	FILE *fd_script;
+	int capacity = 0;
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
+	fd_script = fopen(filename, "r");
 	if (!fd_script)
 		die_perror("fopen");
 
-	int fs_fd = -1;
+	while (fgets(line_buffer, sizeof(line_buffer), fd_script) != NULL) {
+		struct script_line *line;
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
+		if (script->line_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			script->lines = realloc(script->lines, capacity * sizeof(*script->lines));
+			if (!script->lines)
+				die_perror("realloc");
+		}
+		line = &script->lines[script->line_count];
+		memset(line, 0, sizeof(*line));
+
 		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+		line->text = strdup(line_buffer);
+		if (!line->text)
+			die_perror("strdup");
+		line->args[0] = strtok(line_buffer, "\t");
+		if (!line->args[0]) {
+			free(line->text);
+			break;
+		}
+		for (int i = 1; i < SCRIPT_PARTS && line->args[i - 1]; i++)
+			line->args[i] = strtok(NULL, "\t");
+
+		/* Keep the parts beyond the line buffer */
+		for (int i = 0; i < SCRIPT_PARTS && line->args[i]; i++) {
+			line->args[i] = strdup(line->args[i]);
+			if (!line->args[i])
+				die_perror("strdup");
+		}
+		script->line_count++;
+	}
 
-		int data_fd;
-		int count, data_size;
+	fclose(fd_script);
+}
 
-		char *read_buf;
+static void free_script(struct script *script)
+{
+	for (int i = 0; i < script->line_count; i++) {
+		free(script->lines[i].text);
+		for (int j = 0; j < SCRIPT_PARTS; j++)
+			free(script->lines[i].args[j]);
+	}
+	free(script->lines);
+	free(script->scratch);
+}
 
-		/* End when no command present */
-		if (!command)
-			break;
+/* Slots without a name are free, an empty @name finds one */
+static int find_fd(struct script *script, const char *name)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (!strcmp(script->fds[i].name, name))
+			return i;
+	}
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+	return -1;
+}
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
+/* Bytes of a ZERO or RANDOM data source, in a buffer reused by every command */
+static char *synthetic_data(struct script *script, const char *source, size_t size)
+{
+	if (size + 1 > script->scratch_size) {
+		free(script->scratch);
+		script->scratch_size = size + 1;
+		script->scratch = malloc(script->scratch_size);
+		if (!script->scratch) {
+			fs_umount();
+			die_perror("malloc");
+		}
+	}
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+	if (!strcmp(source, "ZERO")) {
+		memset(script->scratch, 0, size);
+	} else {
+		// xorshift64, carrying on from one command to the next so that writes differ
+		for (size_t i = 0; i < size; i++) {
+			script->random_state ^= script->random_state << 13;
+			script->random_state ^= script->random_state >> 7;
+			script->random_state ^= script->random_state << 17;
+			script->scratch[i] = script->random_state;
+		}
+	}
+	script->scratch[size] = '\0';
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+	return script->scratch;
+}
 
-			printf("CREATE successful.\n");
+static void run_command(struct script *script, char **command_args)
+{
+	struct stat st;
+	char *command, *data_source, *data_description, *data, *fs_filename;
+	int offset;
+	int data_fd;
+	int count, data_size;
+	char *read_buf;
+	int fs_fd = script->current >= 0 ? script->fds[script->current].fd : -1;
+
+	command = command_args[0];
+
+	if (strcmp(command, "MOUNT") == 0) {
+		if (fs_mount(script->diskname))
+			die("Cannot mount disk");
+		else {
+			say(script, "MOUNT successful.\n");
+			script->mounted = 1;
+		}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+	} else if (strcmp(command, "UMOUNT") == 0) {
+		if (script->mounted && fs_umount())
+			die("Cannot unmount");
+		else {
+			say(script, "UMOUNT successful.\n");
+			script->mounted = 0;
+		}
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+	} else if (strcmp(command, "CREATE") == 0) {
+		fs_filename = command_args[1];
 
-			printf("DELETE successful.\n");
+		if(fs_create(fs_filename)) {
+			fs_umount();
+			die("Cannot create file");
+		}
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+		say(script, "CREATE successful.\n");
 
-			fs_fd = fs_open(fs_filename);
+	} else if (strcmp(command, "DELETE") == 0) {
+		fs_filename = command_args[1];
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+		if(fs_delete(fs_filename)) {
+			fs_umount();
+			die("Cannot delete file");
+		}
 
-			printf("OPEN successful.\n");
+		say(script, "DELETE successful.\n");
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+	} else if (strcmp(command, "COMPRESS") == 0) {
+		fs_filename = command_args[1];
 
-			printf("CLOSE successful.\n");
+		if(fs_set_compression(fs_filename, 1)) {
+			fs_umount();
+			die("Cannot compress file");
+		}
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+		say(script, "COMPRESS successful.\n");
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+	} else if (strcmp(command, "CLONE") == 0) {
+		if(fs_clone(command_args[1], command_args[2])) {
+			fs_umount();
+			die("Cannot clone file");
+		}
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
+		say(script, "CLONE successful.\n");
+
+	} else if (strcmp(command, "OPEN") == 0) {
+		const char *name;
+		int flags = 0, slot;
+
+		fs_filename = command_args[1];
+		name = command_args[2] ? command_args[2] : fs_filename;
+		if ((command_args[2] && !strcmp(command_args[2], "APPEND"))
+		    || (command_args[3] && !strcmp(command_args[3], "APPEND"))) {
+			flags = FS_O_APPEND;
+			if (!strcmp(name, "APPEND"))
+				name = fs_filename;
+		}
+		if (!name || strlen(name) >= SCRIPT_NAME_LEN) {
+			fs_umount();
+			die("Invalid descriptor name");
+		}
+
+		fs_fd = fs_open_flags(fs_filename, flags);
+
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
 
-			if (!data) {
+		/* The name now designates the new descriptor, which becomes the one used */
+		slot = find_fd(script, name);
+		if (slot < 0)
+			slot = find_fd(script, "");
+		if (slot < 0) {
+			fs_umount();
+			die("Too many descriptors");
+		}
+		strcpy(script->fds[slot].name, name);
+		script->fds[slot].fd = fs_fd;
+		script->current = slot;
+
+		say(script, "OPEN successful.\n");
+
+	} else if (strcmp(command, "USE") == 0) {
+		int slot = command_args[1] ? find_fd(script, command_args[1]) : -1;
+
+		if (slot < 0 || !command_args[1][0]) {
+			fs_umount();
+			die("No descriptor named %s", command_args[1] ? command_args[1] : "");
+		}
+		script->current = slot;
+
+	} else if (strcmp(command, "CLOSE") == 0) {
+		int slot = command_args[1] ? find_fd(script, command_args[1]) : script->current;
+
+		if (slot >= 0)
+			fs_fd = script->fds[slot].fd;
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+
+		// Commands without a descriptor keep using the closed one, and fail
+		if (slot >= 0)
+			script->fds[slot].name[0] = '\0';
+
+		say(script, "CLOSE successful.\n");
+
+	} else if (strcmp(command, "SEEK") == 0) {
+		offset = atoi(command_args[1]);
+
+		if (fs_lseek(fs_fd, offset)) {
+			fs_umount();
+			die("Cannot seek to position");
+		} else {
+			say(script, "SEEK successful.\n");
+		}
+
+	} else if (strcmp(command, "TRUNCATE") == 0) {
+		if (fs_truncate(fs_fd, atoi(command_args[1]))) {
+			fs_umount();
+			die("Cannot truncate file");
+		}
+
+		say(script, "TRUNCATE successful.\n");
+
+	} else if (strcmp(command, "FALLOCATE") == 0) {
+		if (fs_fallocate(fs_fd, atoi(command_args[1]))) {
+			fs_umount();
+			die("Cannot reserve space");
+		}
+
+		say(script, "FALLOCATE successful.\n");
+
+	} else if (strcmp(command, "COPY") == 0) {
+		int slot = command_args[1] ? find_fd(script, command_args[1]) : -1;
+
+		if (slot < 0 || !command_args[1][0] || !command_args[4]) {
+			fs_umount();
+			die("Usage: COPY <name> <offset_in> <offset_out> <len>");
+		}
+
+		count = fs_copy_range(script->fds[slot].fd, get_argv(command_args[2]), fs_fd,
+				      get_argv(command_args[3]), get_argv(command_args[4]));
+		if (count < 0) {
+			fs_umount();
+			die("Cannot copy range");
+		}
+
+		say(script, "Copied %d bytes.\n", count);
+
+	} else if (strcmp(command, "DEFRAG") == 0) {
+		count = fs_defrag(atoi(command_args[1]));
+		if (count < 0) {
+			fs_umount();
+			die("Cannot defragment");
+		}
+
+		say(script, "Moved %d blocks.\n", count);
+
+	} else if (strcmp(command, "AT") == 0) {
+		uint64_t deadline = script->start_ns + get_argv(command_args[1]) * 1000;
+		uint64_t now = now_ns();
+
+		/* Wait for the time the command after was recorded at */
+		if (deadline > now) {
+			struct timespec ts = {
+				.tv_sec = (deadline - now) / 1000000000,
+				.tv_nsec = (deadline - now) % 1000000000,
+			};
+			nanosleep(&ts, NULL);
+		}
+
+	} else if (strcmp(command, "WRITE") == 0) {
+		data_source = command_args[1];
+		data_description = command_args[2];
+		data_fd = -1;
+
+		if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0) {
 				fs_umount();
-				die_perror("Could not find data to write");
+				die_perror("open");
 			}
-
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
+			if (fstat(data_fd, &st)) {
 				fs_umount();
-				die("write error");
+				die_perror("fstat");
 			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
+			if (!S_ISREG(st.st_mode)) {
 				fs_umount();
-				die("Invalid data description");
+				die("Not a regular file: %s\n", data_description);
 			}
+			data_size = st.st_size;
+			data = data_size ? mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0) : "";
+			if (data == MAP_FAILED)
+				data = NULL;
+		} else if (strcmp(data_source, "ZERO") == 0 || strcmp(data_source, "RANDOM") == 0) {
+			data_size = get_argv(data_description);
+			data = synthetic_data(script, data_source, data_size);
+		} else {
+			data = NULL;
+			data_size = 0;
+		}
 
-			if (!data) {
+		if (!data) {
+			fs_umount();
+			die_perror("Could not find data to write");
+		}
+
+		count = fs_write(fs_fd, data, data_size);
+		if (count < 0) {
+			fs_umount();
+			die("write error");
+		}
+		say(script, "Wrote %d bytes to file.\n", count);
+
+		if (data_fd >= 0) {
+			if (data_size)
+				munmap(data, data_size);
+			close(data_fd);
+		}
+
+	} else if (strcmp(command, "READ") == 0) {
+		int read_req_length = atoi(command_args[1]);
+		data_source = command_args[2];
+		data_description = command_args[3];
+
+		char file_loaded = 0;
+
+		if (read_req_length < 0) {
+			fs_umount();
+			die("invalid data read length");
+		}
+
+		if (!data_source) {
+			/* Only read, as when replaying a recording */
+			data = NULL;
+			data_size = 0;
+		} else if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0) {
 				fs_umount();
-				die_perror("Could not find data to write");
+				die_perror("open");
 			}
-
-			if (read_req_length < 0) {
+			if (fstat(data_fd, &st)) {
 				fs_umount();
-				die("invalid data read length");
+				die_perror("fstat");
 			}
+			if (!S_ISREG(st.st_mode)) {
+				fs_umount();
+				die("Not a regular file: %s\n", data_description);
+			}
+			close(data_fd);
+
+			FILE *data_file = fopen(data_description, "r");
+			data_size = st.st_size;
+			data = calloc(data_size+1, sizeof(char));
+			size_t n = fread (data, sizeof(char), data_size, data_file);
+			assert(n == sizeof(char) * data_size);
+			fclose(data_file);
+			file_loaded = 1;
+		} else if (strcmp(data_source, "ZERO") == 0) {
+			data_size = read_req_length;
+			data = synthetic_data(script, data_source, data_size);
+		} else {
+			fs_umount();
+			die("Invalid data description");
+		}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+		if (data_source && !data) {
+			fs_umount();
+			die_perror("Could not find data to write");
+		}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
+		read_buf = calloc(read_req_length+1, sizeof(char));
+		count = fs_read(fs_fd, read_buf, read_req_length);
+
+		if (count < 0) {
+			fs_umount();
+			die("read error");
+		}
+
+		// both data and read_buf were allocated with an extra zero byte
+		// +1 here to check for the canaries
+		if (!data_source)
+			say(script, "Read %d bytes from file.\n", count);
+		else if (memcmp(data, read_buf, data_size+1) == 0)
+			say(script, "Read %d bytes from file. Compared %d correct.\n", count, data_size);
+		else
+			printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+		free(read_buf);
+		if(file_loaded){
+			free(data);
+		}
+	}
+}
+
+/* Time spent on every line of the script, with the text of the line */
+static void report_timing(struct script *script)
+{
+	printf("FS Replay:\n");
+	printf("elapsed_ns=%" PRIu64 "\n", now_ns() - script->start_ns);
+	printf("line\truns\tavg_ns\tmax_ns\ttotal_ns\tcommand\n");
+	for (int i = 0; i < script->line_count; i++) {
+		struct script_line *line = &script->lines[i];
+
+		if (line->runs == 0)
+			continue;
+
+		for (char *tab = strchr(line->text, '\t'); tab; tab = strchr(tab, '\t'))
+			*tab = ' ';
+		printf("%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n", i + 1, line->runs,
+		       line->total_ns / line->runs, line->max_ns, line->total_ns, line->text);
+	}
+}
+
+static void run_script(const char *diskname, const char *filename, int timing)
+{
+	struct script script = {
+		.diskname = diskname,
+		.current = -1,
+		.timing = timing,
+		.random_state = 0x9e3779b97f4a7c15,
+	};
+	struct {
+		int start;			// First line of the block
+		size_t remaining;		// Runs of the block left
+	} loops[SCRIPT_MAX_DEPTH];
+	int depth = 0;
+
+	load_script(&script, filename);
+	script.start_ns = now_ns();
+
+	/* Execute the lines of the script, going back to the start of blocks being repeated */
+	for (int pc = 0; pc < script.line_count;) {
+		struct script_line *line = &script.lines[pc];
+
+		if (strcmp(line->args[0], "REPEAT") == 0) {
+			size_t runs = line->args[1] ? get_argv(line->args[1]) : 0;
+
+			if (depth == SCRIPT_MAX_DEPTH)
+				die("Too many nested REPEAT blocks");
+
+			if (runs > 0) {
+				loops[depth].start = pc + 1;
+				loops[depth].remaining = runs;
+				depth++;
+				pc++;
+				continue;
 			}
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+			/* Skip the block */
+			for (int nested = 0; ++pc < script.line_count;) {
+				if (strcmp(script.lines[pc].args[0], "REPEAT") == 0)
+					nested++;
+				else if (strcmp(script.lines[pc].args[0], "END") == 0 && nested-- == 0)
+					break;
+			}
+			pc++;
+			continue;
+		}
+
+		if (strcmp(line->args[0], "END") == 0) {
+			if (depth == 0)
+				die("END without REPEAT");
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
+			if (--loops[depth - 1].remaining > 0) {
+				pc = loops[depth - 1].start;
+			} else {
+				depth--;
+				pc++;
 			}
+			continue;
+		}
+
+		if (timing) {
+			uint64_t start = now_ns();
+			run_command(&script, line->args);
+			uint64_t elapsed = now_ns() - start;
+
+			line->runs++;
+			line->total_ns += elapsed;
+			if (elapsed > line->max_ns)
+				line->max_ns = elapsed;
+		} else {
+			run_command(&script, line->args);
 		}
+		pc++;
 	}
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (script.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	if (timing)
+		report_timing(&script);
+
+	free_script(&script);
+}
+
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	run_script(t_arg->argv[0], t_arg->argv[1], 0);
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	run_script(t_arg->argv[0], t_arg->argv[1], 1);
 }
 
 void thread_fs_stat(void *arg)
@@ -316,61 +697,289 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
+/*
+ * Pipeline between the host and the file system: two chunk buffers, one being
+ * filled by the producer while the other is drained by the consumer. Only the
+ * main thread calls the library, a helper thread does the host I/O.
+ */
+#define STREAM_CHUNK (64 * BLOCK_SIZE)
+
+struct stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[2];
+	size_t len[2];			// Bytes in a full buffer
+	int full[2];			// Buffer waits for the consumer
+	int next_fill, next_drain;
+	int done;				// Producer is finished, with or without error
+	int error;				// Either side failed, both stop
+	int host_fd;
+};
+
+static void stream_init(struct stream *stream, int host_fd)
+{
+	memset(stream, 0, sizeof(*stream));
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+	stream->host_fd = host_fd;
+	for (int i = 0; i < 2; i++) {
+		stream->buf[i] = malloc(STREAM_CHUNK);
+		if (!stream->buf[i])
+			die_perror("malloc");
+	}
+}
+
+static void stream_destroy(struct stream *stream)
+{
+	free(stream->buf[0]);
+	free(stream->buf[1]);
+	pthread_cond_destroy(&stream->cond);
+	pthread_mutex_destroy(&stream->lock);
+}
+
+/* Next buffer to fill, NULL if the consumer failed */
+static char *stream_fill_begin(struct stream *stream)
+{
+	char *buf = NULL;
+
+	pthread_mutex_lock(&stream->lock);
+	while (stream->full[stream->next_fill] && !stream->error)
+		pthread_cond_wait(&stream->cond, &stream->lock);
+	if (!stream->error)
+		buf = stream->buf[stream->next_fill];
+	pthread_mutex_unlock(&stream->lock);
+
+	return buf;
+}
+
+static void stream_fill_end(struct stream *stream, size_t len)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->len[stream->next_fill] = len;
+	stream->full[stream->next_fill] = 1;
+	stream->next_fill ^= 1;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/* Tell the consumer that no more buffer comes, after an error if @error */
+static void stream_finish(struct stream *stream, int error)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->done = 1;
+	stream->error |= error;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/* Next buffer to drain and its length, NULL once the producer is finished */
+static char *stream_drain_begin(struct stream *stream, size_t *len)
+{
+	char *buf = NULL;
+
+	pthread_mutex_lock(&stream->lock);
+	while (!stream->full[stream->next_drain] && !stream->done && !stream->error)
+		pthread_cond_wait(&stream->cond, &stream->lock);
+	if (stream->full[stream->next_drain] && !stream->error) {
+		buf = stream->buf[stream->next_drain];
+		*len = stream->len[stream->next_drain];
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return buf;
+}
+
+/* Give a drained buffer back to the producer, stopping it if @error */
+static void stream_drain_end(struct stream *stream, int error)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->full[stream->next_drain] = 0;
+	stream->next_drain ^= 1;
+	stream->error |= error;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/* Helper thread of add: produce the chunks of the host file */
+static void *stream_host_reader(void *arg)
+{
+	struct stream *stream = arg;
+	char *buf;
+
+	while ((buf = stream_fill_begin(stream))) {
+		size_t len = 0;
+
+		// Fill whole chunks so the library gets block-aligned writes
+		while (len < STREAM_CHUNK) {
+			ssize_t ret = read(stream->host_fd, buf + len, STREAM_CHUNK - len);
+
+			if (ret < 0) {
+				perror("read");
+				stream_finish(stream, 1);
+				return NULL;
+			}
+			if (ret == 0)
+				break;
+			len += ret;
+		}
+		if (len == 0)
+			break;
+		stream_fill_end(stream, len);
+		if (len < STREAM_CHUNK)
+			break;
+	}
+	stream_finish(stream, 0);
+
+	return NULL;
+}
+
+/* Helper thread of cat: consume the chunks of the file into the host file */
+static void *stream_host_writer(void *arg)
+{
+	struct stream *stream = arg;
+	size_t len;
+	char *buf;
+
+	while ((buf = stream_drain_begin(stream, &len))) {
+		size_t done = 0;
+
+		while (done < len) {
+			ssize_t ret = write(stream->host_fd, buf + done, len - done);
+
+			if (ret < 0) {
+				perror("write");
+				stream_drain_end(stream, 1);
+				return NULL;
+			}
+			done += ret;
+		}
+
+		stream_drain_end(stream, 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * Stream file @fs_fd of @size bytes to standard output, returns bytes read or
+ * -1 if standard output could not be written
+ */
+static ssize_t stream_export(int fs_fd, size_t size)
+{
+	struct stream stream;
+	pthread_t writer;
+	size_t total = 0;
+	int error;
+	char *buf;
+
+	stream_init(&stream, STDOUT_FILENO);
+	if (pthread_create(&writer, NULL, stream_host_writer, &stream))
+		die("Cannot create thread");
+
+	while (total < size && (buf = stream_fill_begin(&stream))) {
+		size_t len = size - total < STREAM_CHUNK ? size - total : STREAM_CHUNK;
+		int read = fs_read(fs_fd, buf, len);
+
+		if (read <= 0)
+			break;
+		stream_fill_end(&stream, read);
+		total += read;
+	}
+	stream_finish(&stream, 0);
+
+	pthread_join(writer, NULL);
+	error = stream.error;
+	stream_destroy(&stream);
+
+	return error ? -1 : (ssize_t)total;
+}
+
+/* Stream host file @host_fd into file @fs_fd, returns bytes written */
+static size_t stream_import(int host_fd, int fs_fd)
+{
+	struct stream stream;
+	pthread_t reader;
+	size_t total = 0, len;
+	char *buf;
+
+	stream_init(&stream, host_fd);
+	if (pthread_create(&reader, NULL, stream_host_reader, &stream))
+		die("Cannot create thread");
+
+	while ((buf = stream_drain_begin(&stream, &len))) {
+		int written = fs_write(fs_fd, buf, len);
+
+		if (written > 0)
+			total += written;
+		stream_drain_end(&stream, written != (int)len);
+	}
+
+	pthread_join(reader, NULL);
+	stream_destroy(&stream);
+
+	return total;
+}
+
+/* Dump the content of each file, all under a single mount */
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
-	int stat, read;
+	int stat;
+	ssize_t read;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename>...");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
+	for (int i = 1; i < t_arg->argc; i++) {
+		filename = t_arg->argv[i];
 
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_umount();
-		die("Cannot stat file");
-	}
-	if (!stat) {
-		/* Nothing to read, file is empty */
-		printf("Empty file\n");
-		return;
-	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
+		fs_fd = fs_open(filename);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
 
-	read = fs_read(fs_fd, buf, stat);
+		stat = fs_stat(fs_fd);
+		if (stat < 0) {
+			fs_close(fs_fd);
+			fs_umount();
+			die("Cannot stat file");
+		}
 
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
+		if (!stat) {
+			/* Nothing to read, file is empty */
+			printf("Empty file\n");
+		} else {
+			/* The content follows the header as it is read, a short read ends in an error */
+			printf("Read file '%s' (%d bytes)\n", filename, stat);
+			printf("Content of the file:\n");
+			fflush(stdout);
+
+			read = stream_export(fs_fd, stat);
+			if (read != stat) {
+				fs_close(fs_fd);
+				fs_umount();
+				if (read < 0)
+					die("Cannot write the content of '%s'", filename);
+				die("Read only %zd/%d bytes of '%s'", read, stat, filename);
+			}
+		}
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
 	}
 
 	if (fs_umount())
 		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
 }
 
 void thread_fs_rm(void *arg)
@@ -398,67 +1007,67 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+/* Copy each host file into a new file of the same name, all under a single mount */
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	size_t written;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename>...");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
 
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die_perror("open");
-	if (fstat(fd, &st))
-		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
-		die("Not a regular file: %s\n", filename);
-
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
-	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
-	 */
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
-		fs_umount();
-		die("Cannot create file");
-	}
+	for (int i = 1; i < t_arg->argc; i++) {
+		filename = t_arg->argv[i];
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
+		/* Open file on host computer */
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			fs_umount();
+			die_perror("open");
+		}
+		if (fstat(fd, &st)) {
+			fs_umount();
+			die_perror("fstat");
+		}
+		if (!S_ISREG(st.st_mode)) {
+			fs_umount();
+			die("Not a regular file: %s\n", filename);
+		}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+		/* Create the new file and stream the host file into it */
+		if (fs_create(filename)) {
+			fs_umount();
+			die("Cannot create file");
+		}
 
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
+		fs_fd = fs_open(filename);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+
+		written = stream_import(fd, fs_fd);
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+		close(fd);
+
+		printf("Wrote file '%s' (%zu/%zu bytes)\n", filename, written,
+			   st.st_size);
 	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
-
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
-
-	munmap(buf, st.st_size);
-	close(fd);
 }
 
 void thread_fs_ls(void *arg)
@@ -499,12 +1108,132 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+void thread_fs_stats(void *arg)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [script filename]");
+
+	/* Collect the statistics of a script, or of a bare mount */
+	fs_reset_stats();
+	fs_set_stats_timing(1);
+	if (t_arg->argc >= 2) {
+		thread_fs_script(arg);
+	} else {
+		if (fs_mount(t_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	if (fs_get_stats(&stats))
+		die("Cannot get statistics");
+
+	printf("FS Stats:\n");
+	printf("blocks_read=%" PRIu64 "\n", stats.blocks_read);
+	printf("blocks_written=%" PRIu64 "\n", stats.blocks_written);
+	printf("fat_steps=%" PRIu64 "\n", stats.fat_steps);
+	printf("bounce_copies=%" PRIu64 "\n", stats.bounce_copies);
+	printf("cache_hits=%" PRIu64 "\n", stats.cache_hits);
+	printf("cache_misses=%" PRIu64 "\n", stats.cache_misses);
+	printf("alloc_scans=%" PRIu64 "\n", stats.alloc_scans);
+	printf("alloc_scan_steps=%" PRIu64 "\n", stats.alloc_scan_steps);
+
+	/* Operations that were called, with their latency histogram */
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		struct fs_op_stats *op_stats = &stats.ops[op];
+
+		if (op_stats->calls == 0)
+			continue;
+
+		printf("%s: calls=%" PRIu64 " errors=%" PRIu64 " avg_ns=%" PRIu64 " max_ns=%" PRIu64 "\n", fs_stats_op_name(op),
+		       op_stats->calls, op_stats->errors, op_stats->timed ? op_stats->total_ns / op_stats->timed : 0,
+		       op_stats->max_ns);
+		for (int bucket = 0; bucket < FS_STATS_BUCKETS; bucket++) {
+			if (op_stats->histogram[bucket])
+				printf("\t>=%luns: %" PRIu64 "\n", bucket ? 1UL << bucket : 0, op_stats->histogram[bucket]);
+		}
+	}
+}
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_trace_event *events;
+	uint64_t lost;
+	FILE *trace_file;
+	int count;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <trace filename>");
+
+	events = malloc(FS_TRACE_CAPACITY * sizeof(*events));
+	if (!events)
+		die_perror("malloc");
+
+	trace_file = fopen(t_arg->argv[2], "w");
+	if (!trace_file)
+		die_perror("fopen");
+
+	/* Trace the script */
+	fs_trace_start();
+	thread_fs_script(arg);
+	fs_trace_stop();
+
+	count = fs_trace_read(events, FS_TRACE_CAPACITY, &lost);
+
+	/* One event per line, see fs_trace.c */
+	fprintf(trace_file, "# lost=%" PRIu64 "\n", lost);
+	for (int i = 0; i < count; i++) {
+		const char *caller = fs_stats_op_name(events[i].caller);
+
+		fprintf(trace_file, "%" PRIu64 "\t%s\t%u\t%u\t%s\t%d\n", events[i].time_ns,
+			fs_stats_op_name(events[i].op), events[i].block, events[i].count, caller ? caller : "-",
+			events[i].file);
+	}
+
+	fclose(trace_file);
+	free(events);
+
+	printf("Traced %d events (%" PRIu64 " lost) to '%s'\n", count, lost, t_arg->argv[2]);
+}
+
+void thread_fs_crash(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct block_sim_fault fault = { .type = BLOCK_SIM_TORN_WRITE };
+	struct block_sim_stats stats;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <block> [torn bytes] [writes to skip]");
+
+	fault.block = get_argv(t_arg->argv[2]);
+	if (t_arg->argc >= 4)
+		fault.bytes = get_argv(t_arg->argv[3]);
+	if (t_arg->argc >= 5)
+		fault.skip = get_argv(t_arg->argv[4]);
+
+	/* Cut the power while the block is being written, and go on regardless */
+	if (block_disk_set_device(&block_sim_device) || block_sim_inject(&fault))
+		die("Cannot set up the simulated disk");
+	thread_fs_script(arg);
+
+	block_sim_get_stats(&stats);
+	if (stats.faults)
+		printf("Crashed writing block %zu, %" PRIu64 " block writes dropped\n", fault.block,
+		       stats.dropped_writes);
+	else
+		printf("Block %zu was not written, no crash\n", fault.block);
+}
+
+void thread_fs_ram(void *arg)
+{
+	/* Only the image saved at each unmount reaches the disk file */
+	if (block_disk_set_device(&block_ram_device))
+		die("Cannot set up the RAM disk");
+	thread_fs_script(arg);
 }
 
 static struct {
@@ -517,7 +1246,12 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "replay",	thread_fs_replay },
+	{ "stats",	thread_fs_stats },
+	{ "trace",	thread_fs_trace },
+	{ "crash",	thread_fs_crash },
+	{ "ram",	thread_fs_ram }
 };
 
 void usage(char *program)
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define MAX_FILE_SIZE (16 * BLOCK_SIZE)
+
+/* Content a file is expected to have */
+struct model {
+	const char *name;
+	int fd;
+	size_t size;
+	char data[MAX_FILE_SIZE];
+};
+
+static struct model a = { .name = "a" }, b = { .name = "b" };
+static struct model src = { .name = "src" }, dst = { .name = "dst" };
+static struct model twin = { .name = "twin" }, holes = { .name = "holes" };
+static struct model packed = { .name = "packed" };
+
+/* Bytes that differ from block to block and from file to file */
+static void fill(char *buf, size_t size, int seed)
+{
+	for (size_t i = 0; i < size; i++)
+		buf[i] = 'A' + (i * 7 + i / BLOCK_SIZE + seed) % 26;
+}
+
+static void create(struct model *file)
+{
+	ASSERT(!fs_create(file->name), "fs_create");
+	file->fd = fs_open(file->name);
+	ASSERT(file->fd >= 0, "fs_open");
+	file->size = 0;
+}
+
+static void reopen(struct model *file)
+{
+	ASSERT(!fs_close(file->fd), "fs_close");
+	file->fd = fs_open(file->name);
+	ASSERT(file->fd >= 0, "fs_open");
+}
+
+static void write_at(struct model *file, size_t offset, const char *buf, size_t count)
+{
+	ASSERT(!fs_lseek(file->fd, offset), "fs_lseek");
+	ASSERT(fs_write(file->fd, (void *)buf, count) == (int)count, "fs_write");
+
+	memcpy(&file->data[offset], buf, count);
+	if (offset + count > file->size)
+		file->size = offset + count;
+}
+
+static void copy(struct model *in, size_t off_in, struct model *out, size_t off_out, size_t len)
+{
+	ASSERT(fs_copy_range(in->fd, off_in, out->fd, off_out, len) == (int)len, "fs_copy_range");
+
+	memmove(&out->data[off_out], &in->data[off_in], len);
+	if (off_out + len > out->size)
+		out->size = off_out + len;
+}
+
+/* Read the whole file back and compare it with its model */
+static void check(struct model *file)
+{
+	static char buf[MAX_FILE_SIZE + 1];
+
+	ASSERT(fs_stat(file->fd) == (int)file->size, "fs_stat");
+	ASSERT(!fs_lseek(file->fd, 0), "fs_lseek");
+	ASSERT(fs_read(file->fd, buf, sizeof(buf)) == (int)file->size, "fs_read");
+	if (memcmp(buf, file->data, file->size)) {
+		fprintf(stderr, "Content of '%s' is wrong\n", file->name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static unsigned int free_blocks(void)
+{
+	struct fs_frag_stats stats;
+
+	ASSERT(!fs_frag_stats(&stats), "fs_frag_stats");
+	return stats.free_blocks;
+}
+
+/* Identical files share their blocks, which get copied once one file is modified */
+static void test_dedup(void)
+{
+	char buf[3 * BLOCK_SIZE];
+	unsigned int before;
+
+	ASSERT(!fs_set_dedup(1), "fs_set_dedup");
+	fill(buf, sizeof(buf), 0);
+
+	create(&a);
+	write_at(&a, 0, buf, sizeof(buf));
+	reopen(&a);
+	before = free_blocks();
+
+	create(&b);
+	write_at(&b, 0, buf, sizeof(buf));
+	reopen(&b);
+	ASSERT(free_blocks() == before, "dedup sharing");
+	check(&a);
+	check(&b);
+
+	write_at(&b, BLOCK_SIZE + 10, "changed", 7);
+	check(&a);
+	check(&b);
+
+	ASSERT(!fs_close(a.fd), "fs_close");
+	ASSERT(!fs_delete("a"), "fs_delete");
+	check(&b);
+	ASSERT(!fs_close(b.fd), "fs_close");
+
+	ASSERT(!fs_set_dedup(0), "fs_set_dedup");
+}
+
+/* Copies between plain, shared, sparse and compressed files */
+static void test_copy_range(void)
+{
+	char buf[8 * BLOCK_SIZE];
+	int filler;
+
+	fill(buf, sizeof(buf), 1);
+	create(&src);
+	write_at(&src, 0, buf, 5 * BLOCK_SIZE + 123);
+	create(&dst);
+	write_at(&dst, 0, "destination", 11);
+
+	/* Unaligned, then aligned, from plain file to plain file */
+	copy(&src, 1000, &dst, 5, 3 * BLOCK_SIZE + 7);
+	check(&dst);
+	copy(&src, BLOCK_SIZE, &dst, 2 * BLOCK_SIZE, 2 * BLOCK_SIZE);
+	check(&dst);
+	check(&src);
+
+	/* Within a file, and the descriptors' offsets are left alone */
+	ASSERT(!fs_lseek(src.fd, 77), "fs_lseek");
+	copy(&src, 0, &src, 3 * BLOCK_SIZE, 100);
+	ASSERT(fs_write(src.fd, "@", 1) == 1, "fs_write");
+	src.data[77] = '@';
+	check(&src);
+
+	/* Into a clone, which must not change the file it was cloned from */
+	ASSERT(!fs_close(dst.fd), "fs_close");
+	ASSERT(!fs_clone("dst", "twin"), "fs_clone");
+	dst.fd = fs_open("dst");
+	twin.fd = fs_open("twin");
+	ASSERT(dst.fd >= 0 && twin.fd >= 0, "fs_open");
+	twin.size = dst.size;
+	memcpy(twin.data, dst.data, dst.size);
+	copy(&src, 10, &twin, BLOCK_SIZE - 3, 9);
+	check(&twin);
+	check(&dst);
+
+	/* From a sparse file, whose holes read as zeros */
+	create(&holes);
+	ASSERT(!fs_truncate(holes.fd, 4 * BLOCK_SIZE), "fs_truncate");
+	memset(holes.data, 0, 4 * BLOCK_SIZE);
+	holes.size = 4 * BLOCK_SIZE;
+	write_at(&holes, 2 * BLOCK_SIZE + 1, "island", 6);
+	copy(&holes, BLOCK_SIZE, &dst, 100, 2 * BLOCK_SIZE + 50);
+	check(&dst);
+
+	/* To and from a compressed file */
+	ASSERT(!fs_create("packed"), "fs_create");
+	ASSERT(!fs_set_compression("packed", 1), "fs_set_compression");
+	packed.fd = fs_open("packed");
+	ASSERT(packed.fd >= 0, "fs_open");
+	copy(&src, 0, &packed, 0, 4 * BLOCK_SIZE);
+	copy(&dst, 3, &packed, 1000, 500);
+	check(&packed);
+	copy(&packed, 900, &src, 2 * BLOCK_SIZE + 1, 700);
+	check(&src);
+
+	/* Fill the disk, then copies that don't fit must leave the files as they were */
+	ASSERT(!fs_create("filler"), "fs_create");
+	filler = fs_open("filler");
+	ASSERT(filler >= 0, "fs_open");
+	while (fs_write(filler, buf, BLOCK_SIZE) == BLOCK_SIZE)
+		;
+	ASSERT(free_blocks() == 0, "disk full");
+
+	ASSERT(fs_copy_range(src.fd, 0, dst.fd, dst.size, 2 * BLOCK_SIZE) < 0, "fs_copy_range");
+	check(&dst);
+	ASSERT(fs_copy_range(holes.fd, 0, dst.fd, dst.size, 3 * BLOCK_SIZE) < 0, "fs_copy_range");
+	check(&dst);
+	ASSERT(fs_copy_range(src.fd, 0, packed.fd, packed.size, 3 * BLOCK_SIZE) < 0, "fs_copy_range");
+	check(&packed);
+	check(&src);
+
+	ASSERT(!fs_close(src.fd) && !fs_close(dst.fd) && !fs_close(twin.fd), "fs_close");
+	ASSERT(!fs_close(holes.fd) && !fs_close(packed.fd) && !fs_close(filler), "fs_close");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_check_report report;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		printf("The disk image should be freshly made, with 64 to 256 data blocks\n");
+		exit(1);
+	}
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	test_dedup();
+	test_copy_range();
+	ASSERT(!fs_umount(), "fs_umount");
+
+	ASSERT(fs_check(argv[1], 0, &report) == 0, "fs_check");
+	printf("Shared and copied files are correct\n");
+
+	return 0;
+}
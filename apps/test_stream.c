@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <stream.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+#define MAX_FILE_SIZE (16 * BLOCK_SIZE)
+#define RANDOM_OPS 2000
+
+/* The same writes go to "buffered" through a stream and to "direct" through a descriptor */
+static struct fs_stream *stream;
+static int buffered_fd, direct_fd;
+static size_t size;
+static char data[MAX_FILE_SIZE];
+
+/* Bytes that differ from block to block */
+static void fill(char *buf, size_t count, int seed)
+{
+	for (size_t i = 0; i < count; i++)
+		buf[i] = 'A' + (i * 7 + i / BLOCK_SIZE + seed) % 26;
+}
+
+/* Size of the file as other descriptors see it */
+static int visible_size(void)
+{
+	return fs_stat(buffered_fd);
+}
+
+static void write_both(size_t offset, const char *buf, size_t count)
+{
+	ASSERT(!fs_fseek(stream, offset), "fs_fseek");
+	ASSERT(fs_fwrite(stream, buf, count) == (int)count, "fs_fwrite");
+	ASSERT((size_t)fs_ftell(stream) == offset + count, "fs_ftell");
+
+	ASSERT(!fs_lseek(direct_fd, offset), "fs_lseek");
+	ASSERT(fs_write(direct_fd, (void *)buf, count) == (int)count, "fs_write");
+
+	memcpy(&data[offset], buf, count);
+	if (offset + count > size)
+		size = offset + count;
+}
+
+/* Read through the stream and through the descriptor, which must agree with the expected content */
+static void read_both(size_t offset, size_t count)
+{
+	static char from_stream[MAX_FILE_SIZE], from_fd[MAX_FILE_SIZE];
+	size_t expected = (offset >= size) ? 0 : (offset + count > size) ? size - offset : count;
+
+	ASSERT(!fs_fseek(stream, offset), "fs_fseek");
+	ASSERT(fs_fread(stream, from_stream, count) == (int)expected, "fs_fread");
+	ASSERT((size_t)fs_ftell(stream) == offset + expected, "fs_ftell");
+
+	ASSERT(!fs_lseek(direct_fd, offset), "fs_lseek");
+	ASSERT(fs_read(direct_fd, from_fd, count) == (int)expected, "fs_read");
+
+	if (memcmp(from_stream, &data[offset], expected) || memcmp(from_fd, &data[offset], expected)) {
+		fprintf(stderr, "Read %zu bytes at %zu: wrong content\n", count, offset);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Small writes stay in the window until the stream leaves it */
+static void test_window(void)
+{
+	char buf[BLOCK_SIZE];
+
+	fill(buf, sizeof(buf), 0);
+	write_both(0, buf, 100);
+	write_both(100, buf + 100, 200);
+	ASSERT(visible_size() == 0, "fs_fwrite buffering");
+
+	// Moving to another block flushes the dirty range
+	write_both(BLOCK_SIZE + 10, buf, 50);
+	ASSERT(visible_size() == 300, "fs_fwrite flush on seek");
+
+	// So does a write that would leave a gap in the dirty range
+	write_both(BLOCK_SIZE + 200, buf, 20);
+	ASSERT(visible_size() == BLOCK_SIZE + 60, "fs_fwrite flush on gap");
+
+	// Filling the rest of the block writes it at once
+	write_both(BLOCK_SIZE + 220, buf, BLOCK_SIZE - 220);
+	ASSERT(visible_size() == 2 * BLOCK_SIZE, "fs_fwrite flush on full block");
+
+	ASSERT(!fs_fflush(stream), "fs_fflush");
+	read_both(0, 2 * BLOCK_SIZE);
+}
+
+/* Reads see the writes still buffered */
+static void test_read_after_write(void)
+{
+	char buf[64];
+
+	fill(buf, sizeof(buf), 1);
+	write_both(2 * BLOCK_SIZE + 5, buf, sizeof(buf));
+	ASSERT(visible_size() == 2 * BLOCK_SIZE, "fs_fwrite buffering");
+	read_both(2 * BLOCK_SIZE, 100);
+	ASSERT(visible_size() == 2 * BLOCK_SIZE + 5 + (int)sizeof(buf), "fs_fread flush");
+
+	// A write within the block read last must not leave the old content in the window
+	write_both(2 * BLOCK_SIZE + 10, "fresh", 5);
+	read_both(2 * BLOCK_SIZE, 100);
+
+	// Reading past the end of file stops there
+	read_both(size - 10, 50);
+	read_both(size + 10, 50);
+}
+
+/* Requests of whole blocks go straight to the file */
+static void test_bypass(void)
+{
+	char buf[3 * BLOCK_SIZE + 10];
+
+	fill(buf, sizeof(buf), 2);
+	write_both(4 * BLOCK_SIZE, buf, 3 * BLOCK_SIZE);
+	ASSERT(visible_size() == 7 * BLOCK_SIZE, "fs_fwrite bypass");
+
+	// The blocks go straight through, the 10 bytes left over are buffered
+	write_both(8 * BLOCK_SIZE, buf, sizeof(buf));
+	ASSERT(visible_size() == 11 * BLOCK_SIZE, "fs_fwrite bypass");
+	ASSERT(!fs_fflush(stream), "fs_fflush");
+	ASSERT(visible_size() == 11 * BLOCK_SIZE + 10, "fs_fflush");
+
+	read_both(4 * BLOCK_SIZE, 3 * BLOCK_SIZE);
+	read_both(7 * BLOCK_SIZE + 100, 2 * BLOCK_SIZE);
+
+	// A write over the window read last makes it stale
+	read_both(5 * BLOCK_SIZE + 10, 10);
+	write_both(5 * BLOCK_SIZE, buf + 1, 2 * BLOCK_SIZE);
+	read_both(5 * BLOCK_SIZE + 10, 10);
+}
+
+/* Random requests, checked against the descriptor after each read */
+static void test_random(void)
+{
+	char buf[3 * BLOCK_SIZE];
+
+	fill(buf, sizeof(buf), 3);
+	srand(1);
+	for (int i = 0; i < RANDOM_OPS; i++) {
+		size_t count = (rand() % 4) ? rand() % 300 : rand() % (2 * BLOCK_SIZE);
+		size_t offset = rand() % (MAX_FILE_SIZE - count);
+
+		// Aligned requests now and then, to go through the bypass
+		if (rand() % 4 == 0)
+			offset -= offset % BLOCK_SIZE;
+
+		if (rand() % 2)
+			write_both(offset, buf + rand() % BLOCK_SIZE, count - count % 3);
+		else
+			read_both(offset, count);
+	}
+	ASSERT(!fs_fflush(stream), "fs_fflush");
+	read_both(0, MAX_FILE_SIZE);
+	ASSERT(visible_size() == (int)size, "fs_stat");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_check_report report;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage>\n", argv[0]);
+		printf("The disk image should be freshly made, with 64 data blocks or more\n");
+		exit(1);
+	}
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_create("buffered") && !fs_create("direct"), "fs_create");
+	stream = fs_fopen("buffered");
+	ASSERT(stream, "fs_fopen");
+	buffered_fd = fs_open("buffered");
+	direct_fd = fs_open("direct");
+	ASSERT(buffered_fd >= 0 && direct_fd >= 0, "fs_open");
+
+	test_window();
+	test_read_after_write();
+	test_bypass();
+	test_random();
+
+	ASSERT(!fs_fclose(stream), "fs_fclose");
+	ASSERT(!fs_close(buffered_fd) && !fs_close(direct_fd), "fs_close");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	ASSERT(fs_check(argv[1], 0, &report) == 0, "fs_check");
+	printf("Streams read and write like descriptors\n");
+
+	return 0;
+}
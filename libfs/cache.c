@@ -0,0 +1,490 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "stats.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Terminates a hash bucket chain */
+#define NO_SLOT -1
+
+/**
+* A slot holds one disk block. Slots are found through a hash table indexed by block number, and recycled with the
+* clock algorithm. A slot under writeback has been copied to the flusher's staging area and cannot be evicted until
+* the copy reaches the disk, otherwise a miss could read the stale on-disk block in the meantime.
+*/
+struct cache_slot {
+	size_t   block;			// Disk block held by the slot
+	int      next;			// Next slot in the same hash bucket
+	uint8_t  valid;			// Slot holds a block
+	uint8_t  dirty;			// Slot differs from the disk
+	uint8_t  writeback;		// Slot is being written by a flush
+	uint8_t  referenced;		// Clock algorithm second-chance bit
+	uint64_t dirty_since;		// Time (ms) the slot became dirty
+};
+
+struct cache {
+	int enabled;
+	struct cache_params params;
+	struct cache_counters counters;
+
+	struct cache_slot *slots;
+	uint8_t *data;			// params.blocks * BLOCK_SIZE bytes
+	int *buckets;
+	size_t hand;			// Clock hand
+	size_t dirty_count;
+
+	/* Flush staging area, sorted by block number */
+	uint8_t *staging;
+	int *staged;
+
+	pthread_mutex_t lock;		// Protects everything above
+	pthread_mutex_t flush_lock;	// Serializes flush passes
+	pthread_cond_t kick;		// Wakes the flusher up
+	pthread_cond_t wb_done;		// Signals the end of a writeback
+	pthread_t flusher;
+	int stopping;
+};
+
+static struct cache cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.flush_lock = PTHREAD_MUTEX_INITIALIZER,
+	.kick = PTHREAD_COND_INITIALIZER,
+	.wb_done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Helper Functions */
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint8_t *slot_data(int slot)
+{
+	return cache.data + (size_t)slot * BLOCK_SIZE;
+}
+
+static int *bucket_of(size_t block)
+{
+	return &cache.buckets[block % cache.params.blocks];
+}
+
+static int lookup(size_t block)
+{
+	int slot = *bucket_of(block);
+
+	while (slot != NO_SLOT && cache.slots[slot].block != block)
+		slot = cache.slots[slot].next;
+
+	return slot;
+}
+
+static void unhash(int slot)
+{
+	int *link = bucket_of(cache.slots[slot].block);
+
+	while (*link != slot)
+		link = &cache.slots[*link].next;
+	*link = cache.slots[slot].next;
+}
+
+static int flush_needed(void)
+{
+	if (cache.dirty_count * 100 >= cache.params.dirty_ratio * cache.params.blocks)
+		return 1;
+
+	uint64_t now = now_ms();
+	for (size_t i = 0; i < cache.params.blocks; ++i) {
+		if (cache.slots[i].dirty && now - cache.slots[i].dirty_since >= cache.params.max_age_ms)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+* grab_slot - Find a slot for @block, evicting another block if needed
+*
+* Must be called with the cache lock held and @block not cached. A dirty victim is written back synchronously; slots
+* under writeback are skipped and, if nothing else is available, the caller waits for the flusher to finish.
+*
+* Return: slot index if successful, -1 otherwise
+*/
+static int grab_slot(size_t block)
+{
+	int slot;
+
+	for (;;) {
+		size_t scanned = 0;
+		for (; scanned < 2 * cache.params.blocks; ++scanned) {
+			slot = cache.hand;
+			cache.hand = (cache.hand + 1) % cache.params.blocks;
+
+			struct cache_slot *s = &cache.slots[slot];
+			if (!s->valid)
+				break;
+			if (s->writeback)
+				continue;
+			if (s->referenced) {
+				s->referenced = 0;
+				continue;
+			}
+			break;
+		}
+		if (scanned < 2 * cache.params.blocks)
+			break;
+
+		pthread_cond_wait(&cache.wb_done, &cache.lock);
+	}
+
+	struct cache_slot *s = &cache.slots[slot];
+	if (s->valid) {
+		if (s->dirty) {
+			if (block_write(s->block, slot_data(slot)) < 0)
+				return -1;
+			s->dirty = 0;
+			cache.dirty_count--;
+			cache.counters.evictions++;
+		}
+		unhash(slot);
+	}
+
+	s->block = block;
+	s->valid = 1;
+	s->referenced = 1;
+	s->next = *bucket_of(block);
+	*bucket_of(block) = slot;
+
+	return slot;
+}
+
+static int compare_staged(const void *a, const void *b)
+{
+	size_t block_a = cache.slots[*(const int *)a].block;
+	size_t block_b = cache.slots[*(const int *)b].block;
+
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+* flush - Write back every dirty block in ascending block order
+*
+* Dirty slots are copied to the staging area under the cache lock, then written without holding it so that foreground
+* operations keep being served from the cache. Consecutive block numbers are merged into a single disk write.
+*/
+static int flush(void)
+{
+	size_t count = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.flush_lock);
+	pthread_mutex_lock(&cache.lock);
+
+	for (size_t i = 0; i < cache.params.blocks; ++i) {
+		if (cache.slots[i].dirty)
+			cache.staged[count++] = i;
+	}
+	qsort(cache.staged, count, sizeof(int), compare_staged);
+
+	for (size_t i = 0; i < count; ++i) {
+		struct cache_slot *s = &cache.slots[cache.staged[i]];
+		memcpy(cache.staging + i * BLOCK_SIZE, slot_data(cache.staged[i]), BLOCK_SIZE);
+		s->dirty = 0;
+		s->writeback = 1;
+	}
+	cache.dirty_count -= count;
+
+	pthread_mutex_unlock(&cache.lock);
+
+	/* Write runs of consecutive blocks */
+	size_t runs = 0;
+	for (size_t start = 0, end; start < count; start = end) {
+		size_t first = cache.slots[cache.staged[start]].block;
+		for (end = start + 1; end < count; ++end) {
+			if (cache.slots[cache.staged[end]].block != first + (end - start))
+				break;
+		}
+
+		if (block_write_multi(first, end - start, cache.staging + start * BLOCK_SIZE) < 0) {
+			/* Keep the blocks dirty so that a later flush retries them */
+			pthread_mutex_lock(&cache.lock);
+			for (size_t i = start; i < end; ++i) {
+				struct cache_slot *s = &cache.slots[cache.staged[i]];
+				if (!s->dirty) {
+					s->dirty = 1;
+					s->dirty_since = now_ms();
+					cache.dirty_count++;
+				}
+			}
+			pthread_mutex_unlock(&cache.lock);
+			ret = -1;
+		}
+		runs++;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+	for (size_t i = 0; i < count; ++i)
+		cache.slots[cache.staged[i]].writeback = 0;
+	if (count) {
+		cache.counters.flushes++;
+		cache.counters.blocks_flushed += count;
+		cache.counters.runs += runs;
+		cache.counters.blocks_coalesced += count - runs;
+	}
+	pthread_cond_broadcast(&cache.wb_done);
+	pthread_mutex_unlock(&cache.lock);
+
+	pthread_mutex_unlock(&cache.flush_lock);
+
+	return ret;
+}
+
+static void *flusher_main(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&cache.lock);
+	while (!cache.stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += cache.params.interval_ms / 1000;
+		deadline.tv_nsec += (cache.params.interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		int rc = pthread_cond_timedwait(&cache.kick, &cache.lock, &deadline);
+		if (cache.stopping)
+			break;
+		if (rc != 0 && rc != ETIMEDOUT)
+			continue;
+
+		if (cache.dirty_count && flush_needed()) {
+			pthread_mutex_unlock(&cache.lock);
+			flush();
+			pthread_mutex_lock(&cache.lock);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return NULL;
+}
+
+static void release(void)
+{
+	free(cache.slots);
+	free(cache.data);
+	free(cache.buckets);
+	free(cache.staging);
+	free(cache.staged);
+	cache.slots = NULL;
+	cache.data = NULL;
+	cache.buckets = NULL;
+	cache.staging = NULL;
+	cache.staged = NULL;
+}
+
+/* Cache Functions */
+
+int cache_enable(const struct cache_params *params)
+{
+	struct cache_params defaults = {
+		.blocks = CACHE_DEFAULT_BLOCKS,
+		.dirty_ratio = CACHE_DEFAULT_DIRTY_RATIO,
+		.max_age_ms = CACHE_DEFAULT_MAX_AGE_MS,
+		.interval_ms = CACHE_DEFAULT_INTERVAL_MS,
+	};
+
+	if (cache.enabled) {
+		cache_error("cache already enabled");
+		return -1;
+	}
+
+	if (!params)
+		params = &defaults;
+
+	if (params->blocks == 0 || params->dirty_ratio > 100 || params->interval_ms == 0) {
+		cache_error("invalid cache parameters");
+		return -1;
+	}
+
+	cache.params = *params;
+	cache.slots = calloc(params->blocks, sizeof(struct cache_slot));
+	cache.data = malloc(params->blocks * BLOCK_SIZE);
+	cache.buckets = malloc(params->blocks * sizeof(int));
+	cache.staging = malloc(params->blocks * BLOCK_SIZE);
+	cache.staged = malloc(params->blocks * sizeof(int));
+	if (!cache.slots || !cache.data || !cache.buckets || !cache.staging || !cache.staged) {
+		release();
+		cache_error("cannot allocate %zu cache blocks", params->blocks);
+		return -1;
+	}
+
+	for (size_t i = 0; i < params->blocks; ++i)
+		cache.buckets[i] = NO_SLOT;
+	cache.hand = 0;
+	cache.dirty_count = 0;
+	cache.counters = (const struct cache_counters){ 0 };
+	cache.stopping = 0;
+
+	if (pthread_create(&cache.flusher, NULL, flusher_main, NULL)) {
+		release();
+		cache_error("cannot start flusher thread");
+		return -1;
+	}
+
+	cache.enabled = 1;
+
+	return 0;
+}
+
+int cache_disable(void)
+{
+	if (!cache.enabled) {
+		cache_error("cache not enabled");
+		return -1;
+	}
+
+	/* Stop the flusher, then write back whatever it left behind */
+	pthread_mutex_lock(&cache.lock);
+	cache.stopping = 1;
+	pthread_cond_signal(&cache.kick);
+	pthread_mutex_unlock(&cache.lock);
+	pthread_join(cache.flusher, NULL);
+
+	if (flush() < 0)
+		return -1;
+
+	cache.enabled = 0;
+	release();
+
+	return 0;
+}
+
+int cache_is_enabled(void)
+{
+	return cache.enabled;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	if (!cache.enabled)
+		return block_read(block, buf);
+
+	pthread_mutex_lock(&cache.lock);
+
+	int slot = lookup(block);
+	if (slot != NO_SLOT) {
+		cache.slots[slot].referenced = 1;
+		cache.counters.hits++;
+		stats_add(cache_hits, 1);
+	} else {
+		slot = grab_slot(block);
+		if (slot < 0 || block_read(block, slot_data(slot)) < 0) {
+			if (slot >= 0) {
+				unhash(slot);
+				cache.slots[slot].valid = 0;
+			}
+			pthread_mutex_unlock(&cache.lock);
+			return -1;
+		}
+		cache.counters.misses++;
+		stats_add(cache_misses, 1);
+	}
+	memcpy(buf, slot_data(slot), BLOCK_SIZE);
+
+	pthread_mutex_unlock(&cache.lock);
+
+	return 0;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	if (!cache.enabled)
+		return block_write(block, buf);
+
+	if (block >= (size_t)block_disk_count()) {
+		cache_error("block index out of bounds (%zu)", block);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+
+	int slot = lookup(block);
+	if (slot == NO_SLOT)
+		slot = grab_slot(block);
+	if (slot < 0) {
+		pthread_mutex_unlock(&cache.lock);
+		return -1;
+	}
+
+	struct cache_slot *s = &cache.slots[slot];
+	memcpy(slot_data(slot), buf, BLOCK_SIZE);
+	s->referenced = 1;
+	if (!s->dirty) {
+		s->dirty = 1;
+		s->dirty_since = now_ms();
+		cache.dirty_count++;
+
+		/* Don't wait for the next period when the dirty ratio is exceeded */
+		if (cache.dirty_count * 100 >= cache.params.dirty_ratio * cache.params.blocks)
+			pthread_cond_signal(&cache.kick);
+	}
+
+	pthread_mutex_unlock(&cache.lock);
+
+	return 0;
+}
+
+int cache_read_multi(size_t block, size_t count, void *buf)
+{
+	if (!cache.enabled)
+		return block_read_multi(block, count, buf);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cache_read(block + i, (uint8_t *)buf + i * BLOCK_SIZE) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int cache_write_multi(size_t block, size_t count, const void *buf)
+{
+	if (!cache.enabled)
+		return block_write_multi(block, count, buf);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (cache_write(block + i, (const uint8_t *)buf + i * BLOCK_SIZE) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int cache_sync(void)
+{
+	if (!cache.enabled)
+		return 0;
+
+	return flush();
+}
+
+void cache_get_counters(struct cache_counters *counters)
+{
+	pthread_mutex_lock(&cache.lock);
+	*counters = cache.counters;
+	pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,123 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Default number of blocks held by the write-back cache */
+#define CACHE_DEFAULT_BLOCKS 256
+
+/** Default percentage of dirty cache blocks that wakes the flusher early */
+#define CACHE_DEFAULT_DIRTY_RATIO 50
+
+/** Default age (in milliseconds) after which a dirty block gets flushed */
+#define CACHE_DEFAULT_MAX_AGE_MS 500
+
+/** Default period (in milliseconds) at which the flusher wakes up */
+#define CACHE_DEFAULT_INTERVAL_MS 100
+
+/* Tuning of the write-back cache and of its flusher thread */
+struct cache_params {
+	size_t   blocks;		// Capacity of the cache in blocks
+	unsigned dirty_ratio;		// Dirty percentage triggering a flush
+	unsigned max_age_ms;		// Maximum age of a dirty block
+	unsigned interval_ms;		// Flusher wake-up period
+};
+
+/* Activity counters of the cache, cumulative since cache_enable() */
+struct cache_counters {
+	uint64_t hits;			// Reads served from the cache
+	uint64_t misses;		// Reads that went to the disk
+	uint64_t evictions;		// Dirty blocks written back on eviction
+	uint64_t flushes;		// Flush passes that wrote something
+	uint64_t blocks_flushed;	// Blocks written by flush passes
+	uint64_t runs;			// Disk writes issued by flush passes
+	uint64_t blocks_coalesced;	// Blocks merged into a preceding run
+};
+
+/**
+ * cache_enable - Switch the block layer to write-back caching
+ * @params: Cache tuning, or NULL for the defaults
+ *
+ * Allocate the cache and start the background flusher thread. Until then, and
+ * again after cache_disable(), cache_read() and cache_write() go straight to
+ * the disk.
+ *
+ * Return: -1 if the cache is already enabled, if @params is invalid or if the
+ * cache cannot be allocated. 0 otherwise.
+ */
+int cache_enable(const struct cache_params *params);
+
+/**
+ * cache_disable - Flush the cache and return to direct disk accesses
+ *
+ * Return: -1 if the cache was not enabled or if flushing failed. 0 otherwise.
+ */
+int cache_disable(void);
+
+/**
+ * cache_is_enabled - Tell whether write-back caching is active
+ *
+ * Return: 1 if write-back caching is active, 0 otherwise.
+ */
+int cache_is_enabled(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * When the cache is enabled, the block is only marked dirty and the call
+ * returns without any disk access; the flusher writes it back later.
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_read_multi - Read a run of consecutive blocks through the cache
+ * @block: Index of the first block to read from
+ * @count: Number of consecutive blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Without the cache, the run is read with a single disk operation.
+ *
+ * Return: -1 if a block cannot be read. 0 otherwise.
+ */
+int cache_read_multi(size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_multi - Write a run of consecutive blocks through the cache
+ * @block: Index of the first block to write to
+ * @count: Number of consecutive blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Without the cache, the run is written with a single disk operation.
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+int cache_write_multi(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_sync - Write back every dirty block
+ *
+ * Return: -1 if a write to the disk failed. 0 otherwise.
+ */
+int cache_sync(void);
+
+/**
+ * cache_get_counters - Retrieve the cache activity counters
+ * @counters: Structure to fill
+ */
+void cache_get_counters(struct cache_counters *counters);
+
+#endif /* _CACHE_H */
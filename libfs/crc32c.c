@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* CRC-32C polynomial, bit-reflected */
+#define POLY 0x82F63B78
+
+/*
+* Interleaved stream lengths of the hardware kernel. Three streams of LONG bytes cover a 4 KiB block but for 16
+* bytes, so a whole disk block is checksummed in a single pass of three independent dependency chains.
+*/
+#define LONG 1360
+#define SHORT 256
+
+/* Slice-by-8 tables */
+static uint32_t crc32c_table[8][256];
+
+/* Tables shifting a CRC register over LONG and SHORT zero bytes */
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static int hw_available;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* Helper Functions */
+
+/*
+* shift_zeros - Advance a raw CRC register over @len zero bytes, one byte at a time
+*/
+static uint32_t shift_zeros(uint32_t crc, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+* build_zeros - Fill @zeros so that shift(crc) is the XOR of one lookup per byte of crc
+*
+* Appending zero bytes is linear over GF(2), so the operator is fully described by its effect on each of the 32
+* register bits.
+*/
+static void build_zeros(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t column[32];
+
+	for (int bit = 0; bit < 32; ++bit)
+		column[bit] = shift_zeros((uint32_t)1 << bit, len);
+
+	for (int byte = 0; byte < 4; ++byte) {
+		for (int n = 0; n < 256; ++n) {
+			uint32_t value = 0;
+			for (int bit = 0; bit < 8; ++bit) {
+				if (n & (1 << bit))
+					value ^= column[byte * 8 + bit];
+			}
+			zeros[byte][n] = value;
+		}
+	}
+}
+
+static uint32_t shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init(void)
+{
+	for (int n = 0; n < 256; ++n) {
+		uint32_t crc = n;
+		for (int k = 0; k < 8; ++k)
+			crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+		crc32c_table[0][n] = crc;
+	}
+	for (int n = 0; n < 256; ++n) {
+		uint32_t crc = crc32c_table[0][n];
+		for (int k = 1; k < 8; ++k) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[k][n] = crc;
+		}
+	}
+
+	build_zeros(crc32c_long, LONG);
+	build_zeros(crc32c_short, SHORT);
+
+#if defined(__x86_64__)
+	hw_available = !!__builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+static uint64_t load64(const unsigned char *p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *next = buf;
+	uint64_t crc0 = ~crc, crc1, crc2;
+
+	/* Compute the three streams in parallel, then merge them with the zeros operator */
+	while (len >= 3 * LONG) {
+		const unsigned char *end = next + LONG;
+		crc1 = 0;
+		crc2 = 0;
+		do {
+			crc0 = _mm_crc32_u64(crc0, load64(next));
+			crc1 = _mm_crc32_u64(crc1, load64(next + LONG));
+			crc2 = _mm_crc32_u64(crc2, load64(next + 2 * LONG));
+			next += 8;
+		} while (next < end);
+		crc0 = shift(crc32c_long, crc0) ^ crc1;
+		crc0 = shift(crc32c_long, crc0) ^ crc2;
+		next += 2 * LONG;
+		len -= 3 * LONG;
+	}
+
+	while (len >= 3 * SHORT) {
+		const unsigned char *end = next + SHORT;
+		crc1 = 0;
+		crc2 = 0;
+		do {
+			crc0 = _mm_crc32_u64(crc0, load64(next));
+			crc1 = _mm_crc32_u64(crc1, load64(next + SHORT));
+			crc2 = _mm_crc32_u64(crc2, load64(next + 2 * SHORT));
+			next += 8;
+		} while (next < end);
+		crc0 = shift(crc32c_short, crc0) ^ crc1;
+		crc0 = shift(crc32c_short, crc0) ^ crc2;
+		next += 2 * SHORT;
+		len -= 3 * SHORT;
+	}
+
+	for (; len >= 8; len -= 8, next += 8)
+		crc0 = _mm_crc32_u64(crc0, load64(next));
+	for (; len; --len)
+		crc0 = _mm_crc32_u8(crc0, *next++);
+
+	return ~(uint32_t)crc0;
+}
+#endif
+
+/* Checksum Functions */
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *next = buf;
+
+	pthread_once(&init_once, crc32c_init);
+
+	crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; len >= 8; len -= 8, next += 8) {
+		uint64_t word;
+		memcpy(&word, next, sizeof(word));
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xff] ^
+			crc32c_table[6][(word >> 8) & 0xff] ^
+			crc32c_table[5][(word >> 16) & 0xff] ^
+			crc32c_table[4][(word >> 24) & 0xff] ^
+			crc32c_table[3][(word >> 32) & 0xff] ^
+			crc32c_table[2][(word >> 40) & 0xff] ^
+			crc32c_table[1][(word >> 48) & 0xff] ^
+			crc32c_table[0][word >> 56];
+	}
+#endif
+
+	for (; len; --len)
+		crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&init_once, crc32c_init);
+
+#if defined(__x86_64__)
+	if (hw_available)
+		return crc32c_hw(crc, buf, len);
+#endif
+
+	return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+	pthread_once(&init_once, crc32c_init);
+
+	return hw_available;
+}
@@ -0,0 +1,37 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC-32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Use the SSE4.2 crc32 instruction on three interleaved streams when the CPU
+ * supports it, and fall back to crc32c_sw() otherwise.
+ *
+ * Return: Checksum of the preceding data followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_sw - Compute a CRC-32C checksum with the table-driven slice-by-8 kernel
+ * @crc: Checksum of the preceding data, 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Return: Checksum of the preceding data followed by @buf.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_hw_available - Tell whether crc32c() uses the hardware kernel
+ *
+ * Return: 1 if the CPU supports SSE4.2, 0 otherwise.
+ */
+int crc32c_hw_available(void);
+
+#endif /* _CRC32C_H */
@@ -6,39 +6,22 @@
 #include <unistd.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define block_error(fmt, ...) \
-	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+	(stats_error(), fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__))
 
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
-/* Disk instance description */
-struct disk {
-	/* File descriptor */
-	int fd;
-	/* Block count */
-	size_t bcount;
-};
-
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* File backend: blocks live in the virtual disk file itself */
+static int file_fd = INVALID_FD;
 
-int block_disk_open(const char *diskname)
+static int file_open(const char *diskname, size_t *bcount)
 {
 	int fd;
 	struct stat st;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
-	}
-
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -46,6 +29,7 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,92 +37,225 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	file_fd = fd;
+	*bcount = st.st_size / BLOCK_SIZE;
 
 	return 0;
 }
 
-int block_disk_close(void)
+static int file_close(void)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	close(file_fd);
+	file_fd = INVALID_FD;
+
+	return 0;
+}
+
+/*
+ * file_transfer - Read or write a run of blocks, as many calls as it takes since
+ * pread() and pwrite() may transfer less than asked
+ */
+static int file_transfer(size_t block, size_t count, void *buf, int write)
+{
+	size_t size = count * BLOCK_SIZE, done = 0;
+	off_t offset = (off_t)block * BLOCK_SIZE;
+
+	while (done < size) {
+		ssize_t ret = write ? pwrite(file_fd, (char *)buf + done, size - done, offset + done) :
+				      pread(file_fd, (char *)buf + done, size - done, offset + done);
+
+		if (ret < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("%s stopped at block %zu", write ? "pwrite" : "pread", block + done / BLOCK_SIZE);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int file_read(size_t block, size_t count, void *buf)
+{
+	return file_transfer(block, count, buf, 0);
+}
+
+static int file_write(size_t block, size_t count, const void *buf)
+{
+	return file_transfer(block, count, (void *)buf, 1);
+}
+
+const struct block_device block_file_device = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.read = file_read,
+	.write = file_write,
+};
+
+/* Disk instance description */
+struct disk {
+	/* Implementation of the open disk, NULL when no disk is open */
+	const struct block_device *device;
+	/* Block count */
+	size_t bcount;
+};
+
+/* Currently open virtual disk (none by default) */
+static struct disk disk;
+
+/* Implementation used by the next block_disk_open() */
+static const struct block_device *next_device = &block_file_device;
+
+int block_disk_set_device(const struct block_device *device)
+{
+	if (disk.device) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	next_device = device ? device : &block_file_device;
+
+	return 0;
+}
+
+const struct block_device *block_disk_device(void)
+{
+	return disk.device ? disk.device : next_device;
+}
+
+int block_disk_open(const char *diskname)
+{
+	size_t bcount;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.device) {
+		block_error("disk already open");
+		return -1;
+	}
 
-	disk.fd = INVALID_FD;
+	if (next_device->open(diskname, &bcount))
+		return -1;
+
+	disk.device = next_device;
+	disk.bcount = bcount;
 
 	return 0;
 }
 
-int block_disk_count(void)
+int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk.device) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	ret = disk.device->close();
+
+	disk.device = NULL;
+
+	return ret;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.device) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return disk.bcount;
+}
+
+/*
+ * Check that a run of blocks can be accessed, then hand it over to the device.
+ * The counters only see the I/O that the device carried out.
+ */
+static int disk_read(size_t block, size_t count, void *buf)
+{
+	if (!disk.device) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (disk.device->read(block, count, buf)) {
+		stats_error();
 		return -1;
 	}
+	stats_add(blocks_read, count);
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+static int disk_write(size_t block, size_t count, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.device) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block + count > disk.bcount || block + count < block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
-
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (disk.device->write(block, count, buf)) {
+		stats_error();
 		return -1;
 	}
+	stats_add(blocks_written, count);
 
 	return 0;
 }
 
+int block_write(size_t block, const void *buf)
+{
+	STATS_SCOPE(FS_OP_BLOCK_WRITE);
+	trace_io(FS_OP_BLOCK_WRITE, block, 1);
+
+	return disk_write(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	STATS_SCOPE(FS_OP_BLOCK_READ);
+	trace_io(FS_OP_BLOCK_READ, block, 1);
+
+	return disk_read(block, 1, buf);
+}
+
+int block_read_multi(size_t block, size_t count, void *buf)
+{
+	STATS_SCOPE(FS_OP_BLOCK_READ_MULTI);
+	trace_io(FS_OP_BLOCK_READ_MULTI, block, count);
+
+	return disk_read(block, count, buf);
+}
+
+int block_write_multi(size_t block, size_t count, const void *buf)
+{
+	STATS_SCOPE(FS_OP_BLOCK_WRITE_MULTI);
+	trace_io(FS_OP_BLOCK_WRITE_MULTI, block, count);
+
+	return disk_write(block, count, buf);
+}
@@ -2,10 +2,178 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * struct block_device - Implementation of a virtual disk
+ * @name: Short name of the implementation
+ * @open: Open virtual disk file @diskname and set *@bcount to its number of
+ *        blocks. Return -1 on failure, 0 otherwise.
+ * @close: Release the open virtual disk. Return -1 on failure, 0 otherwise.
+ * @read: Read the @count blocks starting at @block into @buf. Return -1 on
+ *        failure, 0 otherwise.
+ * @write: Write @buf into the @count blocks starting at @block. Return -1 on
+ *         failure, 0 otherwise.
+ *
+ * The block_*() functions check that a disk is open and that the blocks are
+ * within bounds before calling the implementation, which only handles one disk
+ * at a time.
+ */
+struct block_device {
+	const char *name;
+	int (*open)(const char *diskname, size_t *bcount);
+	int (*close)(void);
+	int (*read)(size_t block, size_t count, void *buf);
+	int (*write)(size_t block, size_t count, const void *buf);
+};
+
+/** Virtual disk accessed in place in its file (default) */
+extern const struct block_device block_file_device;
+
+/**
+ * Virtual disk loaded in memory when opened, and saved back to its file when
+ * closed if it was written to. Block I/O is a memory copy.
+ */
+extern const struct block_device block_ram_device;
+
+/**
+ * block_disk_set_device - Choose the implementation of virtual disks
+ * @device: Implementation used by the next block_disk_open(), NULL for
+ *          %block_file_device
+ *
+ * Return: -1 if a virtual disk is currently open. 0 otherwise.
+ */
+int block_disk_set_device(const struct block_device *device);
+
+/**
+ * block_disk_device - Get the implementation of virtual disks
+ *
+ * Return: the implementation of the currently open disk, or the one the next
+ * block_disk_open() will use if no disk is open.
+ */
+const struct block_device *block_disk_device(void);
+
+/**
+ * block_ram_save - Save the RAM disk to its file
+ *
+ * Write the blocks of the currently open %block_ram_device disk back to the
+ * virtual disk file it was loaded from, if they were written to since it was
+ * loaded or last saved.
+ *
+ * Return: -1 if no RAM disk is currently open or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_ram_save(void);
+
+/**
+ * struct block_sim_config - Behavior of the simulated disk
+ * @device: Backing device holding the blocks, NULL for %block_file_device
+ * @latency_us: Fixed service time of every I/O, in microseconds
+ * @bandwidth_mb_s: Transfer rate in MB/s, 0 for unlimited
+ * @seek_ns_per_block: Seek time per block of distance between the end of the
+ *                     previous I/O and the start of the next one, in ns
+ * @seek_max_us: Upper bound of the seek time in microseconds, 0 for none
+ */
+struct block_sim_config {
+	const struct block_device *device;
+	unsigned int latency_us;
+	unsigned int bandwidth_mb_s;
+	unsigned int seek_ns_per_block;
+	unsigned int seek_max_us;
+};
+
+/** Types of faults of the simulated disk */
+enum block_sim_fault_type {
+	/* Reads of the block fail */
+	BLOCK_SIM_READ_ERROR,
+	/* Writes to the block fail */
+	BLOCK_SIM_WRITE_ERROR,
+	/*
+	 * A write to the block only stores its first bytes and the power goes
+	 * out: later writes are dropped while reporting success, until the disk
+	 * is reopened
+	 */
+	BLOCK_SIM_TORN_WRITE,
+};
+
+/** Maximum number of faults of the simulated disk */
+#define BLOCK_SIM_MAX_FAULTS 16
+
+/**
+ * struct block_sim_fault - Fault of the simulated disk
+ * @type: Type of fault (see &enum block_sim_fault_type)
+ * @block: Block the fault is attached to
+ * @skip: Number of accesses of the type to @block that succeed before the
+ *        fault fires
+ * @bytes: Bytes of a torn write that reach the disk
+ */
+struct block_sim_fault {
+	int type;
+	size_t block;
+	unsigned int skip;
+	size_t bytes;
+};
+
+/**
+ * struct block_sim_stats - Activity of the simulated disk
+ * @ios: Number of block I/O operations
+ * @delay_ns: Total simulated service time
+ * @faults: Number of faults that fired
+ * @dropped_writes: Number of blocks written after a torn write
+ * @powered_off: Whether a torn write cut the power of the open disk
+ */
+struct block_sim_stats {
+	uint64_t ios;
+	uint64_t delay_ns;
+	uint64_t faults;
+	uint64_t dropped_writes;
+	int powered_off;
+};
+
+/**
+ * Virtual disk stored by another device, whose I/O is delayed and may fail
+ * as configured with block_sim_configure() and block_sim_inject(). I/O is
+ * serialized, as on a single-queue device.
+ */
+extern const struct block_device block_sim_device;
+
+/**
+ * block_sim_configure - Configure the simulated disk
+ * @config: Parameters, NULL to reset them all to zero
+ *
+ * Timing parameters apply to the next I/O, the backing device to the next
+ * block_disk_open().
+ */
+void block_sim_configure(const struct block_sim_config *config);
+
+/**
+ * block_sim_inject - Add a fault to the simulated disk
+ * @fault: Fault to inject
+ *
+ * Faults stay until block_sim_clear_faults(), except torn writes which fire
+ * only once.
+ *
+ * Return: -1 if @fault is invalid or if %BLOCK_SIM_MAX_FAULTS faults are
+ * already injected. 0 otherwise.
+ */
+int block_sim_inject(const struct block_sim_fault *fault);
+
+/**
+ * block_sim_clear_faults - Remove all faults of the simulated disk
+ *
+ * Also restores the power if a torn write cut it.
+ */
+void block_sim_clear_faults(void);
+
+/**
+ * block_sim_get_stats - Get the activity of the simulated disk
+ * @stats: Activity since the program started
+ */
+void block_sim_get_stats(struct block_sim_stats *stats);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -60,5 +228,33 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_read_multi - Read a run of consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of consecutive blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1 into
+ * buffer @buf (@count * %BLOCK_SIZE bytes) with a single read operation.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_multi(size_t block, size_t count, void *buf);
+
+/**
+ * block_write_multi - Write a run of consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of consecutive blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1 with a single write operation.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_multi(size_t block, size_t count, const void *buf);
+
 #endif /* _DISK_H */
 
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,8 +7,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "record.h"
+#include "stats.h"
 
 #define error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -15,12 +21,14 @@
 #define fs_error(...)				\
 {							\
 	error(__VA_ARGS__);	\
+	stats_error();					\
 	return -1;					\
 }
 
 #define fs_perror(...)				\
 {							\
 	perror(__VA_ARGS__);	\
+	stats_error();					\
 	return -1;					\
 }
 
@@ -30,6 +38,48 @@
 #define SIGNATURE 0x5346303531534345	// 'ECS150FS' in little-endian
 #define FAT_EOC 0xFFFF
 
+/* Optional on-disk features, flagged in the superblock */
+#define FEATURE_CSUM 0x1		// Data block checksum table
+#define FEATURE_REFCOUNT 0x2		// Data block reference count table
+#define FEATURES_SUPPORTED (FEATURE_CSUM | FEATURE_REFCOUNT)
+
+#define CSUM_PER_BLOCK (BLOCK_SIZE/4)
+#define CSUM_NONE 0u			// No checksum recorded for the block
+#define REFCOUNT_PER_BLOCK (BLOCK_SIZE/2)
+
+#define DEDUP_BUCKET_COUNT 4096
+
+/* Per-file flags, stored in the root directory entry */
+#define FILE_COMPRESSED 0x1		// Data is stored as compressed chunks
+#define FILE_SPARSE 0x2			// Some blocks are holes, listed in a hole map block
+
+#define HOLE_MAP_BITS (BLOCK_SIZE * 8)	// Blocks described by the hole map
+
+#define CHUNK_SIZE (8 * BLOCK_SIZE)	// Logical bytes per compressed chunk
+#define CHUNK_MAX_COUNT (BLOCK_SIZE/4)	// Chunks described by the index block
+
+#define COPY_BATCH_BLOCKS 32		// Blocks moved per batch by fs_copy_range()
+#define DEFRAG_BATCH_BLOCKS 32		// Blocks moved between two syncs by fs_defrag()
+
+#define CHECK_MAX_THREADS 8		// Threads walking chains in fs_check()
+
+/* Chains walked by fs_check(), in walking order: the tables, then the hole map and data of every file */
+#define CHAIN_REFCOUNT 1
+#define CHAIN_CSUM 2
+#define CHAIN_HOLE_MAP(i) (3 + 2 * (i))
+#define CHAIN_DATA(i) (4 + 2 * (i))
+#define CHAIN_COUNT (2 + 2 * FS_FILE_MAX_COUNT)
+
+/*
+* Bits of metadata_dirty: one per FAT block, the root directory, the superblock, one per checksum block, then one per
+* reference count block
+*/
+#define DIRTY_FAT_ALL 0xF
+#define DIRTY_RDIR (1 << 4)
+#define DIRTY_SUPER (1 << 5)
+#define DIRTY_CSUM(i) (1 << (6 + (i)))
+#define DIRTY_REFCOUNT(i) (1 << (14 + (i)))
+
 /* Data Structures */
 
 /**
@@ -43,7 +93,10 @@ struct superblock {
 	uint16_t data_blk;		// Data block start index
 	uint16_t data_blk_count;	// Data block start index
 	uint8_t  fat_blk_count;		// Number of blocks for FAT
-	uint8_t  unused[4079];		// Padding
+	uint32_t features;		// Optional features in use (FEATURE_*)
+	uint16_t csum_blk;		// First data block of the checksum table
+	uint16_t refcount_blk;		// First data block of the reference count table
+	uint8_t  unused[4071];		// Padding
 }__attribute__((packed));
 
 /**
@@ -53,6 +106,44 @@ struct superblock {
 */
 uint16_t FAT[4 * FS_FAT_ENTRY_MAX_COUNT]; // Maximum of 4 FAT blocks, 2048 entires each
 
+/**
+* With FEATURE_CSUM, the CRC32C of every data block is kept in a table indexed like the FAT. The table is stored in a
+* chain of data blocks starting at superblock.csum_blk, which the FAT marks as used so that the format stays readable
+* by implementations unaware of the feature. Blocks that were never written since being allocated have no checksum.
+*/
+uint32_t csum_table[4 * FS_FAT_ENTRY_MAX_COUNT];
+
+/**
+* With FEATURE_REFCOUNT, data blocks can be shared by several files. Since a FAT entry only has room for one next
+* block, files can only share the end of their chain. A block is referenced by root directory entries starting with
+* it and by FAT entries pointing to it; the table, stored like the checksum table from superblock.refcount_blk, counts
+* these references beyond the first one, so that 0 means a single reference (or a free block). A block is then
+* exclusive to a file if neither it nor any block preceding it in the file's chain has extra references. Shared blocks
+* are copied before being modified, and a block is only freed along with its last reference.
+*/
+uint16_t refcount_table[4 * FS_FAT_ENTRY_MAX_COUNT];
+
+/**
+* In dedup mode, the hash of every data block written is kept in memory, in a hash table chaining blocks of the same
+* bucket (chains end with FAT_EOC), to find blocks with identical content when a file is closed.
+*/
+struct dedup_index {
+	uint8_t  enabled;
+	uint8_t  indexed[4 * FS_FAT_ENTRY_MAX_COUNT];	// Block is in the index
+	uint32_t hash[4 * FS_FAT_ENTRY_MAX_COUNT];
+	uint16_t next[4 * FS_FAT_ENTRY_MAX_COUNT];	// Next block in the same bucket
+	uint16_t bucket[DEDUP_BUCKET_COUNT];		// First block of each bucket
+};
+
+/**
+* Free data blocks are counted as the FAT gets modified, so that neither fs_info() nor allocations scan the whole FAT.
+* Allocations stay first-fit: no data block before the hint is free.
+*/
+struct free_space {
+	int      count;		// Number of free data blocks
+	uint16_t hint;		// First data block that may be free
+};
+
 /**
 * The root directory is an array of 128 entries that describe the filesystem's contained files.
 * See HTML doc for format specifications
@@ -61,7 +152,9 @@ struct file_entry { // 32B
 	uint8_t  file_name[FS_FILENAME_LEN];
 	uint32_t file_size;		// Length 4 bytes file size
 	uint16_t data_blk;		// Index of the first data block
-	uint8_t  unused[10];
+	uint8_t  flags;			// Per-file flags (FILE_*)
+	uint16_t hole_blk;		// Data block holding the hole map (FILE_SPARSE)
+	uint8_t  unused[7];
 }__attribute__((packed));
 
 struct root_dir {
@@ -82,9 +175,105 @@ struct data_block {
 * The library must support a maximum of 32 file descriptors that can be open simultaneously.
 * A file descriptor is associated to a file and also contains a file offset.
 */
+/**
+* An FS_O_APPEND descriptor keeps the block that holds the end of its file. Appended bytes are copied in data and the
+* block is only written once full, or when the file is flushed for another operation. The file size in the root
+* directory only counts written bytes, the others are pending. Operations that move or modify the file's blocks drop
+* the tail, which is loaded again by the next append.
+*/
+struct append_tail {
+	uint8_t  loaded;		// The fields below describe the end of the file
+	uint16_t block;			// Block at position, FAT_EOC if not allocated yet
+	uint16_t prev;			// Block before it in the chain, FAT_EOC if none
+	uint32_t position;		// File offset of the block, a multiple of BLOCK_SIZE
+	uint32_t length;		// Bytes of the file in data, pending ones included
+	uint32_t size;			// File size when the tail was last written or loaded
+	uint8_t  data[BLOCK_SIZE];
+};
+
 struct file_descriptor {
 	struct file_entry* entry;
 	size_t  offset;
+	int     flags;			// FS_O_* flags given to fs_open_flags()
+	struct append_tail tail;	// FS_O_APPEND only
+};
+
+/**
+* A compressed file is split in chunks of CHUNK_SIZE logical bytes, each compressed independently so that any offset
+* can be reached by decompressing a single chunk. The first block of the file's chain is the chunk index, which holds
+* the end offset of every chunk in the compressed stream packed in the following blocks. A chunk whose compressed size
+* equals its logical size is stored raw.
+*
+* The last chunk used is kept decompressed, so that small sequential reads don't decompress it over and over.
+*/
+struct chunk_cache {
+	struct file_entry *entry;	// File whose index is loaded, NULL if none
+	uint32_t index[CHUNK_MAX_COUNT];
+	uint32_t chunk;			// Chunk held in data
+	uint8_t  loaded;		// data holds a chunk
+	uint8_t  data[CHUNK_SIZE];
+};
+
+/**
+* A sparse file has a hole map, a data block with one bit per block of the file which is set for holes. Holes have no
+* data block and read as zeros, so the chain only links the other blocks, in file order: the block at some position of
+* the file is found in the chain at that position minus the number of holes before it. The hole map of the last sparse
+* file used is kept in memory.
+*/
+struct hole_map {
+	struct file_entry *entry;	// File whose hole map is loaded, NULL if none
+	uint8_t dirty;			// bits were modified since the hole map was stored
+	uint8_t bits[BLOCK_SIZE];
+};
+
+/**
+* fs_defrag() may stop in the middle of a file. The cursor remembers the file being moved and the extent it is moved to,
+* whose first blocks already hold the start of the file's chain. It is checked again before being used, since the file
+* may have changed in between.
+*/
+struct defrag_cursor {
+	struct file_entry *entry;	// File being moved, NULL if none
+	uint16_t target;		// First block of the extent the file is moved to
+	uint32_t done;			// Blocks of the chain already in the extent
+};
+
+/**
+* fs_check() walks every chain from its first block, claiming the blocks it reaches in a map shared by the walking
+* threads. A block already claimed by the same chain closes a cycle, and one claimed by another chain is a cross-link,
+* unless reference counts say it is shared: the walk then goes on without claiming, as the rest of the chain belongs to
+* the chain that claimed it. Used blocks left unclaimed are leaked.
+*/
+enum chain_error {
+	CHAIN_OK,
+	CHAIN_BAD_POINTER,	// Block out of the data region, or free
+	CHAIN_CYCLE,
+	CHAIN_CROSS_LINK,
+};
+
+struct chain_check {
+	uint16_t start;		// First block, FAT_EOC if the chain is empty
+	uint16_t last_good;	// Last block before the error, FAT_EOC if there is none
+	uint32_t length;	// Blocks reached before the error
+	uint8_t  error;		// enum chain_error
+	uint8_t  too_short;	// Chain can't hold what its file or table needs
+	uint32_t capacity;	// Bytes the chain of a file can hold
+};
+
+struct checker {
+	uint16_t owner[4 * FS_FAT_ENTRY_MAX_COUNT];	// Chain that claimed each block, 0 if none
+	struct chain_check chain[CHAIN_COUNT + 1];
+	int next;					// Next chain to walk, taken by the threads
+	int repair;					// Cut chains at their error
+};
+
+/**
+* Batched operations look names up in an open addressing hash table of root directory entries, filled in a single pass
+* over the root directory. Entries are never removed: a deleted file keeps its slot, its empty name matching nothing.
+*/
+#define NAME_INDEX_SIZE (2 * FS_FILE_MAX_COUNT)
+
+struct name_index {
+	int16_t slot[NAME_INDEX_SIZE];	// Root directory entry, -1 if the slot is empty
 };
 
 /* Global Variables*/
@@ -92,9 +281,261 @@ struct superblock superblock;
 struct root_dir root_dir;
 struct data_block bounce;
 struct file_descriptor fd_list[FS_OPEN_MAX_COUNT];
+struct chunk_cache chunk_cache;
+struct hole_map hole_map;
+struct dedup_index dedup;
+struct free_space free_space;
+struct defrag_cursor defrag;
+struct checker checker;
+unsigned int metadata_dirty;	// Metadata blocks modified since last commit
 
 /* Helper Functions */
 
+/*
+* set_fat - Modify a FAT entry and remember that its FAT block is dirty
+* @index: FAT entry to modify
+* @value: New value of the entry
+*
+* Free space accounting follows data blocks being allocated or freed.
+*/
+void set_fat(uint16_t index, uint16_t value)
+{
+	if (index < superblock.data_blk_count && (FAT[index] == 0) != (value == 0)) {
+		if (value == 0) {
+			free_space.count++;
+			if (index < free_space.hint)
+				free_space.hint = index;
+		} else {
+			free_space.count--;
+		}
+	}
+
+	FAT[index] = value;
+	metadata_dirty |= 1 << (index / FS_FAT_ENTRY_MAX_COUNT);
+}
+
+/*
+* write_metadata - Write the modified FAT and root directory blocks
+*
+* Return: -1 if a block couldn't be written, 0 otherwise
+*/
+int write_metadata(void)
+{
+	if (metadata_dirty & DIRTY_SUPER) {
+		if (cache_write(0, &superblock) < 0)
+			return -1;
+	}
+
+	for (int i = 0; i < superblock.fat_blk_count; ++i) {
+		if (!(metadata_dirty & (1 << i)))
+			continue;
+		if (cache_write(i + 1, &(FAT[i * FS_FAT_ENTRY_MAX_COUNT])) < 0)
+			return -1;
+	}
+
+	if (metadata_dirty & DIRTY_RDIR) {
+		if (cache_write(superblock.rdir_blk, &root_dir) < 0)
+			return -1;
+	}
+
+	if (superblock.features & FEATURE_CSUM) {
+		uint16_t csum_block = superblock.csum_blk;
+		for (int i = 0; csum_block != FAT_EOC; ++i, csum_block = FAT[csum_block]) {
+			if (!(metadata_dirty & DIRTY_CSUM(i)))
+				continue;
+			if (cache_write(csum_block + superblock.data_blk, &csum_table[i * CSUM_PER_BLOCK]) < 0)
+				return -1;
+		}
+	}
+
+	if (superblock.features & FEATURE_REFCOUNT) {
+		uint16_t refcount_block = superblock.refcount_blk;
+		for (int i = 0; refcount_block != FAT_EOC; ++i, refcount_block = FAT[refcount_block]) {
+			if (!(metadata_dirty & DIRTY_REFCOUNT(i)))
+				continue;
+			if (cache_write(refcount_block + superblock.data_blk, &refcount_table[i * REFCOUNT_PER_BLOCK]) < 0)
+				return -1;
+		}
+	}
+
+	metadata_dirty = 0;
+
+	return 0;
+}
+
+/*
+* commit_metadata - Hand the modified metadata blocks over to the write-back cache
+*
+* Without write-back caching the metadata stays in memory until fs_umount() or fs_sync(). With it, dirty FAT and root
+* directory blocks are pushed into the cache so that the flusher batches them together with the data blocks.
+*
+* Return: -1 if a block couldn't be written to the cache, 0 otherwise
+*/
+int commit_metadata(void)
+{
+	if (!cache_is_enabled())
+		return 0;
+
+	return write_metadata();
+}
+
+/*
+* block_checksum - Compute the checksum recorded for a data block
+*/
+uint32_t block_checksum(const void *buf)
+{
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+
+	// Keep CSUM_NONE for blocks without checksum
+	return (crc == CSUM_NONE) ? ~CSUM_NONE : crc;
+}
+
+void set_csum(uint16_t index, uint32_t value)
+{
+	if (!(superblock.features & FEATURE_CSUM) || csum_table[index] == value)
+		return;
+
+	csum_table[index] = value;
+	metadata_dirty |= DIRTY_CSUM(index / CSUM_PER_BLOCK);
+}
+
+void set_refcount(uint16_t index, uint16_t value)
+{
+	refcount_table[index] = value;
+	metadata_dirty |= DIRTY_REFCOUNT(index / REFCOUNT_PER_BLOCK);
+}
+
+/* Dedup Index Helpers */
+
+void dedup_remove(uint16_t index)
+{
+	if (!dedup.indexed[index])
+		return;
+
+	uint16_t *link = &dedup.bucket[dedup.hash[index] % DEDUP_BUCKET_COUNT];
+	while (*link != index)
+		link = &dedup.next[*link];
+	*link = dedup.next[index];
+	dedup.indexed[index] = 0;
+}
+
+void dedup_insert(uint16_t index, uint32_t hash)
+{
+	dedup_remove(index);
+
+	uint16_t *bucket = &dedup.bucket[hash % DEDUP_BUCKET_COUNT];
+	dedup.hash[index] = hash;
+	dedup.next[index] = *bucket;
+	dedup.indexed[index] = 1;
+	*bucket = index;
+}
+
+/*
+* read_data_block - Read a data block and verify its checksum
+* @index: Index of the block in the data region
+* @buf: Data buffer to be filled with content of block
+*
+* Return: -1 if the block can't be read or doesn't match its checksum, 0 otherwise
+*/
+int read_data_block(uint16_t index, void *buf)
+{
+	if (cache_read(index + superblock.data_blk, buf) < 0)
+		return -1;
+
+	if ((superblock.features & FEATURE_CSUM) && csum_table[index] != CSUM_NONE
+	    && csum_table[index] != block_checksum(buf))
+		fs_error("Checksum mismatch on data block %d", index);
+
+	return 0;
+}
+
+/*
+* write_data_block - Write a data block and record its checksum
+* @index: Index of the block in the data region
+* @buf: Data buffer to write in the block
+*
+* Return: -1 if the block can't be written, 0 otherwise
+*/
+int write_data_block(uint16_t index, const void *buf)
+{
+	if (superblock.features & FEATURE_CSUM)
+		set_csum(index, block_checksum(buf));
+
+	if (dedup.enabled)
+		dedup_insert(index, crc32c(0, buf, BLOCK_SIZE));
+
+	return cache_write(index + superblock.data_blk, buf);
+}
+
+/*
+* read_data_blocks - Read a run of consecutive data blocks and verify their checksums
+* @index: Index of the first block in the data region
+* @count: Number of blocks to read
+* @buf: Data buffer to be filled with content of the blocks
+*
+* Return: -1 if the blocks can't be read or one doesn't match its checksum, 0 otherwise
+*/
+int read_data_blocks(uint16_t index, int count, void *buf)
+{
+	if (cache_read_multi(index + superblock.data_blk, count, buf) < 0)
+		return -1;
+
+	if (!(superblock.features & FEATURE_CSUM))
+		return 0;
+
+	for (int i = 0; i < count; ++i) {
+		const uint8_t *block = (const uint8_t *)buf + i * BLOCK_SIZE;
+		if (csum_table[index + i] != CSUM_NONE && csum_table[index + i] != block_checksum(block))
+			fs_error("Checksum mismatch on data block %d", index + i);
+	}
+
+	return 0;
+}
+
+/*
+* write_data_blocks - Write a run of consecutive data blocks and record their checksums
+* @index: Index of the first block in the data region
+* @count: Number of blocks to write
+* @buf: Data buffer to write in the blocks
+*
+* Return: -1 if the blocks can't be written, 0 otherwise
+*/
+int write_data_blocks(uint16_t index, int count, const void *buf)
+{
+	for (int i = 0; i < count; ++i) {
+		const uint8_t *block = (const uint8_t *)buf + i * BLOCK_SIZE;
+		if (superblock.features & FEATURE_CSUM)
+			set_csum(index + i, block_checksum(block));
+		if (dedup.enabled)
+			dedup_insert(index + i, crc32c(0, block, BLOCK_SIZE));
+	}
+
+	return cache_write_multi(index + superblock.data_blk, count, buf);
+}
+
+/*
+* find_free_block - Find the first unused data block
+*
+* Return: index of the block if successful, FAT_EOC if the disk is full
+*/
+uint16_t find_free_block(void)
+{
+	stats_add(alloc_scans, 1);
+
+	for (uint16_t index = free_space.hint; index < superblock.data_blk_count; ++index) {
+		if (FAT[index] == 0) {
+			stats_add(alloc_scan_steps, index - free_space.hint + 1);
+			free_space.hint = index;
+			return index;
+		}
+	}
+
+	stats_add(alloc_scan_steps, superblock.data_blk_count - free_space.hint);
+	free_space.hint = superblock.data_blk_count;
+
+	return FAT_EOC;
+}
+
 /*
 * fetch_next_block - Retrieve specified block from chainlinked FAT
 * @current_block:  The current block being read
@@ -111,132 +552,2284 @@ uint16_t fetch_data_block(uint16_t current_block, uint16_t FAT_entries_to_skip)
 	for (uint16_t i = 0; i < FAT_entries_to_skip; ++i) {
 		current_block = FAT[current_block];
 	}
+	stats_add(fat_steps, FAT_entries_to_skip);
 
 	return current_block;
 }
 
+/*
+* link_data_block - Append an unused data block to a chain
+* @current_block: Last block of the chain
+*
+* Return: appended block, FAT_EOC if the disk is full
+*/
 uint16_t link_data_block(uint16_t current_block)
 {
-	/* Loop through FAT to find first available block */
-	int free_index = 1;
-	for (; free_index < superblock.fat_blk_count * FS_FAT_ENTRY_MAX_COUNT; ++free_index) {
-		if (FAT[free_index] == 0)
-			break;
-	}
+	uint16_t free_index = find_free_block();
+	if (free_index == FAT_EOC)
+		return FAT_EOC;
 
 	// Link current FAT entry to new FAT entry and new FAT entry to end of chain
-	FAT[current_block] = free_index;
-	FAT[free_index] = FAT_EOC;
+	set_fat(current_block, free_index);
+	set_fat(free_index, FAT_EOC);
 
 	return free_index;
 }
 
+/*
+* create_data_block - Give the empty file open as @fd its first data block
+*
+* Return: new block, FAT_EOC if the disk is full
+*/
 uint16_t create_data_block(int fd)
 {
-	/* Loop through FAT to find first available block */
-	int free_index = 0;
-	for (; free_index < superblock.fat_blk_count * FS_FAT_ENTRY_MAX_COUNT; ++free_index) {
-		if (FAT[free_index] == 0)
-			break;
-	}
+	uint16_t free_index = find_free_block();
+	if (free_index == FAT_EOC)
+		return FAT_EOC;
 
 	// Link root directory entry to data block 
 	fd_list[fd].entry->data_blk = free_index;
+	metadata_dirty |= DIRTY_RDIR;
 
 	// Link new (only) FAT entry to end of chain
-	FAT[free_index] = FAT_EOC;
+	set_fat(free_index, FAT_EOC);
 
 	return free_index;
 }
 
-/* Filesystem Functions */
-int fs_mount(const char *diskname)
+/*
+* find_free_extent - Find a run of unused data blocks
+* @hint: Preferred first block of the run
+* @count: Length of the run
+*
+* Return: first block of the run at @hint if it is free, else of the first free run, FAT_EOC if there is none
+*/
+uint16_t find_free_extent(uint16_t hint, int count)
 {
-	/* Mount disk */
-	// Open file
-	if (block_disk_open(diskname) < 0)
-		fs_error("Couldn't open disk");
+	int run = 0;
 
-	// Read in superblock
-	if (block_read(0, &superblock) < 0)
-		fs_error("Couldn't read superblock");
+	stats_add(alloc_scans, 1);
 
-	// Read in root directory
-	if (block_read(superblock.rdir_blk, &root_dir) < 0)
-		fs_error("Couldn't read root directory");
+	for (int index = hint; index < superblock.data_blk_count && run < count && FAT[index] == 0; ++index)
+		run++;
+	stats_add(alloc_scan_steps, run + 1);
+	if (run == count)
+		return hint;
 
-	// Read FAT by iterating at a block-level
-	for (int i = 0; i < superblock.fat_blk_count; ++i) {
-		// Find the correct FAT block & pass the corresponding entry address as the buffer
-		if (block_read(i + 1, &(FAT[i * FS_FAT_ENTRY_MAX_COUNT])) < 0)
-			fs_error("Couldn't read FAT")
+	run = 0;
+	for (int index = 1; index < superblock.data_blk_count; ++index) {
+		run = (FAT[index] == 0) ? run + 1 : 0;
+		if (run == count) {
+			stats_add(alloc_scan_steps, index);
+			return index - count + 1;
+		}
 	}
+	stats_add(alloc_scan_steps, superblock.data_blk_count - 1);
 
-	/* Error checking */
-	// Check signature
-	if (superblock.sig != SIGNATURE)
-		fs_error("Filesystem has an invalid format");
+	return FAT_EOC;
+}
 
-	// Check disk size
-	if (superblock.total_blk_count != block_disk_count())
-		fs_error("Mismatched number of total blocks");
+/*
+* alloc_extent - Append unused data blocks to a chain, contiguously whenever possible
+* @last: Last block of the chain, FAT_EOC if the chain is empty
+* @count: Number of blocks to append, which must all be available
+*
+* The blocks are taken from a single free run, preferably the one right after @last. When free space is too
+* fragmented for such a run, they are taken one by one from the first free blocks.
+*
+* Return: first appended block
+*/
+uint16_t alloc_extent(uint16_t last, int count)
+{
+	uint16_t first = FAT_EOC;
+	uint16_t start = find_free_extent((last == FAT_EOC) ? 1 : last + 1, count);
 
-	/* Prepare file descriptors */
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		fd_list[i].entry = NULL;
-		fd_list[i].offset = 0;
+	for (int i = 0; i < count; ++i) {
+		uint16_t index = (start == FAT_EOC) ? find_free_block() : start + i;
+		set_fat(index, FAT_EOC);
+		if (last != FAT_EOC)
+			set_fat(last, index);
+		if (first == FAT_EOC)
+			first = index;
+		last = index;
 	}
 
-	return 0;
+	return first;
 }
 
-int fs_umount(void)
+/*
+* release_chain - Drop a reference to a chain of data blocks
+* @index: First block of the chain
+*
+* Blocks are freed until one that is still referenced from elsewhere, which keeps the rest of the chain alive.
+*/
+void release_chain(uint16_t index)
 {
-	/* Write back blocks */
-	// Root Directory
-	if (block_write(superblock.rdir_blk, &root_dir) < 0)
-		fs_error("Couldn't write over root directory");
+	while (index != FAT_EOC) {
+		if (refcount_table[index]) {
+			set_refcount(index, refcount_table[index] - 1);
+			return;
+		}
 
-	// FAT
-	for (int i = 0; i < superblock.fat_blk_count; ++i) {
-		// Find the correct FAT block & pass the corresponding entry address as the buffer
-		if (block_write(i + 1, &(FAT[i * FS_FAT_ENTRY_MAX_COUNT])) < 0)
-			fs_error("Couldn't write over FAT");
+		uint16_t next = FAT[index];
+		set_fat(index, 0x0);
+		set_csum(index, CSUM_NONE);
+		dedup_remove(index);
+		index = next;
 	}
+}
 
-	// Check for open fd
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		if (fd_list[i].entry != NULL)
-			fs_error("There exist open file descriptors");
+/*
+* count_free_blocks - Count unused data blocks, stopping once @needed were found
+*/
+int count_free_blocks(int needed)
+{
+	return (free_space.count < needed) ? free_space.count : needed;
+}
+
+/* Sharing Helpers */
+
+/*
+* alloc_refcount_table - Allocate the reference count table if the file system doesn't have one yet
+*
+* Return: -1 if there is not enough space for the table, 0 otherwise
+*/
+int alloc_refcount_table(void)
+{
+	uint16_t head = FAT_EOC, tail = FAT_EOC;
+
+	if (superblock.features & FEATURE_REFCOUNT)
+		return 0;
+
+	for (int i = 0; i * REFCOUNT_PER_BLOCK < superblock.data_blk_count; ++i) {
+		uint16_t index = find_free_block();
+		if (index == FAT_EOC) {
+			release_chain(head);
+			fs_error("Not enough space for the reference count table");
+		}
+
+		set_fat(index, FAT_EOC);
+		if (tail == FAT_EOC)
+			head = index;
+		else
+			set_fat(tail, index);
+		tail = index;
+		metadata_dirty |= DIRTY_REFCOUNT(i);
 	}
 
-	/* Empty all structs */
-	superblock = (const struct superblock){ 0 };
-	memset(FAT, 0, sizeof(FAT));
-	root_dir = (const struct root_dir){ 0 };
-	bounce = (const struct data_block){ 0 };
+	memset(refcount_table, 0, sizeof(refcount_table));
+	superblock.features |= FEATURE_REFCOUNT;
+	superblock.refcount_blk = head;
+	metadata_dirty |= DIRTY_SUPER;
 
 	return 0;
 }
 
-int fs_info(void)
+/*
+* first_shared_block - Find where the shared part of a file's chain starts
+*
+* Return: position in the chain of the first block with extra references, UINT32_MAX if there is none
+*/
+uint32_t first_shared_block(struct file_entry *entry)
 {
-	// Root Directory Traversal
-	int free_file_count = FS_FILE_MAX_COUNT;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (root_dir.file[i].file_name[0] == '\0')
-			continue;
-		free_file_count--;
-	}
+	uint32_t position = 0;
 
-	// FAT Traversal
-	int free_data_blk_count = superblock.data_blk_count;
-	for (int i = 0; i < superblock.data_blk_count; ++i) {
-		if (FAT[i] == '\0')
-			continue;
-		free_data_blk_count--;
+	if (!(superblock.features & FEATURE_REFCOUNT))
+		return UINT32_MAX;
+
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index], ++position) {
+		if (refcount_table[index])
+			return position;
 	}
 
+	return UINT32_MAX;
+}
+
+/*
+* unshare_block - Make a block of a file exclusive to it before it gets modified
+* @entry: File to modify
+* @block_offset: Position of the block in the file's chain
+*
+* Every block from the first shared one up to @block_offset is copied and the copies are linked in place of the
+* originals. The last copy keeps pointing to the original next block, which gains a reference.
+*
+* Return: index of the exclusive block at @block_offset if successful, FAT_EOC otherwise
+*/
+uint16_t unshare_block(struct file_entry *entry, uint32_t block_offset)
+{
+	uint16_t prev = FAT_EOC, index = entry->data_blk;
+	uint32_t i = 0;
+
+	/* Find the first shared block */
+	for (; i < block_offset && !refcount_table[index]; ++i) {
+		prev = index;
+		index = FAT[index];
+	}
+	if (!refcount_table[index])
+		return index;
+
+	int copies = block_offset - i + 1;
+	if (count_free_blocks(copies) < copies) {
+		error("Not enough space to copy shared blocks");
+		return FAT_EOC;
+	}
+
+	// The first copy takes over this file's reference to the shared block
+	set_refcount(index, refcount_table[index] - 1);
+
+	/* Copy it and the following ones up to @block_offset */
+	for (; i <= block_offset; ++i) {
+		uint16_t copy = find_free_block();
+		set_fat(copy, FAT[index]);
+		if (prev == FAT_EOC) {
+			entry->data_blk = copy;
+			metadata_dirty |= DIRTY_RDIR;
+		} else {
+			set_fat(prev, copy);
+		}
+
+		if (read_data_block(index, &bounce) < 0 || write_data_block(copy, &bounce) < 0)
+			return FAT_EOC;
+
+		prev = copy;
+		index = FAT[copy];
+	}
+
+	// The last copy adds a reference to the rest of the chain
+	if (index != FAT_EOC)
+		set_refcount(index, refcount_table[index] + 1);
+
+	return prev;
+}
+
+/*
+* dedup_file - Share the end of a file's chain with identical blocks of other files
+* @entry: File to deduplicate
+*
+* Walk the chain backwards: the last block may be replaced by any identical block ending another chain, and each
+* preceding block by an identical block pointing to the replacement of its successor. Only blocks with a single
+* reference can be replaced, as the other references to a block can't be found. The walk stops at the first block
+* without a twin, since none of its predecessors can have one.
+*
+* Return: number of blocks freed if successful, -1 otherwise
+*/
+int dedup_file(struct file_entry *entry)
+{
+	static uint16_t chain[4 * FS_FAT_ENTRY_MAX_COUNT];
+	static struct data_block twin;
+	int length = 0, freed = 0;
+	uint16_t target = FAT_EOC;	// Block the twin must point to
+
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index])
+		chain[length++] = index;
+
+	for (int k = length - 1; k >= 0; --k) {
+		uint16_t index = chain[k];
+
+		// Already shared
+		if (refcount_table[index]) {
+			target = index;
+			continue;
+		}
+
+		if (read_data_block(index, &bounce) < 0)
+			return -1;
+		if (!dedup.indexed[index])
+			dedup_insert(index, crc32c(0, &bounce, BLOCK_SIZE));
+
+		/* Look for a twin in the same bucket */
+		uint16_t candidate = dedup.bucket[dedup.hash[index] % DEDUP_BUCKET_COUNT];
+		for (; candidate != FAT_EOC; candidate = dedup.next[candidate]) {
+			if (candidate == index || FAT[candidate] != target || dedup.hash[candidate] != dedup.hash[index])
+				continue;
+			if (read_data_block(candidate, &twin) < 0)
+				return -1;
+			if (memcmp(&twin, &bounce, BLOCK_SIZE) == 0)
+				break;
+		}
+		if (candidate == FAT_EOC)
+			break;
+
+		/* Replace the block by its twin */
+		if (k == 0) {
+			entry->data_blk = candidate;
+			metadata_dirty |= DIRTY_RDIR;
+		} else {
+			set_fat(chain[k - 1], candidate);
+		}
+		set_refcount(candidate, refcount_table[candidate] + 1);
+		if (target != FAT_EOC)
+			set_refcount(target, refcount_table[target] - 1);
+		set_fat(index, 0x0);
+		set_csum(index, CSUM_NONE);
+		dedup_remove(index);
+		freed++;
+
+		target = candidate;
+	}
+
+	return freed;
+}
+
+/* Compression Helpers */
+
+uint32_t chunk_start(uint32_t chunk)
+{
+	return chunk ? chunk_cache.index[chunk - 1] : 0;
+}
+
+/*
+* load_chunk_index - Make the chunk cache describe the compressed file @entry
+*
+* Return: -1 if the index block can't be read, 0 otherwise
+*/
+int load_chunk_index(struct file_entry *entry)
+{
+	if (chunk_cache.entry == entry)
+		return 0;
+
+	chunk_cache.entry = NULL;
+	chunk_cache.loaded = 0;
+	memset(chunk_cache.index, 0, sizeof(chunk_cache.index));
+
+	if (entry->data_blk != FAT_EOC && read_data_block(entry->data_blk, chunk_cache.index) < 0)
+		return -1;
+
+	chunk_cache.entry = entry;
+
+	return 0;
+}
+
+/*
+* load_chunk - Decompress a chunk of the compressed file @entry into the chunk cache
+* @entry: File to read from
+* @chunk: Chunk to decompress, which must lie within the file
+*
+* Return: -1 if the chunk can't be read or is corrupted, 0 otherwise
+*/
+int load_chunk(struct file_entry *entry, uint32_t chunk)
+{
+	static uint8_t packed[CHUNK_SIZE + BLOCK_SIZE];
+
+	if (load_chunk_index(entry) < 0)
+		return -1;
+
+	if (chunk_cache.loaded && chunk_cache.chunk == chunk)
+		return 0;
+
+	uint32_t start = chunk_start(chunk);
+	uint32_t end = chunk_cache.index[chunk];
+	uint32_t logical = entry->file_size - chunk * CHUNK_SIZE;
+	if (logical > CHUNK_SIZE)
+		logical = CHUNK_SIZE;
+	if (end < start || end - start > logical)
+		fs_error("Corrupted chunk index");
+
+	/* Read the blocks holding the compressed chunk (the stream starts after the index block) */
+	uint16_t block = fetch_data_block(entry->data_blk, 1 + start / BLOCK_SIZE);
+	uint32_t block_count = (end - 1) / BLOCK_SIZE - start / BLOCK_SIZE + 1;
+	for (uint32_t i = 0; i < block_count; ++i, block = FAT[block]) {
+		if (block == FAT_EOC || read_data_block(block, &packed[i * BLOCK_SIZE]) < 0)
+			fs_error("Couldn't read chunk %u", chunk);
+	}
+
+	chunk_cache.loaded = 0;
+	uint8_t *src = &packed[start % BLOCK_SIZE];
+	if (end - start == logical)
+		memcpy(chunk_cache.data, src, logical);
+	else if (lz_decompress(src, end - start, chunk_cache.data, CHUNK_SIZE) != (int)logical)
+		fs_error("Corrupted chunk %u", chunk);
+
+	chunk_cache.chunk = chunk;
+	chunk_cache.loaded = 1;
+
+	return 0;
+}
+
+int read_compressed(int fd, void *buf, size_t count)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	size_t counted = 0;
+
+	if (fd_list[fd].offset >= entry->file_size)
+		return 0;
+	if (fd_list[fd].offset + count > entry->file_size)
+		count = entry->file_size - fd_list[fd].offset;
+
+	while (counted < count) {
+		uint32_t chunk = fd_list[fd].offset / CHUNK_SIZE;
+		size_t chunk_offset = fd_list[fd].offset % CHUNK_SIZE;
+		size_t read_count = CHUNK_SIZE - chunk_offset;
+		if (read_count > count - counted)
+			read_count = count - counted;
+
+		if (load_chunk(entry, chunk) < 0)
+			return -1;
+
+		memcpy((uint8_t *)buf + counted, &chunk_cache.data[chunk_offset], read_count);
+		counted += read_count;
+		fd_list[fd].offset += read_count;
+	}
+
+	return counted;
+}
+
+/*
+* write_stream - Write compressed bytes into the chain of a compressed file
+* @entry: File to write to, whose chain already holds enough blocks
+* @position: Offset in the compressed stream
+* @data: Compressed bytes
+* @length: Number of bytes in @data
+*
+* Only the first block may hold bytes preceding @position that must be preserved; the stream ends with @data, so the
+* last block is padded with zeros rather than read back.
+*
+* Return: -1 if a block couldn't be accessed, 0 otherwise
+*/
+int write_stream(struct file_entry *entry, uint32_t position, const uint8_t *data, uint32_t length)
+{
+	uint16_t block = fetch_data_block(entry->data_blk, 1 + position / BLOCK_SIZE);
+	uint32_t reduced_offset = position % BLOCK_SIZE;
+	uint32_t counted = 0;
+
+	while (counted < length) {
+		uint32_t write_count = BLOCK_SIZE - reduced_offset;
+		if (write_count > length - counted)
+			write_count = length - counted;
+
+		if (reduced_offset) {
+			if (read_data_block(block, &bounce) < 0)
+				return -1;
+		}
+		if (reduced_offset + write_count < BLOCK_SIZE)
+			memset(&bounce.byte[reduced_offset + write_count], 0, BLOCK_SIZE - reduced_offset - write_count);
+		memcpy(&bounce.byte[reduced_offset], data + counted, write_count);
+		stats_add(bounce_copies, 1);
+
+		if (write_data_block(block, &bounce) < 0)
+			return -1;
+
+		counted += write_count;
+		reduced_offset = 0;
+		block = FAT[block];
+	}
+
+	return 0;
+}
+
+/*
+* write_compressed - Write to a compressed file
+*
+* Every chunk from the one holding the file offset up to the end of the file is decompressed, patched, recompressed and
+* packed again, since its compressed size may change. Appending thus only recompresses the last chunk.
+*
+* Return: number of bytes written if successful, -1 otherwise
+*/
+int write_compressed(int fd, const void *buf, size_t count)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	size_t offset = fd_list[fd].offset;
+	size_t new_size = (offset + count > entry->file_size) ? offset + count : entry->file_size;
+	// Past the end of file, the chunk holding the end of file gets rewritten too, padded with zeros
+	uint32_t first_chunk = ((offset < entry->file_size) ? offset : entry->file_size) / CHUNK_SIZE;
+	uint32_t old_chunk_count = (entry->file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	uint32_t new_chunk_count = (new_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	if (new_chunk_count > CHUNK_MAX_COUNT)
+		fs_error("Compressed files are limited to %d bytes", CHUNK_MAX_COUNT * CHUNK_SIZE);
+
+	if (load_chunk_index(entry) < 0)
+		return -1;
+
+	// The chain gets rewritten in place, so it must not be shared
+	if (entry->data_blk != FAT_EOC) {
+		uint32_t last_block = 0;
+		for (uint16_t index = entry->data_blk; FAT[index] != FAT_EOC; index = FAT[index])
+			last_block++;
+		if (unshare_block(entry, last_block) == FAT_EOC)
+			return -1;
+	}
+
+	/* Gather the logical content of the rewritten chunks */
+	size_t tail_size = new_size - (size_t)first_chunk * CHUNK_SIZE;
+	uint8_t *tail = calloc(1, tail_size);
+	uint8_t *packed = malloc(tail_size + 1);
+	if (!tail || !packed) {
+		free(tail);
+		free(packed);
+		fs_perror("malloc");
+	}
+
+	for (uint32_t chunk = first_chunk; chunk < old_chunk_count; ++chunk) {
+		if (load_chunk(entry, chunk) < 0)
+			goto fail;
+		uint32_t logical = entry->file_size - chunk * CHUNK_SIZE;
+		memcpy(&tail[(chunk - first_chunk) * CHUNK_SIZE], chunk_cache.data,
+		       logical < CHUNK_SIZE ? logical : CHUNK_SIZE);
+	}
+	memcpy(&tail[offset - (size_t)first_chunk * CHUNK_SIZE], buf, count);
+
+	/* Compress them back to back */
+	uint32_t position = chunk_start(first_chunk);
+	uint32_t packed_size = 0;
+	for (uint32_t chunk = first_chunk; chunk < new_chunk_count; ++chunk) {
+		uint8_t *src = &tail[(chunk - first_chunk) * CHUNK_SIZE];
+		size_t logical = new_size - (size_t)chunk * CHUNK_SIZE;
+		if (logical > CHUNK_SIZE)
+			logical = CHUNK_SIZE;
+
+		// Store the chunk raw unless compression makes it smaller
+		size_t compressed = lz_compress(src, logical, &packed[packed_size], logical - 1);
+		if (compressed == 0) {
+			memcpy(&packed[packed_size], src, logical);
+			compressed = logical;
+		}
+		packed_size += compressed;
+		chunk_cache.index[chunk] = position + packed_size;
+	}
+
+	/* Resize the chain to the index block plus the compressed stream */
+	int needed = 1 + (position + packed_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int have = 0;
+	uint16_t last = FAT_EOC;
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index], ++have) {
+		if (have == needed - 1)
+			last = index;
+	}
+
+	if (needed > have) {
+		if (count_free_blocks(needed - have) < needed - have) {
+			error("Not enough space on disk");
+			goto fail;
+		}
+		if (entry->data_blk == FAT_EOC) {
+			last = create_data_block(fd);
+			have = 1;
+		} else {
+			last = fetch_data_block(entry->data_blk, have - 1);
+		}
+		for (; have < needed; ++have)
+			last = link_data_block(last);
+	} else if (needed < have) {
+		release_chain(FAT[last]);
+		set_fat(last, FAT_EOC);
+	}
+
+	if (write_stream(entry, position, packed, packed_size) < 0
+	    || write_data_block(entry->data_blk, chunk_cache.index) < 0)
+		goto fail;
+
+	free(tail);
+	free(packed);
+
+	chunk_cache.loaded = 0;
+	fd_list[fd].offset += count;
+	if (entry->file_size != new_size) {
+		entry->file_size = new_size;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return count;
+
+fail:
+	// The on-disk index wasn't modified, forget the in-memory one
+	chunk_cache.entry = NULL;
+	free(tail);
+	free(packed);
+	return -1;
+}
+
+/* Sparse File Helpers */
+
+/*
+* load_hole_map - Make the in-memory hole map describe the file @entry
+*
+* Files that are not sparse get an empty hole map.
+*
+* Return: -1 if the hole map block can't be read, 0 otherwise
+*/
+int load_hole_map(struct file_entry *entry)
+{
+	if (hole_map.entry == entry)
+		return 0;
+
+	hole_map.entry = NULL;
+	hole_map.dirty = 0;
+	memset(hole_map.bits, 0, sizeof(hole_map.bits));
+
+	if ((entry->flags & FILE_SPARSE) && read_data_block(entry->hole_blk, hole_map.bits) < 0)
+		return -1;
+
+	hole_map.entry = entry;
+
+	return 0;
+}
+
+/*
+* store_hole_map - Write the in-memory hole map to a hole map block
+*
+* The block is kept out of the dedup index, since it gets modified in place.
+*
+* Return: -1 if the block can't be written, 0 otherwise
+*/
+int store_hole_map(uint16_t block)
+{
+	if (superblock.features & FEATURE_CSUM)
+		set_csum(block, block_checksum(hole_map.bits));
+
+	hole_map.dirty = 0;
+
+	return cache_write(block + superblock.data_blk, hole_map.bits);
+}
+
+int is_hole(uint32_t position)
+{
+	return position < HOLE_MAP_BITS && (hole_map.bits[position / 8] & (1 << (position % 8)));
+}
+
+void set_hole(uint32_t position, int hole)
+{
+	hole_map.dirty = 1;
+	if (hole)
+		hole_map.bits[position / 8] |= 1 << (position % 8);
+	else
+		hole_map.bits[position / 8] &= ~(1 << (position % 8));
+}
+
+/*
+* count_holes - Count the holes before @position in the loaded hole map
+*/
+uint32_t count_holes(uint32_t position)
+{
+	uint32_t holes = 0, i = 0;
+
+	if (position > HOLE_MAP_BITS)
+		position = HOLE_MAP_BITS;
+
+	for (; i + 64 <= position; i += 64) {
+		uint64_t word;
+		memcpy(&word, &hole_map.bits[i / 8], sizeof(word));
+		holes += __builtin_popcountll(word);
+	}
+	for (; i < position; ++i)
+		holes += is_hole(i);
+
+	return holes;
+}
+
+/*
+* chain_length - Count the data blocks linked in a file's chain
+*/
+uint32_t chain_length(struct file_entry *entry)
+{
+	uint32_t length = 0;
+
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index])
+		length++;
+
+	return length;
+}
+
+/*
+* make_sparse - Give a file a hole map, and load it
+*
+* Return: -1 if there is no space for the hole map, 0 otherwise
+*/
+int make_sparse(struct file_entry *entry)
+{
+	if (entry->flags & FILE_SPARSE)
+		return load_hole_map(entry);
+
+	uint16_t block = find_free_block();
+	if (block == FAT_EOC)
+		fs_error("Not enough space for the hole map");
+	set_fat(block, FAT_EOC);
+
+	entry->hole_blk = block;
+	entry->flags |= FILE_SPARSE;
+	metadata_dirty |= DIRTY_RDIR;
+
+	hole_map.entry = entry;
+	memset(hole_map.bits, 0, sizeof(hole_map.bits));
+
+	return store_hole_map(block);
+}
+
+/*
+* seek_chain - Move a cursor along a file's chain
+* @entry: File whose chain is walked
+* @cursor_position: Position in the chain of the block at @cursor_block
+* @cursor_block: Block at the cursor, FAT_EOC to start from the first block
+* @position: Position to reach in the chain
+*
+* Return: block at @position, FAT_EOC if the chain is shorter
+*/
+uint16_t seek_chain(struct file_entry *entry, uint32_t *cursor_position, uint16_t *cursor_block, uint32_t position)
+{
+	if (*cursor_block == FAT_EOC || *cursor_position > position) {
+		*cursor_position = 0;
+		*cursor_block = entry->data_blk;
+	}
+
+	uint32_t start = *cursor_position;
+	for (; *cursor_position < position && *cursor_block != FAT_EOC; ++*cursor_position)
+		*cursor_block = FAT[*cursor_block];
+	stats_add(fat_steps, *cursor_position - start);
+
+	return *cursor_block;
+}
+
+/*
+* write_range - Write to an uncompressed file that may have holes, block by block
+* @entry: File to write to
+* @offset: Offset of the range in the file
+* @buf: Data to write, NULL to zero the range in the blocks that exist without filling holes
+* @count: Number of bytes to write
+*
+* Blocks written over holes or past the end of the chain are allocated and linked at their place in the chain, and
+* start zeroed rather than being read. Blocks are copied before being modified if other files share them.
+*
+* Return: number of bytes written, which is smaller than @count if the disk is full, -1 if a block can't be accessed
+*/
+int write_range(struct file_entry *entry, size_t offset, const uint8_t *buf, size_t count)
+{
+	if (load_hole_map(entry) < 0)
+		return -1;
+
+	uint32_t logical = chain_length(entry) + count_holes(HOLE_MAP_BITS);	// Blocks and holes of the file
+	uint32_t shared_from = first_shared_block(entry);
+	uint32_t position = offset / BLOCK_SIZE;
+	uint32_t holes = count_holes(position);	// Holes before position that are left unfilled
+	uint32_t cursor_position = 0;
+	uint16_t cursor_block = FAT_EOC;
+	size_t counted = 0;
+
+	for (size_t reduced_offset = offset % BLOCK_SIZE; counted < count; ++position, reduced_offset = 0) {
+		size_t write_count = BLOCK_SIZE - reduced_offset;
+		if (write_count > count - counted)
+			write_count = count - counted;
+
+		int exists = position < logical && !is_hole(position);
+		uint32_t chain_position = position - holes;
+		uint16_t block;
+
+		if (!exists && buf == NULL) {
+			holes += position < logical;
+			counted += write_count;
+			continue;
+		}
+
+		if (exists) {
+			// Copy the block first if other files share it
+			if (chain_position >= shared_from) {
+				block = unshare_block(entry, chain_position);
+				if (block == FAT_EOC)
+					return -1;
+				shared_from = chain_position + 1;
+				cursor_position = chain_position;
+				cursor_block = block;
+			} else {
+				block = seek_chain(entry, &cursor_position, &cursor_block, chain_position);
+			}
+
+			if (write_count < BLOCK_SIZE && read_data_block(block, &bounce) < 0)
+				return -1;
+		} else {
+			// The previous block of the chain gets linked to the new one, so it must not be shared
+			uint16_t prev = FAT_EOC;
+			if (chain_position > 0) {
+				if (chain_position - 1 >= shared_from) {
+					prev = unshare_block(entry, chain_position - 1);
+					if (prev == FAT_EOC)
+						return -1;
+				} else {
+					prev = seek_chain(entry, &cursor_position, &cursor_block, chain_position - 1);
+				}
+			}
+
+			block = find_free_block();
+			if (block == FAT_EOC) {
+				error("Disk is full");
+				break;
+			}
+
+			/* Link the new block at its place in the chain */
+			if (prev == FAT_EOC) {
+				set_fat(block, entry->data_blk);
+				entry->data_blk = block;
+				metadata_dirty |= DIRTY_RDIR;
+			} else {
+				set_fat(block, FAT[prev]);
+				set_fat(prev, block);
+			}
+			if (shared_from != UINT32_MAX)
+				shared_from++;
+			if (position < logical)
+				set_hole(position, 0);
+			else
+				logical++;
+			cursor_position = chain_position;
+			cursor_block = block;
+
+			memset(&bounce, 0, BLOCK_SIZE);
+		}
+
+		if (buf)
+			memcpy(&bounce.byte[reduced_offset], buf + counted, write_count);
+		else
+			memset(&bounce.byte[reduced_offset], 0, write_count);
+		stats_add(bounce_copies, 1);
+		if (write_data_block(block, &bounce) < 0)
+			return -1;
+
+		counted += write_count;
+	}
+
+	return counted;
+}
+
+/*
+* extend_file - Extend an uncompressed file up to @new_size with zeros
+*
+* Bytes past the end of file in the blocks that exist, such as the end of the last block or blocks reserved by
+* fs_fallocate(), are zeroed. The file gets holes for the blocks that don't exist yet.
+*
+* Return: -1 if the file couldn't be extended, 0 otherwise
+*/
+int extend_file(struct file_entry *entry, size_t new_size)
+{
+	if (new_size > (size_t)HOLE_MAP_BITS * BLOCK_SIZE)
+		fs_error("Sparse files are limited to %d bytes", HOLE_MAP_BITS * BLOCK_SIZE);
+
+	if (load_hole_map(entry) < 0)
+		return -1;
+
+	uint32_t logical = chain_length(entry) + count_holes(HOLE_MAP_BITS);
+	uint32_t new_logical = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	/* Zero the blocks that exist */
+	size_t zero_end = (size_t)logical * BLOCK_SIZE;
+	if (zero_end > new_size)
+		zero_end = new_size;
+	if (zero_end > entry->file_size && write_range(entry, entry->file_size, NULL, zero_end - entry->file_size) < 0)
+		return -1;
+
+	/* Punch holes for the others */
+	if (new_logical > logical) {
+		if (make_sparse(entry) < 0)
+			return -1;
+		for (uint32_t position = logical; position < new_logical; ++position)
+			set_hole(position, 1);
+		if (store_hole_map(entry->hole_blk) < 0)
+			return -1;
+	}
+
+	entry->file_size = new_size;
+	metadata_dirty |= DIRTY_RDIR;
+
+	return 0;
+}
+
+/*
+* undo_extend - Bring a file extended by extend_file() back to @old_size
+* @entry: Extended file, whose hole map is loaded
+* @old_size: Size of the file before it was extended
+* @was_sparse: Whether the file had a hole map before it was extended
+*
+* The holes past the old end of file are forgotten, and so is the hole map if extending the file created it. Blocks
+* that existed past the old end of file stay reserved, only their zeroed bytes past it are kept.
+*/
+void undo_extend(struct file_entry *entry, size_t old_size, int was_sparse)
+{
+	for (uint32_t position = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE; position < HOLE_MAP_BITS; ++position) {
+		if (is_hole(position))
+			set_hole(position, 0);
+	}
+
+	if (!was_sparse && (entry->flags & FILE_SPARSE)) {
+		release_chain(entry->hole_blk);
+		entry->flags &= ~FILE_SPARSE;
+		hole_map.entry = NULL;
+		hole_map.dirty = 0;
+	}
+
+	entry->file_size = old_size;
+	metadata_dirty |= DIRTY_RDIR;
+}
+
+/*
+* write_sparse - Write to an uncompressed file past its end or with holes
+*
+* A write past the end of file that can't write anything, as the disk is full, leaves the file as it was.
+*
+* Return: number of bytes written if successful, -1 otherwise
+*/
+int write_sparse(int fd, const void *buf, size_t count)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	size_t offset = fd_list[fd].offset;
+
+	if (offset + count > (size_t)HOLE_MAP_BITS * BLOCK_SIZE)
+		fs_error("Sparse files are limited to %d bytes", HOLE_MAP_BITS * BLOCK_SIZE);
+
+	size_t old_size = entry->file_size;
+	int was_sparse = entry->flags & FILE_SPARSE;
+	if (offset > old_size && extend_file(entry, offset) < 0)
+		return -1;
+
+	int written = write_range(entry, offset, buf, count);
+	if (written < 0)
+		return -1;
+
+	if (written == 0 && entry->file_size > old_size)
+		undo_extend(entry, old_size, was_sparse);
+
+	fd_list[fd].offset += written;
+	if (written > 0 && entry->file_size < fd_list[fd].offset) {
+		entry->file_size = fd_list[fd].offset;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	if (hole_map.dirty && store_hole_map(entry->hole_blk) < 0)
+		return -1;
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return written;
+}
+
+/*
+* read_sparse - Read from a sparse file, holes being filled with zeros without any disk access
+*
+* Return: number of bytes read if successful, -1 otherwise
+*/
+int read_sparse(int fd, void *buf, size_t count)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	size_t counted = 0;
+
+	if (fd_list[fd].offset >= entry->file_size)
+		return 0;
+	if (count > entry->file_size - fd_list[fd].offset)
+		count = entry->file_size - fd_list[fd].offset;
+
+	if (load_hole_map(entry) < 0)
+		return -1;
+
+	uint32_t position = fd_list[fd].offset / BLOCK_SIZE;
+	uint32_t holes = count_holes(position);
+	uint32_t cursor_position = 0;
+	uint16_t cursor_block = FAT_EOC;
+
+	for (size_t reduced_offset = fd_list[fd].offset % BLOCK_SIZE; counted < count; ++position, reduced_offset = 0) {
+		size_t read_count = BLOCK_SIZE - reduced_offset;
+		if (read_count > count - counted)
+			read_count = count - counted;
+
+		if (is_hole(position)) {
+			memset((uint8_t *)buf + counted, 0, read_count);
+			holes++;
+		} else {
+			uint16_t block = seek_chain(entry, &cursor_position, &cursor_block, position - holes);
+			if (read_data_block(block, &bounce) < 0)
+				return -1;
+			memcpy((uint8_t *)buf + counted, &bounce.byte[reduced_offset], read_count);
+			stats_add(bounce_copies, 1);
+		}
+
+		counted += read_count;
+		fd_list[fd].offset += read_count;
+	}
+
+	return counted;
+}
+
+/* Append Helpers */
+
+/*
+* flush_tail - Write the pending bytes of an FS_O_APPEND descriptor's tail block
+* @fd: File descriptor
+* @forget: Drop the tail as well, because the file's blocks are about to be moved or modified
+*
+* Return: -1 if the block couldn't be written, 0 otherwise
+*/
+int flush_tail(int fd, int forget)
+{
+	struct append_tail *tail = &fd_list[fd].tail;
+
+	if (!tail->loaded)
+		return 0;
+
+	if (tail->position + tail->length > tail->size) {
+		if (write_data_block(tail->block, tail->data) < 0)
+			return -1;
+		tail->size = tail->position + tail->length;
+		fd_list[fd].entry->file_size = tail->size;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	if (forget)
+		tail->loaded = 0;
+
+	return 0;
+}
+
+/*
+* flush_appends - Flush the tail blocks of the FS_O_APPEND descriptors open on a file
+* @entry: File to flush, NULL for all files
+* @forget: As for flush_tail()
+*
+* Return: -1 if a block couldn't be written, 0 otherwise
+*/
+int flush_appends(struct file_entry *entry, int forget)
+{
+	int ret = 0;
+
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; ++fd) {
+		if (fd_list[fd].entry != NULL && (entry == NULL || fd_list[fd].entry == entry)
+		    && flush_tail(fd, forget) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+* pending_appends - Count the bytes appended to a file that are still in tail blocks
+*/
+uint32_t pending_appends(struct file_entry *entry)
+{
+	uint32_t pending = 0;
+
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; ++fd) {
+		struct append_tail *tail = &fd_list[fd].tail;
+		if (fd_list[fd].entry == entry && tail->loaded)
+			pending += tail->position + tail->length - tail->size;
+	}
+
+	return pending;
+}
+
+/*
+* load_tail - Find the block holding the end of the file of an FS_O_APPEND descriptor
+* @fd: File descriptor
+*
+* The block is made exclusive to the file, as is the block before it when the file ends on a block boundary, since a
+* new block will be linked to it.
+*
+* Return: -1 if the block couldn't be read or copied, 0 otherwise
+*/
+int load_tail(int fd)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	struct append_tail *tail = &fd_list[fd].tail;
+	uint32_t block_offset = entry->file_size / BLOCK_SIZE;
+
+	tail->prev = FAT_EOC;
+	tail->block = entry->data_blk;
+	for (uint32_t i = 0; i < block_offset && tail->block != FAT_EOC; ++i) {
+		tail->prev = tail->block;
+		tail->block = FAT[tail->block];
+	}
+	tail->position = block_offset * BLOCK_SIZE;
+	tail->length = entry->file_size - tail->position;
+	tail->size = entry->file_size;
+
+	if (tail->block == FAT_EOC && tail->length)
+		fs_error("Chain is shorter than the file");
+
+	// Blocks reserved by fs_fallocate() may follow, shared with a clone
+	uint32_t shared_from = first_shared_block(entry);
+	if (tail->block != FAT_EOC && block_offset >= shared_from) {
+		tail->block = unshare_block(entry, block_offset);
+		if (tail->block == FAT_EOC)
+			fs_error("unshare_block");
+	} else if (tail->block == FAT_EOC && tail->prev != FAT_EOC && block_offset - 1 >= shared_from) {
+		tail->prev = unshare_block(entry, block_offset - 1);
+		if (tail->prev == FAT_EOC)
+			fs_error("unshare_block");
+	}
+
+	if (tail->length) {
+		if (read_data_block(tail->block, tail->data) < 0)
+			fs_error("block_read");
+	} else {
+		memset(tail->data, 0, BLOCK_SIZE);
+	}
+
+	tail->loaded = 1;
+
+	return 0;
+}
+
+/*
+* write_append - Write at the end of a file through the tail block of an FS_O_APPEND descriptor
+* @fd: File descriptor
+* @buf: Data buffer to write
+* @count: Number of bytes to write
+*
+* Return: number of bytes written, -1 if the tail block couldn't be loaded or written
+*/
+int write_append(int fd, const uint8_t *buf, size_t count)
+{
+	struct file_entry *entry = fd_list[fd].entry;
+	struct append_tail *tail = &fd_list[fd].tail;
+	size_t counted = 0;
+
+	// Only one descriptor at a time can hold the end of the file
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (i != fd && fd_list[i].entry == entry && flush_tail(i, 1) < 0)
+			fs_error("Couldn't write appended data");
+	}
+
+	if (!tail->loaded || tail->size != entry->file_size) {
+		tail->loaded = 0;
+		if (load_tail(fd) < 0)
+			return -1;
+	}
+
+	while (counted < count) {
+		// Blocks are allocated with the first byte they receive, so that running out of space is noticed right away
+		if (tail->block == FAT_EOC) {
+			if (count_free_blocks(1) < 1)
+				break;
+			tail->block = alloc_extent(tail->prev, 1);
+			if (tail->prev == FAT_EOC) {
+				entry->data_blk = tail->block;
+				metadata_dirty |= DIRTY_RDIR;
+			}
+		}
+
+		uint32_t length = (count - counted < BLOCK_SIZE - tail->length) ?
+			count - counted : BLOCK_SIZE - tail->length;
+		memcpy(&tail->data[tail->length], buf + counted, length);
+		tail->length += length;
+		counted += length;
+
+		if (tail->length < BLOCK_SIZE)
+			break;
+
+		/* The block is full, write it and move on to the next one */
+		if (write_data_block(tail->block, tail->data) < 0) {
+			tail->loaded = 0;
+			fs_error("block_write");
+		}
+		tail->size = tail->position + BLOCK_SIZE;
+		entry->file_size = tail->size;
+		metadata_dirty |= DIRTY_RDIR;
+
+		tail->prev = tail->block;
+		tail->block = FAT[tail->block];
+		tail->position += BLOCK_SIZE;
+		tail->length = 0;
+		memset(tail->data, 0, BLOCK_SIZE);
+
+		// Reserved blocks may be shared with a clone
+		if (tail->block != FAT_EOC && refcount_table[tail->block]) {
+			tail->block = unshare_block(entry, tail->position / BLOCK_SIZE);
+			if (tail->block == FAT_EOC) {
+				tail->loaded = 0;
+				fs_error("unshare_block");
+			}
+		}
+	}
+
+	fd_list[fd].offset = tail->position + tail->length;
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return counted;
+}
+
+/* Copy Helpers */
+
+/*
+* buffered_copy_space - Count the blocks that writing a range of a file through fs_write() may allocate at most
+* @out: File written to
+* @off_out: Offset of the range in @out, at most its size
+* @len: Length of the range
+*
+* Compressed files are unshared whole, and their stream is never longer than their data. Other files get a block for
+* every hole or block past the chain in the range, and a copy of every shared block up to the last one written.
+*
+* Return: number of blocks if successful, -1 if the hole map can't be read
+*/
+int buffered_copy_space(struct file_entry *out, size_t off_out, size_t len)
+{
+	uint32_t chain = chain_length(out);
+	uint32_t shared_from = first_shared_block(out);
+	uint32_t shared = (shared_from < chain) ? chain - shared_from : 0;
+	size_t end_out = off_out + len;
+
+	if (out->flags & FILE_COMPRESSED) {
+		size_t new_size = (end_out > out->file_size) ? end_out : out->file_size;
+		uint32_t needed = 1 + (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		return ((needed > chain) ? needed - chain : 0) + shared;
+	}
+
+	if (load_hole_map(out) < 0)
+		return -1;
+
+	uint32_t logical = chain + count_holes(HOLE_MAP_BITS);
+	uint32_t first = off_out / BLOCK_SIZE, last = (end_out - 1) / BLOCK_SIZE;
+	int needed = 0;
+
+	for (uint32_t position = first; position <= last; ++position) {
+		if (position >= logical || is_hole(position))
+			needed++;
+	}
+
+	// A block's position in the chain is never past its position in the file
+	if (shared && last >= shared_from)
+		needed += ((last < chain) ? last + 1 : chain) - shared_from;
+
+	return needed;
+}
+
+/*
+* copy_range_buffered - Copy a byte range through a temporary buffer, for compressed or sparse files
+*
+* The file offsets are moved for fs_read() and fs_write(), then restored. The copy is refused up front if the disk
+* may not hold it, so that running out of space never leaves the destination half-written. If a block can't be
+* accessed midway, the destination is cut back to its former size.
+*
+* Return: -1 if the copy failed, 0 otherwise
+*/
+int copy_range_buffered(int fd_in, size_t off_in, int fd_out, size_t off_out, size_t len)
+{
+	size_t saved_in = fd_list[fd_in].offset, saved_out = fd_list[fd_out].offset;
+	size_t saved_size = fd_list[fd_out].entry->file_size;
+	size_t done = 0;
+
+	int needed = buffered_copy_space(fd_list[fd_out].entry, off_out, len);
+	if (needed < 0)
+		return -1;
+	if (count_free_blocks(needed) < needed)
+		fs_error("Not enough space");
+
+	uint8_t *buf = malloc(CHUNK_SIZE);
+	if (!buf)
+		fs_perror("malloc");
+
+	while (done < len) {
+		int count = (len - done < CHUNK_SIZE) ? len - done : CHUNK_SIZE;
+
+		fd_list[fd_in].offset = off_in + done;
+		if (fs_read(fd_in, buf, count) != count)
+			break;
+		fd_list[fd_out].offset = off_out + done;
+		if (fs_write(fd_out, buf, count) != count)
+			break;
+		done += count;
+	}
+
+	fd_list[fd_in].offset = saved_in;
+	fd_list[fd_out].offset = saved_out;
+	free(buf);
+
+	if (done < len) {
+		if (fd_list[fd_out].entry->file_size > saved_size)
+			fs_truncate(fd_out, saved_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+* transfer_blocks - Read or write the blocks of a batch, one disk operation per run of consecutive blocks
+* @blocks: Data blocks of the batch
+* @count: Number of blocks in the batch
+* @buf: Data buffer holding @count blocks
+* @write: Non-zero to write the blocks, zero to read them
+*
+* Return: -1 if a run can't be transferred, 0 otherwise
+*/
+int transfer_blocks(const uint16_t *blocks, int count, uint8_t *buf, int write)
+{
+	for (int start = 0, end; start < count; start = end) {
+		for (end = start + 1; end < count && blocks[end] == blocks[end - 1] + 1; ++end)
+			;
+
+		int ret = write ? write_data_blocks(blocks[start], end - start, buf + start * BLOCK_SIZE)
+				: read_data_blocks(blocks[start], end - start, buf + start * BLOCK_SIZE);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+* copy_range_blocks - Copy a byte range between uncompressed files, block to block
+* @in: Source file
+* @off_in: Offset of the range in @in
+* @out: Destination file
+* @off_out: Offset of the range in @out, at most its size
+* @len: Length of the range, which @in must hold entirely
+*
+* Destination blocks past the end of @out are allocated as a single extent when possible. Blocks are then moved by
+* batches of runs of consecutive blocks. When both offsets are equally aligned within their blocks, source blocks are
+* read straight into the destination buffer, and only destination blocks partially covered by the range are read
+* beforehand to keep the rest of their content.
+*
+* Return: -1 if the copy failed, 0 otherwise
+*/
+int copy_range_blocks(struct file_entry *in, size_t off_in, struct file_entry *out, size_t off_out, size_t len)
+{
+	static uint16_t src_blocks[COPY_BATCH_BLOCKS + 1], dst_blocks[COPY_BATCH_BLOCKS];
+	static uint8_t src_buf[(COPY_BATCH_BLOCKS + 1) * BLOCK_SIZE], dst_buf[COPY_BATCH_BLOCKS * BLOCK_SIZE];
+	size_t end_out = off_out + len;
+	uint32_t have = 0, needed = (end_out + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint16_t last = FAT_EOC;
+	int aligned = (off_in % BLOCK_SIZE) == (off_out % BLOCK_SIZE);
+
+	for (uint16_t index = out->data_blk; index != FAT_EOC; index = FAT[index], ++have)
+		last = index;
+
+	/* Make the destination blocks exclusive, including the last one if the chain grows */
+	uint32_t last_modified = (needed > have) ? have - 1 : needed - 1;
+	if (have && last_modified >= first_shared_block(out)) {
+		last = unshare_block(out, last_modified);
+		if (last == FAT_EOC)
+			return -1;
+	}
+
+	/* Grow the destination chain */
+	if (needed > have) {
+		if (count_free_blocks(needed - have) < (int)(needed - have))
+			fs_error("Not enough space");
+		uint16_t first = alloc_extent(last, needed - have);
+		if (last == FAT_EOC) {
+			out->data_blk = first;
+			metadata_dirty |= DIRTY_RDIR;
+		}
+	}
+
+	/* Move the range batch by batch */
+	uint16_t src = fetch_data_block(in->data_blk, off_in / BLOCK_SIZE);
+	uint16_t dst = fetch_data_block(out->data_blk, off_out / BLOCK_SIZE);
+	size_t done = 0;
+
+	while (done < len) {
+		size_t dst_start = off_out + done, src_start = off_in + done;
+		size_t batch_end = (dst_start / BLOCK_SIZE + COPY_BATCH_BLOCKS) * BLOCK_SIZE;
+		size_t length = ((batch_end < end_out) ? batch_end : end_out) - dst_start;
+		int dst_count = (dst_start % BLOCK_SIZE + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int src_count = (src_start % BLOCK_SIZE + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t head = dst_start % BLOCK_SIZE;			// Bytes kept at the start of the first block
+		size_t tail = (head + length) % BLOCK_SIZE;		// Bytes copied in the last block, 0 if it is full
+
+		for (int i = 0; i < dst_count; ++i, dst = FAT[dst])
+			dst_blocks[i] = dst;
+		for (int i = 0; i < src_count; ++i) {
+			src_blocks[i] = src;
+			if (i < src_count - 1)
+				src = FAT[src];
+		}
+		// The next batch starts in the last source block unless this one ends on its boundary
+		if ((src_start + length) % BLOCK_SIZE == 0)
+			src = FAT[src];
+
+		// Partially covered destination blocks holding file data must be read first
+		int keep_first = head > 0;
+		int keep_last = tail > 0 && dst_start + length < out->file_size;
+
+		if (aligned) {
+			if (transfer_blocks(src_blocks, src_count, dst_buf, 0) < 0)
+				return -1;
+			if (keep_first) {
+				if (read_data_block(dst_blocks[0], &bounce) < 0)
+					return -1;
+				memcpy(dst_buf, &bounce, head);
+				stats_add(bounce_copies, 1);
+			}
+			if (keep_last) {
+				if (read_data_block(dst_blocks[dst_count - 1], &bounce) < 0)
+					return -1;
+				memcpy(dst_buf + (dst_count - 1) * BLOCK_SIZE + tail, bounce.byte + tail, BLOCK_SIZE - tail);
+				stats_add(bounce_copies, 1);
+			}
+		} else {
+			if (keep_first && read_data_block(dst_blocks[0], dst_buf) < 0)
+				return -1;
+			if (keep_last && read_data_block(dst_blocks[dst_count - 1], dst_buf + (dst_count - 1) * BLOCK_SIZE) < 0)
+				return -1;
+			if (transfer_blocks(src_blocks, src_count, src_buf, 0) < 0)
+				return -1;
+			memcpy(dst_buf + head, src_buf + src_start % BLOCK_SIZE, length);
+		}
+
+		if (transfer_blocks(dst_blocks, dst_count, dst_buf, 1) < 0)
+			return -1;
+
+		done += length;
+	}
+
+	return 0;
+}
+
+/* Defragmentation Helpers */
+
+/*
+* count_extents - Count the runs of consecutive data blocks in a file's chain
+*/
+uint32_t count_extents(struct file_entry *entry)
+{
+	uint32_t extents = 0;
+
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index]) {
+		if (FAT[index] != index + 1)
+			extents++;
+	}
+
+	return extents;
+}
+
+/*
+* sync_metadata - Write the modified metadata, then every cached block, to disk
+*
+* Return: -1 if a block couldn't be written, 0 otherwise
+*/
+int sync_metadata(void)
+{
+	if (write_metadata() < 0 || cache_sync() < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+* defrag_pick - Point the defrag cursor to the next file worth moving
+*
+* A file is moved when its chain has several extents and a free run can hold it whole. The run right after the file's
+* first extent is preferred, as that extent then stays in place; otherwise the file goes to the first run large enough.
+* Files sharing blocks are left alone, since the other references to their blocks can't be updated.
+*
+* Return: 1 if a file was found, 0 otherwise
+*/
+int defrag_pick(void)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct file_entry *entry = &root_dir.file[i];
+
+		if (entry->file_name[0] == '\0' || entry->data_blk == FAT_EOC)
+			continue;
+		if (count_extents(entry) < 2 || first_shared_block(entry) != UINT32_MAX)
+			continue;
+
+		uint32_t length = chain_length(entry), head = 1;
+		for (uint16_t index = entry->data_blk; FAT[index] == index + 1; index = FAT[index])
+			head++;
+
+		if (find_free_extent(entry->data_blk + head, length - head) == entry->data_blk + head) {
+			defrag.target = entry->data_blk;
+			defrag.done = head;
+		} else {
+			uint16_t start = find_free_extent(1, length);
+			if (start == FAT_EOC)
+				continue;
+			defrag.target = start;
+			defrag.done = 0;
+		}
+
+		defrag.entry = entry;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+* defrag_cursor_valid - Check that the file at the defrag cursor can still be moved where planned
+*
+* Return: 1 if the file has blocks left to move and they fit in the free end of the extent, 0 otherwise
+*/
+int defrag_cursor_valid(void)
+{
+	struct file_entry *entry = defrag.entry;
+
+	if (entry == NULL || entry->file_name[0] == '\0' || first_shared_block(entry) != UINT32_MAX)
+		return 0;
+
+	/* The blocks already moved must start the chain */
+	uint16_t index = entry->data_blk;
+	for (uint32_t position = 0; position < defrag.done; ++position, index = FAT[index]) {
+		if (index != defrag.target + position)
+			return 0;
+	}
+
+	/* The rest of the extent must still be free */
+	uint32_t left = 0;
+	for (; index != FAT_EOC; index = FAT[index])
+		left++;
+	if (left == 0 || defrag.target + defrag.done + left > superblock.data_blk_count)
+		return 0;
+	for (uint32_t i = 0; i < left; ++i) {
+		if (FAT[defrag.target + defrag.done + i] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+* defrag_step - Move the next blocks of the file at the defrag cursor into its extent
+* @count: Maximum number of blocks to move
+*
+* The blocks are copied first and the copies linked to the rest of the chain. Only then does the preceding block, or the
+* root directory entry, point to the copies, and only then are the originals freed. Each step is synced to disk, so
+* that a crash leaves either the old or the new chain, at worst with unreferenced blocks.
+*
+* Return: number of blocks moved if successful, -1 otherwise
+*/
+int defrag_step(uint32_t count)
+{
+	static uint16_t blocks[DEFRAG_BATCH_BLOCKS];
+	static uint8_t buf[DEFRAG_BATCH_BLOCKS * BLOCK_SIZE];
+	struct file_entry *entry = defrag.entry;
+	uint16_t prev = defrag.done ? defrag.target + defrag.done - 1 : FAT_EOC;
+	uint16_t dst = defrag.target + defrag.done;
+	uint16_t index = (prev == FAT_EOC) ? entry->data_blk : FAT[prev];
+	int moved = 0;
+
+	if (count > DEFRAG_BATCH_BLOCKS)
+		count = DEFRAG_BATCH_BLOCKS;
+
+	for (; moved < (int)count && index != FAT_EOC; ++moved, index = FAT[index])
+		blocks[moved] = index;
+
+	/* Copy the blocks, linking the copies to the rest of the chain */
+	if (transfer_blocks(blocks, moved, buf, 0) < 0 || write_data_blocks(dst, moved, buf) < 0)
+		return -1;
+	for (int i = 0; i < moved; ++i)
+		set_fat(dst + i, (i < moved - 1) ? dst + i + 1 : index);
+	if (sync_metadata() < 0)
+		return -1;
+
+	/* Switch the chain over to the copies */
+	if (prev == FAT_EOC) {
+		entry->data_blk = dst;
+		metadata_dirty |= DIRTY_RDIR;
+	} else {
+		set_fat(prev, dst);
+	}
+	if (sync_metadata() < 0)
+		return -1;
+
+	/* Free the originals */
+	for (int i = 0; i < moved; ++i) {
+		set_fat(blocks[i], 0x0);
+		set_csum(blocks[i], CSUM_NONE);
+		dedup_remove(blocks[i]);
+	}
+	if (sync_metadata() < 0)
+		return -1;
+
+	defrag.done += moved;
+
+	return moved;
+}
+
+/* Consistency Check Helpers */
+
+/*
+* walk_chain - Walk a chain for fs_check(), claiming its blocks
+* @id: Chain to walk (CHAIN_*), whose start must be set
+* @limit: Maximum number of blocks in the chain, a longer chain ending with a bad pointer
+*/
+void walk_chain(int id, uint32_t limit)
+{
+	struct chain_check *chain = &checker.chain[id];
+	uint16_t prev = FAT_EOC, index = chain->start;
+	int borrowed = 0;
+
+	chain->length = 0;
+	chain->error = CHAIN_OK;
+
+	while (index != FAT_EOC) {
+		if (index == 0 || index >= superblock.data_blk_count || FAT[index] == 0) {
+			chain->error = CHAIN_BAD_POINTER;
+			break;
+		}
+
+		// Borrowed tails aren't claimed, so only their length tells about a cycle
+		if (chain->length == limit) {
+			chain->error = borrowed ? CHAIN_CYCLE : CHAIN_BAD_POINTER;
+			break;
+		}
+
+		if (!borrowed) {
+			uint16_t owner = 0;
+			if (!__atomic_compare_exchange_n(&checker.owner[index], &owner, id, 0,
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				if (owner == id) {
+					chain->error = CHAIN_CYCLE;
+					break;
+				}
+				// A shared block starts the tail of other chains, walked by the one claiming it
+				if (!refcount_table[index]) {
+					chain->error = CHAIN_CROSS_LINK;
+					break;
+				}
+				borrowed = 1;
+			}
+		}
+
+		chain->length++;
+		prev = index;
+		index = FAT[index];
+	}
+
+	chain->last_good = prev;
+
+	/* Make the chain end before its error */
+	if (checker.repair && chain->error != CHAIN_OK && prev != FAT_EOC)
+		set_fat(prev, FAT_EOC);
+}
+
+/*
+* check_table - Walk the chain of the checksum or reference count table for fs_check()
+*/
+void check_table(int id, int entries_per_block)
+{
+	struct chain_check *chain = &checker.chain[id];
+	uint32_t needed = (superblock.data_blk_count + entries_per_block - 1) / entries_per_block;
+
+	walk_chain(id, needed);
+	chain->too_short = chain->error == CHAIN_OK && chain->length < needed;
+}
+
+/*
+* check_file - Walk the hole map and data chains of a file for fs_check(), and check that they can hold its content
+* @i: Index of the file in the root directory
+*
+* In repair mode, a file without valid hole map stops being sparse, a compressed file that can't be decompressed is
+* emptied, and the size of other files is cut down to what their chain holds.
+*/
+void check_file(int i)
+{
+	struct file_entry *entry = &root_dir.file[i];
+	struct chain_check *map = &checker.chain[CHAIN_HOLE_MAP(i)], *data = &checker.chain[CHAIN_DATA(i)];
+	uint8_t bits[BLOCK_SIZE];
+	uint32_t blocks = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	/* Hole map, a single block */
+	memset(bits, 0, sizeof(bits));
+	if (entry->flags & FILE_SPARSE) {
+		walk_chain(CHAIN_HOLE_MAP(i), 1);
+		if (map->error == CHAIN_OK && block_read(entry->hole_blk + superblock.data_blk, bits) < 0)
+			map->error = CHAIN_BAD_POINTER;
+
+		if (checker.repair && map->last_good == FAT_EOC && map->error != CHAIN_OK) {
+			entry->flags &= ~FILE_SPARSE;
+			entry->hole_blk = 0;
+			metadata_dirty |= DIRTY_RDIR;
+			memset(bits, 0, sizeof(bits));
+		}
+	}
+
+	/* Data */
+	walk_chain(CHAIN_DATA(i), superblock.data_blk_count);
+	if (checker.repair && data->error != CHAIN_OK && data->last_good == FAT_EOC) {
+		entry->data_blk = FAT_EOC;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	if (entry->flags & FILE_COMPRESSED) {
+		// The chunk index tells how long the compressed stream is
+		uint32_t chunks = (entry->file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		uint32_t index[CHUNK_MAX_COUNT];
+
+		data->too_short = 0;
+		if (chunks) {
+			data->too_short = data->length == 0 || chunks > CHUNK_MAX_COUNT
+				|| block_read(entry->data_blk + superblock.data_blk, index) < 0
+				|| data->length < 1 + (index[chunks - 1] + (uint64_t)BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+		data->capacity = data->too_short ? 0 : entry->file_size;
+
+		if (checker.repair && (data->too_short || data->error != CHAIN_OK) && entry->file_size) {
+			// The blocks left behind are freed as leaked
+			entry->data_blk = FAT_EOC;
+			entry->file_size = 0;
+			metadata_dirty |= DIRTY_RDIR;
+		}
+		return;
+	}
+
+	// Holes need no block in the chain
+	uint32_t left = data->length, position = 0;
+	for (; position < blocks; ++position) {
+		if (position < HOLE_MAP_BITS && (bits[position / 8] & (1 << (position % 8))))
+			continue;
+		if (left == 0)
+			break;
+		left--;
+	}
+
+	data->capacity = (position == blocks) ? entry->file_size : position * BLOCK_SIZE;
+	data->too_short = data->capacity < entry->file_size;
+
+	if (checker.repair && data->too_short) {
+		entry->file_size = data->capacity;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+}
+
+void *check_worker(void *arg)
+{
+	UNUSED(arg);
+
+	/* Take the checksum table, then the files, one at a time */
+	for (;;) {
+		int item = __atomic_fetch_add(&checker.next, 1, __ATOMIC_RELAXED);
+		if (item > FS_FILE_MAX_COUNT)
+			break;
+
+		if (item == 0) {
+			if (superblock.features & FEATURE_CSUM)
+				check_table(CHAIN_CSUM, CSUM_PER_BLOCK);
+		} else if (root_dir.file[item - 1].file_name[0] != '\0') {
+			check_file(item - 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+* check_chains - Walk every chain of the file system for fs_check()
+* @threads: Number of threads walking the chains
+*
+* The reference count table is walked and loaded first, since the other walks need it to tell shared blocks from
+* cross-links.
+*
+* Return: -1 if a thread can't be created, 0 otherwise
+*/
+int check_chains(int threads)
+{
+	pthread_t thread[CHECK_MAX_THREADS];
+
+	memset(checker.owner, 0, sizeof(checker.owner));
+	memset(checker.chain, 0, sizeof(checker.chain));
+	memset(refcount_table, 0, sizeof(refcount_table));
+	checker.next = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] == '\0')
+			continue;
+		checker.chain[CHAIN_HOLE_MAP(i)].start = root_dir.file[i].hole_blk;
+		checker.chain[CHAIN_DATA(i)].start = root_dir.file[i].data_blk;
+	}
+	checker.chain[CHAIN_REFCOUNT].start = superblock.refcount_blk;
+	checker.chain[CHAIN_CSUM].start = superblock.csum_blk;
+
+	/* Reference count table */
+	if (superblock.features & FEATURE_REFCOUNT) {
+		struct chain_check *chain = &checker.chain[CHAIN_REFCOUNT];
+
+		check_table(CHAIN_REFCOUNT, REFCOUNT_PER_BLOCK);
+		if (chain->error == CHAIN_OK && !chain->too_short) {
+			uint16_t index = chain->start;
+			for (int i = 0; index != FAT_EOC; ++i, index = FAT[index]) {
+				if (block_read(index + superblock.data_blk, &refcount_table[i * REFCOUNT_PER_BLOCK]) < 0)
+					fs_error("Couldn't read reference count table");
+			}
+		}
+	}
+
+	/* Everything else */
+	if (threads > CHECK_MAX_THREADS)
+		threads = CHECK_MAX_THREADS;
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&thread[i], NULL, check_worker, NULL)) {
+			threads = i;
+			break;
+		}
+	}
+	check_worker(NULL);
+	for (int i = 1; i < threads; ++i)
+		pthread_join(thread[i], NULL);
+
+	return 0;
+}
+
+/*
+* chain_name - Describe a chain walked by fs_check() in @buf
+*/
+const char *chain_name(int id, char *buf, size_t size)
+{
+	if (id == CHAIN_REFCOUNT)
+		return "reference count table";
+	if (id == CHAIN_CSUM)
+		return "checksum table";
+
+	snprintf(buf, size, "%s'%.*s'", (id % 2) ? "hole map of " : "", FS_FILENAME_LEN,
+		 (char *)root_dir.file[(id - 3) / 2].file_name);
+
+	return buf;
+}
+
+/*
+* count_chain_errors - Add up the errors found by check_chains() in @report
+*
+* Return: number of errors found
+*/
+int count_chain_errors(struct fs_check_report *report, int verbose)
+{
+	static const char *messages[] = {
+		[CHAIN_BAD_POINTER] = "bad pointer",
+		[CHAIN_CYCLE] = "cycle",
+		[CHAIN_CROSS_LINK] = "cross-link",
+	};
+	char name[32];
+	int errors = 0;
+
+	for (int id = 1; id <= CHAIN_COUNT; ++id) {
+		struct chain_check *chain = &checker.chain[id];
+
+		if (chain->error != CHAIN_OK) {
+			if (verbose)
+				error("%s: %s after %u blocks", chain_name(id, name, sizeof(name)),
+				      messages[chain->error], chain->length);
+			report->bad_pointers += chain->error == CHAIN_BAD_POINTER;
+			report->cycles += chain->error == CHAIN_CYCLE;
+			report->cross_links += chain->error == CHAIN_CROSS_LINK;
+			errors++;
+		}
+		if (chain->too_short) {
+			if (verbose)
+				error("%s: chain too short (%u blocks)", chain_name(id, name, sizeof(name)), chain->length);
+			report->short_chains++;
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/*
+* check_superblock - Check that the superblock describes the layout of the disk
+*
+* Return: number of invalid fields
+*/
+int check_superblock(void)
+{
+	int errors = 0;
+
+	if (superblock.sig != SIGNATURE) {
+		error("Invalid signature");
+		return 1;
+	}
+
+	if (superblock.total_blk_count != block_disk_count()) {
+		error("total_blk_count=%d but the disk has %d blocks", superblock.total_blk_count, block_disk_count());
+		errors++;
+	}
+	if (superblock.data_blk_count == 0 || superblock.data_blk_count > 4 * FS_FAT_ENTRY_MAX_COUNT) {
+		error("Invalid data_blk_count=%d", superblock.data_blk_count);
+		errors++;
+	}
+	if (superblock.fat_blk_count != (superblock.data_blk_count + FS_FAT_ENTRY_MAX_COUNT - 1) / FS_FAT_ENTRY_MAX_COUNT) {
+		error("fat_blk_count=%d doesn't match data_blk_count=%d", superblock.fat_blk_count, superblock.data_blk_count);
+		errors++;
+	}
+	if (superblock.rdir_blk != superblock.fat_blk_count + 1) {
+		error("Invalid rdir_blk=%d", superblock.rdir_blk);
+		errors++;
+	}
+	if (superblock.data_blk != superblock.rdir_blk + 1
+	    || superblock.data_blk + superblock.data_blk_count != superblock.total_blk_count) {
+		error("Invalid data_blk=%d", superblock.data_blk);
+		errors++;
+	}
+	if (superblock.features & ~FEATURES_SUPPORTED) {
+		error("Unsupported features 0x%x", superblock.features & ~FEATURES_SUPPORTED);
+		errors++;
+	}
+
+	return errors;
+}
+
+/*
+* check_metadata - Check the FAT entries and root directory entries that don't belong to chains
+*
+* Return: number of errors found
+*/
+int check_metadata(struct fs_check_report *report)
+{
+	// The first entry is reserved
+	if (FAT[0] != FAT_EOC) {
+		error("FAT entry 0 isn't reserved");
+		report->fat_errors++;
+		if (checker.repair)
+			set_fat(0, FAT_EOC);
+	}
+
+	// Entries past the data region don't describe any block
+	for (int index = superblock.data_blk_count; index < superblock.fat_blk_count * FS_FAT_ENTRY_MAX_COUNT; ++index) {
+		if (FAT[index] == 0)
+			continue;
+		error("FAT entry %d is past the data region", index);
+		report->fat_errors++;
+		if (checker.repair)
+			set_fat(index, 0);
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct file_entry *entry = &root_dir.file[i];
+		if (entry->file_name[0] == '\0')
+			continue;
+
+		if (entry->file_name[FS_FILENAME_LEN - 1] != '\0') {
+			error("Root entry %d: file name isn't terminated", i);
+			report->entry_errors++;
+			if (checker.repair)
+				entry->file_name[FS_FILENAME_LEN - 1] = '\0';
+		}
+		if ((entry->flags & ~(FILE_COMPRESSED | FILE_SPARSE))
+		    || (entry->flags & (FILE_COMPRESSED | FILE_SPARSE)) == (FILE_COMPRESSED | FILE_SPARSE)) {
+			error("Root entry %d: invalid flags 0x%x", i, entry->flags);
+			report->entry_errors++;
+			if (checker.repair)
+				entry->flags &= (entry->flags & FILE_COMPRESSED) ? FILE_COMPRESSED : FILE_SPARSE;
+		}
+	}
+	if (checker.repair)
+		metadata_dirty |= DIRTY_RDIR;
+
+	return report->fat_errors + report->entry_errors;
+}
+
+/*
+* check_image - Check the file system of the open disk for fs_check()
+*
+* Return: number of problems left unrepaired if successful, -1 otherwise
+*/
+int check_image(int repair, struct fs_check_report *report)
+{
+	struct fs_check_report remaining = { 0 };
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int found;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > CHECK_MAX_THREADS)
+		threads = CHECK_MAX_THREADS;
+	report->threads = threads;
+
+	/* Superblock: the layout must be known before anything else can be checked */
+	if (block_read(0, &superblock) < 0)
+		fs_error("Couldn't read superblock");
+	report->superblock_errors = check_superblock();
+	if (report->superblock_errors)
+		return report->superblock_errors;
+
+	if (block_read(superblock.rdir_blk, &root_dir) < 0)
+		fs_error("Couldn't read root directory");
+	for (int i = 0; i < superblock.fat_blk_count; ++i) {
+		if (block_read(i + 1, &FAT[i * FS_FAT_ENTRY_MAX_COUNT]) < 0)
+			fs_error("Couldn't read FAT");
+	}
+
+	checker.repair = repair;
+	found = check_metadata(report);
+	checker.repair = 0;
+
+	/* Chains */
+	if (check_chains(threads) < 0)
+		return -1;
+	int chain_errors = count_chain_errors(report, 1);
+	found += chain_errors;
+
+	struct chain_check *refcount = &checker.chain[CHAIN_REFCOUNT];
+	if (repair && (refcount->error != CHAIN_OK || refcount->too_short)) {
+		// Shared blocks can't be told from cross-links without the table
+		error("Reference count table is damaged, not repairing");
+		return found;
+	}
+
+	if (repair && chain_errors) {
+		// Cut the chains walking them one by one, so that on a cross-link the first file keeps the block
+		checker.repair = 1;
+		if (check_chains(1) < 0)
+			return -1;
+		checker.repair = 0;
+
+		if (checker.chain[CHAIN_CSUM].error != CHAIN_OK || checker.chain[CHAIN_CSUM].too_short) {
+			// The remaining checksum blocks are freed as leaked
+			superblock.features &= ~FEATURE_CSUM;
+			superblock.csum_blk = 0;
+			metadata_dirty |= DIRTY_SUPER;
+		}
+
+		if (check_chains(threads) < 0)
+			return -1;
+		report->repaired += chain_errors - count_chain_errors(&remaining, 0);
+	}
+	report->repaired += repair ? report->fat_errors + report->entry_errors : 0;
+
+	// Freed blocks must lose their checksum
+	if (repair && (superblock.features & FEATURE_CSUM)) {
+		uint16_t index = superblock.csum_blk;
+		for (int i = 0; index != FAT_EOC; ++i, index = FAT[index]) {
+			if (block_read(index + superblock.data_blk, &csum_table[i * CSUM_PER_BLOCK]) < 0)
+				fs_error("Couldn't read checksum table");
+		}
+	}
+
+	/* Used blocks no chain reaches */
+	for (int index = 1; index < superblock.data_blk_count; ++index) {
+		if (FAT[index] == 0 || checker.owner[index])
+			continue;
+		report->leaked_blocks++;
+		found++;
+		if (repair) {
+			set_fat(index, 0);
+			set_csum(index, CSUM_NONE);
+			report->repaired++;
+		}
+	}
+	if (report->leaked_blocks)
+		error("%u leaked blocks", report->leaked_blocks);
+
+	/* Reference counts: one per root entry or FAT entry pointing to a block, beyond the first */
+	if ((superblock.features & FEATURE_REFCOUNT) && refcount->error == CHAIN_OK && !refcount->too_short) {
+		static uint16_t references[4 * FS_FAT_ENTRY_MAX_COUNT];
+
+		memset(references, 0, sizeof(references));
+		for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+			uint16_t data_blk = root_dir.file[i].data_blk;
+			if (root_dir.file[i].file_name[0] != '\0' && data_blk < superblock.data_blk_count)
+				references[data_blk]++;
+		}
+		// Only the blocks of file data chains point to shared blocks
+		for (int index = 1; index < superblock.data_blk_count; ++index) {
+			uint16_t owner = checker.owner[index];
+			if (owner >= CHAIN_DATA(0) && owner % 2 == 0 && FAT[index] < superblock.data_blk_count)
+				references[FAT[index]]++;
+		}
+
+		for (int index = 1; index < superblock.data_blk_count; ++index) {
+			uint16_t expected = (references[index] > 1) ? references[index] - 1 : 0;
+			if (refcount_table[index] == expected)
+				continue;
+			error("Block %d has %d extra references, not %d", index, expected, refcount_table[index]);
+			report->bad_refcounts++;
+			found++;
+			if (repair) {
+				set_refcount(index, expected);
+				report->repaired++;
+			}
+		}
+	}
+
+	if (repair && write_metadata() < 0)
+		fs_error("Couldn't write repaired metadata");
+
+	return found - report->repaired;
+}
+
+/* Root Directory Helpers */
+
+/*
+* forget_entry - Drop the state kept in memory about a file being deleted
+*/
+void forget_entry(struct file_entry *entry)
+{
+	if (chunk_cache.entry == entry)
+		chunk_cache.entry = NULL;
+	if (hole_map.entry == entry)
+		hole_map.entry = NULL;
+	if (defrag.entry == entry)
+		defrag.entry = NULL;
+}
+
+uint32_t name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;	// FNV-1a
+
+	for (; *name; ++name)
+		hash = (hash ^ (uint8_t)*name) * 16777619u;
+
+	return hash;
+}
+
+void name_index_init(struct name_index *index)
+{
+	for (int i = 0; i < NAME_INDEX_SIZE; ++i)
+		index->slot[i] = -1;
+}
+
+void name_index_insert(struct name_index *index, int entry)
+{
+	uint32_t slot = name_hash((char *)root_dir.file[entry].file_name) % NAME_INDEX_SIZE;
+
+	while (index->slot[slot] >= 0)
+		slot = (slot + 1) % NAME_INDEX_SIZE;
+	index->slot[slot] = entry;
+}
+
+/*
+* name_index_find - Look up the root directory entry of a file
+*
+* Return: index of the entry named @name, -1 if there is none
+*/
+int name_index_find(const struct name_index *index, const char *name)
+{
+	uint32_t slot = name_hash(name) % NAME_INDEX_SIZE;
+
+	for (; index->slot[slot] >= 0; slot = (slot + 1) % NAME_INDEX_SIZE) {
+		if (strcmp((char *)root_dir.file[index->slot[slot]].file_name, name) == 0)
+			return index->slot[slot];
+	}
+
+	return -1;
+}
+
+/* Filesystem Functions */
+int fs_mount(const char *diskname)
+{
+	STATS_SCOPE(FS_OP_MOUNT);
+
+	/* Mount disk */
+	// Open file
+	if (block_disk_open(diskname) < 0)
+		fs_error("Couldn't open disk");
+
+	// Read in superblock
+	if (block_read(0, &superblock) < 0)
+		fs_error("Couldn't read superblock");
+
+	// Read in root directory
+	if (cache_read(superblock.rdir_blk, &root_dir) < 0)
+		fs_error("Couldn't read root directory");
+
+	// Read FAT by iterating at a block-level
+	for (int i = 0; i < superblock.fat_blk_count; ++i) {
+		// Find the correct FAT block & pass the corresponding entry address as the buffer
+		if (cache_read(i + 1, &(FAT[i * FS_FAT_ENTRY_MAX_COUNT])) < 0)
+			fs_error("Couldn't read FAT")
+	}
+
+	/* Error checking */
+	// Check signature
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem has an invalid format");
+
+	// Check disk size
+	if (superblock.total_blk_count != block_disk_count())
+		fs_error("Mismatched number of total blocks");
+
+	// Check optional features
+	if (superblock.features & ~FEATURES_SUPPORTED)
+		fs_error("Filesystem uses unsupported features");
+
+	// Read checksum table
+	if (superblock.features & FEATURE_CSUM) {
+		uint16_t csum_block = superblock.csum_blk;
+		for (int i = 0; i * CSUM_PER_BLOCK < superblock.data_blk_count; ++i, csum_block = FAT[csum_block]) {
+			if (csum_block >= superblock.data_blk_count)
+				fs_error("Invalid checksum table");
+			if (cache_read(csum_block + superblock.data_blk, &csum_table[i * CSUM_PER_BLOCK]) < 0)
+				fs_error("Couldn't read checksum table");
+		}
+	}
+
+	// Read reference count table
+	if (superblock.features & FEATURE_REFCOUNT) {
+		uint16_t refcount_block = superblock.refcount_blk;
+		for (int i = 0; i * REFCOUNT_PER_BLOCK < superblock.data_blk_count; ++i, refcount_block = FAT[refcount_block]) {
+			if (refcount_block >= superblock.data_blk_count)
+				fs_error("Invalid reference count table");
+			if (cache_read(refcount_block + superblock.data_blk, &refcount_table[i * REFCOUNT_PER_BLOCK]) < 0)
+				fs_error("Couldn't read reference count table");
+		}
+	}
+
+	/* Prepare file descriptors */
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		fd_list[i].entry = NULL;
+		fd_list[i].offset = 0;
+	}
+	metadata_dirty = 0;
+
+	/* Count free data blocks */
+	free_space.count = 0;
+	free_space.hint = 1;
+	for (int i = 0; i < superblock.data_blk_count; ++i) {
+		if (FAT[i] == 0)
+			free_space.count++;
+	}
+
+	record_call(-1, -1, "MOUNT");
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	STATS_SCOPE(FS_OP_UMOUNT);
+
+	/* Write back blocks */
+	// Root Directory, FAT, and whatever else was modified
+	metadata_dirty |= DIRTY_RDIR | DIRTY_FAT_ALL;
+	if (write_metadata() < 0)
+		fs_error("Couldn't write over metadata");
+
+	// Check for open fd
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (fd_list[i].entry != NULL)
+			fs_error("There exist open file descriptors");
+	}
+
+	// Write back and drop the cache
+	if (cache_is_enabled() && cache_disable() < 0)
+		fs_error("Couldn't flush cache");
+
+	if (block_disk_close() < 0)
+		fs_error("Couldn't close disk");
+
+	record_call(-1, -1, "UMOUNT");
+
+	/* Empty all structs */
+	superblock = (const struct superblock){ 0 };
+	memset(FAT, 0, sizeof(FAT));
+	free_space = (const struct free_space){ 0 };
+	memset(csum_table, 0, sizeof(csum_table));
+	memset(refcount_table, 0, sizeof(refcount_table));
+	dedup.enabled = 0;
+	root_dir = (const struct root_dir){ 0 };
+	bounce = (const struct data_block){ 0 };
+	chunk_cache.entry = NULL;
+	hole_map.entry = NULL;
+	defrag.entry = NULL;
+
+	return 0;
+}
+
+int fs_info(void)
+{
+	STATS_SCOPE(FS_OP_INFO);
+
+	// Root Directory Traversal
+	int free_file_count = FS_FILE_MAX_COUNT;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] == '\0')
+			continue;
+		free_file_count--;
+	}
+
+	// Free data blocks are counted by set_fat()
+	int free_data_blk_count = free_space.count;
+
 	fprintf(stdout, "FS Info:\n");
 	fprintf(stdout, "total_blk_count=%d\n",		superblock.total_blk_count);
 	fprintf(stdout, "fat_blk_count=%d\n",		superblock.fat_blk_count);
@@ -246,126 +2839,804 @@ int fs_info(void)
 	fprintf(stdout, "fat_free_ratio=%d/%d\n",	free_data_blk_count,	superblock.data_blk_count); // Not functional yet
 	fprintf(stdout, "rdir_free_ratio=%d/%d\n",	free_file_count,	FS_FILE_MAX_COUNT);
 
-	return 0;
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+	STATS_SCOPE(FS_OP_CREATE);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	//Check if filename is NULL or empty
+	if (filename == NULL || filename[0] == '\0')
+		fs_error("Filename is invalid (either NULL or empty)");
+
+	// Check filename length (strlen doesn't count NULL, therefore use >=)
+	if (strlen(filename) >= FS_FILENAME_LEN)
+		fs_error("Filename must be less than 16 characters");
+
+	/* Find empty root entry */
+	int free_index = 0;
+	for (; free_index < FS_FILE_MAX_COUNT; free_index++) {
+		// Break loop if empty entry is found
+		if (root_dir.file[free_index].file_name[0] == '\0')
+			break;
+
+		// Check if file already exists
+		if (strcmp(filename, (char*) root_dir.file[free_index].file_name) == 0)
+			fs_error("File already exists");
+	}
+
+	// Check root directory capacity
+	if (free_index == FS_FILE_MAX_COUNT)
+		fs_error("Filesystem is full");
+
+	record_call(-1, -1, "CREATE\t%s", filename);
+
+	/* Create file */
+	strcpy((char*)root_dir.file[free_index].file_name, filename);
+	root_dir.file[free_index].file_size = 0;
+	root_dir.file[free_index].data_blk = FAT_EOC;
+	root_dir.file[free_index].flags = 0;
+	metadata_dirty |= DIRTY_RDIR;
+
+	return commit_metadata();
+}
+
+int fs_delete(const char *filename)
+{
+	STATS_SCOPE(FS_OP_DELETE);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	//Check if filename is NULL or empty
+	if (filename == NULL || filename[0] == '\0')
+		fs_error("Filename is invalid (either NULL or empty)");
+
+	// Check if file is open
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		// Skip if fd is closed
+		if (fd_list[i].entry == NULL)
+			continue;
+
+		if (strcmp(filename, (char*) fd_list[i].entry->file_name) == 0)
+			fs_error("Filename is currently open");
+	}
+
+	/* Find File in Root Directory */
+	int death_index = 0;
+	for (; death_index < FS_FILE_MAX_COUNT; death_index++) {
+		// Break loop if entry is found
+		if (strcmp((char*)root_dir.file[death_index].file_name, filename) == 0)
+			break;
+	}
+		
+	// Check if file was found
+	if (death_index == FS_FILE_MAX_COUNT)
+		fs_error("File not found");
+
+	record_call(-1, -1, "DELETE\t%s", filename);
+
+	/* Delete File */
+	root_dir.file[death_index].file_name[0] = '\0';
+	forget_entry(&root_dir.file[death_index]);
+	metadata_dirty |= DIRTY_RDIR;
+
+	// Sparse files also have a hole map block
+	if (root_dir.file[death_index].flags & FILE_SPARSE)
+		release_chain(root_dir.file[death_index].hole_blk);
+
+	/* Make FAT available */
+	// Checks to see if file has content (created but unwritten files will have FAT_EOC)
+	if (root_dir.file[death_index].data_blk == FAT_EOC)
+		return commit_metadata();
+
+	// File has content
+	release_chain(root_dir.file[death_index].data_blk);
+
+	root_dir.file[death_index].data_blk = '\0';
+
+	return commit_metadata();
+}
+
+int fs_create_many(const char **filenames, size_t count, int *status)
+{
+	STATS_SCOPE(FS_OP_CREATE_MANY);
+	struct name_index index;
+	int free_entries[FS_FILE_MAX_COUNT];
+	int free_count = 0, next_free = 0, created = 0;
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (filenames == NULL && count > 0)
+		fs_error("filenames is NULL");
+
+	/* Index existing files and collect empty entries in one pass */
+	name_index_init(&index);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] == '\0')
+			free_entries[free_count++] = i;
+		else
+			name_index_insert(&index, i);
+	}
+
+	/* Create files */
+	for (size_t n = 0; n < count; ++n) {
+		const char *filename = filenames[n];
+		int ret = -1;
+
+		if (filename == NULL || filename[0] == '\0') {
+			error("Filename is invalid (either NULL or empty)");
+		} else if (strlen(filename) >= FS_FILENAME_LEN) {
+			error("Filename must be less than 16 characters: %s", filename);
+		} else if (name_index_find(&index, filename) >= 0) {
+			error("File already exists: %s", filename);
+		} else if (next_free == free_count) {
+			error("Filesystem is full: %s", filename);
+		} else {
+			struct file_entry *entry = &root_dir.file[free_entries[next_free]];
+			strcpy((char*)entry->file_name, filename);
+			entry->file_size = 0;
+			entry->data_blk = FAT_EOC;
+			entry->flags = 0;
+			name_index_insert(&index, free_entries[next_free++]);
+			created++;
+			ret = 0;
+			record_call(-1, -1, "CREATE\t%s", filename);
+		}
+
+		if (status)
+			status[n] = ret;
+	}
+
+	if (created) {
+		metadata_dirty |= DIRTY_RDIR;
+		if (commit_metadata() < 0)
+			fs_error("commit_metadata");
+	}
+
+	return created;
+}
+
+int fs_delete_many(const char **filenames, size_t count, int *status)
+{
+	STATS_SCOPE(FS_OP_DELETE_MANY);
+	struct name_index index;
+	uint8_t open[FS_FILE_MAX_COUNT] = { 0 };
+	int deleted[FS_FILE_MAX_COUNT];
+	int deleted_count = 0;
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (filenames == NULL && count > 0)
+		fs_error("filenames is NULL");
+
+	/* Note open files, and index existing ones */
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (fd_list[i].entry != NULL)
+			open[fd_list[i].entry - root_dir.file] = 1;
+	}
+
+	name_index_init(&index);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] != '\0')
+			name_index_insert(&index, i);
+	}
+
+	/* Remove the root entries */
+	for (size_t n = 0; n < count; ++n) {
+		const char *filename = filenames[n];
+		int entry = -1, ret = -1;
+
+		if (filename == NULL || filename[0] == '\0')
+			error("Filename is invalid (either NULL or empty)");
+		else if ((entry = name_index_find(&index, filename)) < 0)
+			error("File not found: %s", filename);
+		else if (open[entry])
+			error("Filename is currently open: %s", filename);
+
+		if (entry >= 0 && !open[entry]) {
+			root_dir.file[entry].file_name[0] = '\0';
+			forget_entry(&root_dir.file[entry]);
+			deleted[deleted_count++] = entry;
+			ret = 0;
+			record_call(-1, -1, "DELETE\t%s", filename);
+		}
+
+		if (status)
+			status[n] = ret;
+	}
+
+	if (deleted_count == 0)
+		return 0;
+
+	/* Free the chains of every deleted file in one sweep */
+	for (int i = 0; i < deleted_count; ++i) {
+		struct file_entry *entry = &root_dir.file[deleted[i]];
+
+		// Sparse files also have a hole map block
+		if (entry->flags & FILE_SPARSE)
+			release_chain(entry->hole_blk);
+		if (entry->data_blk != FAT_EOC)
+			release_chain(entry->data_blk);
+		entry->data_blk = '\0';
+	}
+	metadata_dirty |= DIRTY_RDIR;
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return deleted_count;
+}
+
+int fs_ls(void)
+{
+	STATS_SCOPE(FS_OP_LS);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	/* List files */
+	fprintf(stdout, "FS Ls:\n");
+	for (int index = 0; index < FS_FILE_MAX_COUNT; index++) {
+		//Skip index if empty
+		if (root_dir.file[index].file_name[0] == '\0')
+			continue;
+
+		fprintf(stdout, "file: %s, size: %d, data_blk: %d\n", 
+			root_dir.file[index].file_name, root_dir.file[index].file_size + pending_appends(&root_dir.file[index]),
+			root_dir.file[index].data_blk);
+	}
+
+	return 0;
+}
+
+int fs_list(struct fs_dirent *out, size_t max)
+{
+	STATS_SCOPE(FS_OP_LIST);
+	size_t count = 0;
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (out == NULL && max > 0)
+		fs_error("out is NULL");
+
+	/* Describe files */
+	for (int index = 0; index < FS_FILE_MAX_COUNT && count < max; index++) {
+		struct file_entry *entry = &root_dir.file[index];
+
+		//Skip index if empty
+		if (entry->file_name[0] == '\0')
+			continue;
+
+		memcpy(out[count].name, entry->file_name, FS_FILENAME_LEN);
+		out[count].name[FS_FILENAME_LEN - 1] = '\0';
+		out[count].size = entry->file_size + pending_appends(entry);
+		out[count].data_blk = entry->data_blk;
+		out[count].blocks = chain_length(entry);
+		count++;
+	}
+
+	return count;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	STATS_SCOPE(FS_OP_OPEN);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (flags & ~FS_O_APPEND)
+		fs_error("Unknown flags");
+
+	// Check if filename is NULL or empty
+	if (filename == NULL || filename[0] == '\0')
+		fs_error("Filename is invalid (either NULL or empty)");
+
+	/* Find file in root directory */
+	int file_root_index = 0;
+	for (; file_root_index < FS_FILE_MAX_COUNT; file_root_index++) {
+		// Break loop if empty entry is found
+		if (strcmp((char*)root_dir.file[file_root_index].file_name, filename) == 0)
+			break;
+	}
+	if (file_root_index == FS_FILE_MAX_COUNT)
+		fs_error("No such file or directory");
+
+	/* Look for empty file descriptor */
+	int free_fd = 0;
+	for (; free_fd < FS_OPEN_MAX_COUNT; ++free_fd) {
+		if (fd_list[free_fd].entry == NULL)
+			break;
+	}
+	if (free_fd == FS_OPEN_MAX_COUNT)
+		fs_error("Too many files are currently open");
+
+	/* Assign file to fd */
+	fd_list[free_fd].entry = &(root_dir.file[file_root_index]);
+	fd_list[free_fd].flags = flags;
+	fd_list[free_fd].tail.loaded = 0;
+
+	record_call(-1, free_fd, "OPEN\t%s\tfd%d%s", filename, free_fd, (flags & FS_O_APPEND) ? "\tAPPEND" : "");
+
+	return free_fd;
 }
 
-int fs_create(const char *filename)
+int fs_close(int fd)
 {
+	STATS_SCOPE(FS_OP_CLOSE);
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
-	//Check if filename is NULL or empty
-	if (filename == NULL || filename[0] == '\0')
-		fs_error("Filename is invalid (either NULL or empty)");
+	// Check if file descriptor is closed or out of bounds
+	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+		fs_error("Invalid file descriptor");
 
-	// Check filename length (strlen doesn't count NULL, therefore use >=)
-	if (strlen(filename) >= FS_FILENAME_LEN)
-		fs_error("Filename must be less than 16 characters");
+	record_call(fd, -1, "CLOSE");
 
-	/* Find empty root entry */
-	int free_index = 0;
-	for (; free_index < FS_FILE_MAX_COUNT; free_index++) {
-		// Break loop if empty entry is found
-		if (root_dir.file[free_index].file_name[0] == '\0')
-			break;
+	// Write what was appended and is still in memory
+	if (flush_tail(fd, 1) < 0)
+		fs_error("Couldn't write appended data");
 
-		// Check if file already exists
-		if (strcmp(filename, (char*) root_dir.file[free_index].file_name) == 0)
-			fs_error("File already exists");
+	// Share the blocks the file has in common with others, which mustn't be kept by appending descriptors
+	if (dedup.enabled) {
+		if (flush_appends(fd_list[fd].entry, 1) < 0 || dedup_file(fd_list[fd].entry) < 0)
+			fs_error("dedup_file");
 	}
 
-	// Check root directory capacity
-	if (free_index == FS_FILE_MAX_COUNT)
-		fs_error("Filesystem is full");
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
 
-	/* Create file */
-	strcpy((char*)root_dir.file[free_index].file_name, filename);
-	root_dir.file[free_index].file_size = 0;
-	root_dir.file[free_index].data_blk = FAT_EOC;
+	/* Close the file (i.e. reset file descriptor) */
+	fd_list[fd].entry = NULL;
+	fd_list[fd].offset = 0;
+	fd_list[fd].flags = 0;
 
 	return 0;
 }
 
-int fs_delete(const char *filename)
+int fs_stat(int fd)
 {
+	STATS_SCOPE(FS_OP_STAT);
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
-	//Check if filename is NULL or empty
-	if (filename == NULL || filename[0] == '\0')
-		fs_error("Filename is invalid (either NULL or empty)");
+	// Check if file descriptor is open (i.e. not used) or out of bounds
+	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+		fs_error("Invalid file descriptor");
 
-	// Check if file is open
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		// Skip if fd is closed
-		if (fd_list[i].entry == NULL)
-			continue;
+	return fd_list[fd].entry->file_size + pending_appends(fd_list[fd].entry);
+}
 
-		if (strcmp(filename, (char*) fd_list[i].entry->file_name) == 0)
-			fs_error("Filename is currently open");
+int fs_lseek(int fd, size_t offset)
+{
+	STATS_SCOPE(FS_OP_LSEEK);
+
+	// Does error checks; the offset may go past the end of file, writing there leaves a gap of zeros
+	if (fs_stat(fd) < 0)
+		fs_error("fs_stat");
+
+	record_call(fd, fd, "SEEK\t%zu", offset);
+
+	/* Perform lseek */
+	fd_list[fd].offset = offset;
+
+	return 0;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	STATS_SCOPE(FS_OP_WRITE);
+	uint32_t counted = 0;
+	uint16_t reduced_offset = fd_list[fd].offset % BLOCK_SIZE;
+	uint16_t remaining_block_count = ((count + reduced_offset) / BLOCK_SIZE) + 1;	// Number of total blocks that must be written, accounting for offset
+	uint16_t current_block_index;
+	uint16_t write_count;
+	uint32_t shared_from;	// Blocks from this position on must be copied before being modified
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	// Check if file descriptor is closed or out of bounds
+	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+		fs_error("Invalid file descriptor");
+
+	if (buf == NULL)
+		fs_error("buf is NULL");
+
+	if (count == 0)
+		return 0;
+
+	record_call(fd, fd, "WRITE\tRANDOM\t%zu", count);
+	trace_request(FS_OP_WRITE, fd_list[fd].entry - root_dir.file, (fd_list[fd].flags & FS_O_APPEND) ?
+		      fd_list[fd].entry->file_size + pending_appends(fd_list[fd].entry) : fd_list[fd].offset, count);
+
+	// Appends go through the tail block, except for compressed and sparse files which just write at the end
+	if (fd_list[fd].flags & FS_O_APPEND) {
+		if (!(fd_list[fd].entry->flags & (FILE_COMPRESSED | FILE_SPARSE)))
+			return write_append(fd, buf, count);
+		fd_list[fd].offset = fd_list[fd].entry->file_size;
 	}
 
-	/* Find File in Root Directory */
-	int death_index = 0;
-	for (; death_index < FS_FILE_MAX_COUNT; death_index++) {
-		// Break loop if entry is found
-		if (strcmp((char*)root_dir.file[death_index].file_name, filename) == 0)
+	// Blocks kept by appending descriptors would become stale
+	if (flush_appends(fd_list[fd].entry, 1) < 0)
+		fs_error("Couldn't write appended data");
+
+	if (fd_list[fd].entry->flags & FILE_COMPRESSED)
+		return write_compressed(fd, buf, count);
+
+	// Writing past the end of file leaves a gap of zeros, possibly as holes
+	if (fd_list[fd].offset > fd_list[fd].entry->file_size || (fd_list[fd].entry->flags & FILE_SPARSE))
+		return write_sparse(fd, buf, count);
+
+	/* Begin Write */
+	shared_from = first_shared_block(fd_list[fd].entry);
+
+	// If data_blk = FAT_EOC, file is new. Otherwise, file exists.
+	current_block_index = (fd_list[fd].entry->data_blk == FAT_EOC) ?
+		create_data_block(fd) : fetch_data_block(fd_list[fd].entry->data_blk, fd_list[fd].offset / BLOCK_SIZE);
+
+	// Special case: If offset is at EOC, extend before write
+	if (reduced_offset == 0 && fd_list[fd].offset > 0 && current_block_index == FAT_EOC) {
+		uint16_t last_data_block = fetch_data_block(fd_list[fd].entry->data_blk, (fd_list[fd].offset / BLOCK_SIZE) - 1);
+		if ((fd_list[fd].offset / BLOCK_SIZE) - 1 >= shared_from)
+			last_data_block = unshare_block(fd_list[fd].entry, (fd_list[fd].offset / BLOCK_SIZE) - 1);
+		if (last_data_block == FAT_EOC)
+			fs_error("unshare_block");
+		current_block_index = link_data_block(last_data_block);
+	}
+
+	// Nothing can be written if the disk is full
+	if (current_block_index == FAT_EOC) {
+		error("Disk is full");
+		if (commit_metadata() < 0)
+			fs_error("commit_metadata");
+		return 0;
+	}
+
+	for (int i = 0; i < remaining_block_count; ++i, reduced_offset = 0) {
+		// Find if write ends within current block (count - counted) or extends past (BLOCK_SIZE - reduced_offset) [always <= 4096]
+		write_count = ( count - counted < (unsigned)BLOCK_SIZE - reduced_offset) ?
+				count - counted : (unsigned)BLOCK_SIZE - reduced_offset;
+
+		// Copy the block first if other files share it
+		if (fd_list[fd].offset / BLOCK_SIZE >= shared_from) {
+			current_block_index = unshare_block(fd_list[fd].entry, fd_list[fd].offset / BLOCK_SIZE);
+			if (current_block_index == FAT_EOC)
+				fs_error("unshare_block");
+			shared_from = fd_list[fd].offset / BLOCK_SIZE + 1;
+		}
+
+		/* Step 1: Read the offset'd block of the file into bounce buffer */
+		if (read_data_block(current_block_index, &bounce) < 0)
+			fs_error("block_read");
+
+		/* Step 2: Modify offset-bytes of bounce */
+		memcpy(&bounce.byte[reduced_offset], buf + counted, write_count);
+		stats_add(bounce_copies, 1);
+		counted += write_count;
+		fd_list[fd].offset += write_count;
+
+		/* Step 3: Write back bounce */
+		if (write_data_block(current_block_index, &bounce) < 0)
+			fs_error("block_write");
+
+		// Break if an adequate number of bytes were counted
+		if (counted >= count)
+			break;
+
+		/* Step 4: Modify FAT to link the next block in entry */
+		current_block_index = (FAT[current_block_index] == FAT_EOC) ?
+			link_data_block(current_block_index) : fetch_data_block(current_block_index, 1);
+		if (current_block_index == FAT_EOC) {
+			error("Disk is full");
 			break;
+		}
 	}
-		
-	// Check if file was found
-	if (death_index == FS_FILE_MAX_COUNT)
-		fs_error("File not found");
 
-	/* Delete File */
-	root_dir.file[death_index].file_name[0] = '\0';
+	// Increase file size metadata if offset extends beyond stored size
+	if (fd_list[fd].entry->file_size < fd_list[fd].offset) {
+		fd_list[fd].entry->file_size = fd_list[fd].offset;
+		metadata_dirty |= DIRTY_RDIR;
+	}
 
-	/* Make FAT available */
-	// Checks to see if file has content (created but unwritten files will have FAT_EOC)
-	if (root_dir.file[death_index].data_blk == FAT_EOC)
-		return 0;
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return counted;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	STATS_SCOPE(FS_OP_READ);
+	uint32_t counted = 0;
+	uint16_t reduced_offset = fd_list[fd].offset % BLOCK_SIZE;
+	uint16_t remaining_block_count = ((count + reduced_offset) / BLOCK_SIZE) + 1;	// Number of total blocks that must be written, accounting for offset
+	uint16_t current_block_index;
+	uint16_t read_count;
+
+	/* Error Checking */
+
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	// Check if file descriptor is closed or out of bounds
+	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+		fs_error("Invalid file descriptor");
+
+	// Check if buf is NULL
+	if (buf == NULL)
+		fs_error("buf is NULL");
+
+	record_call(fd, fd, "READ\t%zu", count);
+	trace_request(FS_OP_READ, fd_list[fd].entry - root_dir.file, fd_list[fd].offset, count);
+
+	// Bytes appended through other descriptors may still be in memory
+	if (flush_appends(fd_list[fd].entry, 0) < 0)
+		fs_error("Couldn't write appended data");
+
+	if (fd_list[fd].entry->flags & FILE_COMPRESSED)
+		return read_compressed(fd, buf, count);
+
+	if (fd_list[fd].entry->flags & FILE_SPARSE)
+		return read_sparse(fd, buf, count);
+
+	// Check if file is empty
+	if (fd_list[fd].entry->file_size == 0)
+		remaining_block_count = 0;
+
+	/* Begin Read */
+
+	// Account for offset possibly extending past first data block
+	current_block_index = fetch_data_block(fd_list[fd].entry->data_blk, fd_list[fd].offset / BLOCK_SIZE);
+	for (int i = 0; i < remaining_block_count; ++i, reduced_offset = 0) {
+		// Stop at the end of file, the chain may go on with blocks reserved by fs_fallocate()
+		if (fd_list[fd].offset >= fd_list[fd].entry->file_size)
+			break;
+
+		// Find if read ends within current block (count - counted) or extends past (BLOCK_SIZE - reduced_offset)
+		read_count = (  count - counted < (unsigned)BLOCK_SIZE - reduced_offset) ? 
+				count - counted : (unsigned)BLOCK_SIZE - reduced_offset;
+
+		// Account for if read_count surpasses file boundary
+		if (read_count > fd_list[fd].entry->file_size - fd_list[fd].offset)
+			read_count = fd_list[fd].entry->file_size - fd_list[fd].offset;
+
+		/* STEP 1: Read the offset'd block of the file into bounce buffer */ 
+		if (read_data_block(current_block_index, &bounce) < 0)
+			fs_error("block_read");
+
+		/* STEP 2: Copy bytes from bounce buffer to requested pointer */
+		memcpy(buf + counted, &bounce.byte[reduced_offset], read_count);
+		stats_add(bounce_copies, 1);
+		counted += read_count;
+		fd_list[fd].offset += read_count;
+
+		// Break if no more blocks
+		if (FAT[current_block_index] == FAT_EOC)
+			break;
+
+		/* STEP 3: Fetch next data block */
+		current_block_index = fetch_data_block(current_block_index, 1);
+	}
+
+	return counted;
+}
+
+
+int fs_flusher_start(const struct fs_flusher_config *config)
+{
+	STATS_SCOPE(FS_OP_FLUSHER_START);
+	struct cache_params params = {
+		.blocks = CACHE_DEFAULT_BLOCKS,
+		.dirty_ratio = CACHE_DEFAULT_DIRTY_RATIO,
+		.max_age_ms = CACHE_DEFAULT_MAX_AGE_MS,
+		.interval_ms = CACHE_DEFAULT_INTERVAL_MS,
+	};
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	// Zero fields keep their default value
+	if (config) {
+		if (config->cache_blocks)
+			params.blocks = config->cache_blocks;
+		if (config->dirty_ratio)
+			params.dirty_ratio = config->dirty_ratio;
+		if (config->max_age_ms)
+			params.max_age_ms = config->max_age_ms;
+		if (config->interval_ms)
+			params.interval_ms = config->interval_ms;
+	}
+
+	if (cache_enable(&params) < 0)
+		fs_error("Couldn't enable write-back cache");
+
+	// Metadata modified so far now goes through the cache as well
+	metadata_dirty = ~0u;
+
+	return commit_metadata();
+}
+
+int fs_flusher_stop(void)
+{
+	STATS_SCOPE(FS_OP_FLUSHER_STOP);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (!cache_is_enabled())
+		fs_error("Flusher not running");
+
+	if (cache_disable() < 0)
+		fs_error("Couldn't flush cache");
+
+	return 0;
+}
+
+int fs_sync(void)
+{
+	STATS_SCOPE(FS_OP_SYNC);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (flush_appends(NULL, 0) < 0 || write_metadata() < 0 || cache_sync() < 0)
+		fs_error("Couldn't flush cache");
+
+	return 0;
+}
 
-	// File has content
-	int index = root_dir.file[death_index].data_blk;
-	do {
-		int next = FAT[index];
-		FAT[index] = 0x0;
-		index = next;
+int fs_flusher_stats(struct fs_flusher_stats *stats)
+{
+	struct cache_counters counters;
 
-	} while (index != FAT_EOC);
+	if (stats == NULL)
+		fs_error("stats is NULL");
 
-	root_dir.file[death_index].data_blk = '\0';
+	cache_get_counters(&counters);
+	stats->flushes = counters.flushes;
+	stats->blocks_flushed = counters.blocks_flushed;
+	stats->runs = counters.runs;
+	stats->blocks_coalesced = counters.blocks_coalesced;
 
 	return 0;
 }
 
-int fs_ls(void)
+int fs_csum_enable(void)
 {
+	STATS_SCOPE(FS_OP_CSUM_ENABLE);
+	uint16_t head = FAT_EOC, tail = FAT_EOC;
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
-	/* List files */
-	fprintf(stdout, "FS Ls:\n");
-	for (int index = 0; index < FS_FILE_MAX_COUNT; index++) {
-		//Skip index if empty
-		if (root_dir.file[index].file_name[0] == '\0')
+	if (superblock.features & FEATURE_CSUM)
+		fs_error("Checksums already enabled");
+
+	/* Allocate the checksum table */
+	for (int i = 0; i * CSUM_PER_BLOCK < superblock.data_blk_count; ++i) {
+		uint16_t index = find_free_block();
+		if (index == FAT_EOC) {
+			// Give back what was allocated so far
+			while (head != FAT_EOC) {
+				uint16_t next = FAT[head];
+				set_fat(head, 0);
+				head = next;
+			}
+			fs_error("Not enough space for the checksum table");
+		}
+
+		set_fat(index, FAT_EOC);
+		if (tail == FAT_EOC)
+			head = index;
+		else
+			set_fat(tail, index);
+		tail = index;
+		metadata_dirty |= DIRTY_CSUM(i);
+	}
+
+	memset(csum_table, 0, sizeof(csum_table));
+	superblock.features |= FEATURE_CSUM;
+	superblock.csum_blk = head;
+	metadata_dirty |= DIRTY_SUPER;
+
+	/* Checksum the blocks currently holding file data */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] == '\0')
 			continue;
 
-		fprintf(stdout, "file: %s, size: %d, data_blk: %d\n", 
-			root_dir.file[index].file_name, root_dir.file[index].file_size, root_dir.file[index].data_blk);
+		for (uint16_t index = root_dir.file[i].data_blk; index != FAT_EOC; index = FAT[index]) {
+			if (cache_read(index + superblock.data_blk, &bounce) < 0)
+				fs_error("block_read");
+			set_csum(index, block_checksum(&bounce));
+		}
+
+		if (root_dir.file[i].flags & FILE_SPARSE) {
+			if (cache_read(root_dir.file[i].hole_blk + superblock.data_blk, &bounce) < 0)
+				fs_error("block_read");
+			set_csum(root_dir.file[i].hole_blk, block_checksum(&bounce));
+		}
 	}
 
-	return 0;
+	return commit_metadata();
 }
 
-int fs_open(const char *filename)
+int fs_csum_disable(void)
+{
+	STATS_SCOPE(FS_OP_CSUM_DISABLE);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (!(superblock.features & FEATURE_CSUM))
+		fs_error("Checksums not enabled");
+
+	/* Release the checksum table */
+	uint16_t index = superblock.csum_blk;
+	while (index != FAT_EOC) {
+		uint16_t next = FAT[index];
+		set_fat(index, 0);
+		index = next;
+	}
+
+	memset(csum_table, 0, sizeof(csum_table));
+	superblock.features &= ~FEATURE_CSUM;
+	superblock.csum_blk = 0;
+	metadata_dirty |= DIRTY_SUPER;
+
+	return commit_metadata();
+}
+
+int fs_set_compression(const char *filename, int enable)
 {
+	STATS_SCOPE(FS_OP_SET_COMPRESSION);
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
@@ -378,84 +3649,209 @@ int fs_open(const char *filename)
 	/* Find file in root directory */
 	int file_root_index = 0;
 	for (; file_root_index < FS_FILE_MAX_COUNT; file_root_index++) {
-		// Break loop if empty entry is found
 		if (strcmp((char*)root_dir.file[file_root_index].file_name, filename) == 0)
 			break;
 	}
 	if (file_root_index == FS_FILE_MAX_COUNT)
 		fs_error("No such file or directory");
 
-	/* Look for empty file descriptor */
-	int free_fd = 0;
-	for (; free_fd < FS_OPEN_MAX_COUNT; ++free_fd) {
-		if (fd_list[free_fd].entry == NULL)
-			break;
-	}
-	if (free_fd == FS_OPEN_MAX_COUNT)
-		fs_error("Too many files are currently open");
+	// Scripts can only enable compression
+	if (enable)
+		record_call(-1, -1, "COMPRESS\t%s", filename);
 
-	/* Assign file to fd */
-	fd_list[free_fd].entry = &(root_dir.file[file_root_index]);
+	// The data layout depends on the mode, so it can only change while there is no data
+	struct file_entry *entry = &root_dir.file[file_root_index];
+	if (flush_appends(entry, 1) < 0)
+		fs_error("Couldn't write appended data");
+	if (entry->file_size != 0 || entry->data_blk != FAT_EOC)
+		fs_error("File is not empty");
 
-	return free_fd;
+	/* Change mode */
+	if (enable)
+		entry->flags |= FILE_COMPRESSED;
+	else
+		entry->flags &= ~FILE_COMPRESSED;
+	metadata_dirty |= DIRTY_RDIR;
+
+	return commit_metadata();
 }
 
-int fs_close(int fd)
+int fs_set_dedup(int enable)
 {
+	STATS_SCOPE(FS_OP_SET_DEDUP);
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
-	// Check if file descriptor is closed or out of bounds
-	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
-		fs_error("Invalid file descriptor");
+	if (!enable) {
+		dedup.enabled = 0;
+		return 0;
+	}
 
-	/* Close the file (i.e. reset file descriptor) */
-	fd_list[fd].entry = NULL;
-	fd_list[fd].offset = 0;
+	if (dedup.enabled)
+		return 0;
 
-	return 0;
+	if (alloc_refcount_table() < 0)
+		return -1;
+
+	/* Index the blocks of existing files */
+	memset(dedup.indexed, 0, sizeof(dedup.indexed));
+	for (int i = 0; i < DEDUP_BUCKET_COUNT; ++i)
+		dedup.bucket[i] = FAT_EOC;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_dir.file[i].file_name[0] == '\0')
+			continue;
+
+		for (uint16_t index = root_dir.file[i].data_blk; index != FAT_EOC; index = FAT[index]) {
+			if (dedup.indexed[index])
+				continue;
+			if (read_data_block(index, &bounce) < 0)
+				fs_error("block_read");
+			dedup_insert(index, crc32c(0, &bounce, BLOCK_SIZE));
+		}
+	}
+
+	dedup.enabled = 1;
+
+	return commit_metadata();
 }
 
-int fs_stat(int fd)
+int fs_clone(const char *src, const char *dst)
 {
+	STATS_SCOPE(FS_OP_CLONE);
+
 	/* Error Checking */
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
-	// Check if file descriptor is open (i.e. not used) or out of bounds
-	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
-		fs_error("Invalid file descriptor");
+	// Check if filenames are NULL or empty
+	if (src == NULL || src[0] == '\0' || dst == NULL || dst[0] == '\0')
+		fs_error("Filename is invalid (either NULL or empty)");
+
+	// Check filename length (strlen doesn't count NULL, therefore use >=)
+	if (strlen(dst) >= FS_FILENAME_LEN)
+		fs_error("Filename must be less than 16 characters");
+
+	/* Find source and empty root entry */
+	int src_index = FS_FILE_MAX_COUNT, free_index = FS_FILE_MAX_COUNT;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_dir.file[i].file_name[0] == '\0') {
+			if (free_index == FS_FILE_MAX_COUNT)
+				free_index = i;
+			continue;
+		}
+
+		if (strcmp(dst, (char*) root_dir.file[i].file_name) == 0)
+			fs_error("File already exists");
+		if (strcmp(src, (char*) root_dir.file[i].file_name) == 0)
+			src_index = i;
+	}
+
+	if (src_index == FS_FILE_MAX_COUNT)
+		fs_error("No such file or directory");
+
+	// Check root directory capacity
+	if (free_index == FS_FILE_MAX_COUNT)
+		fs_error("Filesystem is full");
+
+	record_call(-1, -1, "CLONE\t%s\t%s", src, dst);
+
+	if (flush_appends(&root_dir.file[src_index], 1) < 0)
+		fs_error("Couldn't write appended data");
+
+	/* Share the source's chain */
+	// The new root entry is one more reference to the first block, and through it to the whole chain
+	uint16_t data_blk = root_dir.file[src_index].data_blk;
+	if (data_blk != FAT_EOC) {
+		if (alloc_refcount_table() < 0)
+			return -1;
+		set_refcount(data_blk, refcount_table[data_blk] + 1);
+	}
+
+	// The hole map gets modified in place, so the clone has its own copy
+	if (root_dir.file[src_index].flags & FILE_SPARSE) {
+		uint16_t hole_blk = find_free_block();
+		if (hole_blk == FAT_EOC || load_hole_map(&root_dir.file[src_index]) < 0) {
+			if (data_blk != FAT_EOC)
+				set_refcount(data_blk, refcount_table[data_blk] - 1);
+			fs_error("Couldn't copy the hole map");
+		}
+		set_fat(hole_blk, FAT_EOC);
+		if (store_hole_map(hole_blk) < 0)
+			return -1;
+		root_dir.file[free_index].hole_blk = hole_blk;
+	}
+
+	/* Create file */
+	strcpy((char*)root_dir.file[free_index].file_name, dst);
+	root_dir.file[free_index].file_size = root_dir.file[src_index].file_size;
+	root_dir.file[free_index].data_blk = data_blk;
+	root_dir.file[free_index].flags = root_dir.file[src_index].flags;
+	metadata_dirty |= DIRTY_RDIR;
 
-	return fd_list[fd].entry->file_size;
+	return commit_metadata();
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out, size_t len)
 {
-	// Fetches file size AND does error checks
-	int file_size = fs_stat(fd);
-	if (file_size < 0)
-		fs_error("fs_stat");
+	STATS_SCOPE(FS_OP_COPY_RANGE);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	// Check if file descriptors are closed or out of bounds
+	if (fd_in < 0 || fd_in >= FS_OPEN_MAX_COUNT || fd_list[fd_in].entry == NULL
+	    || fd_out < 0 || fd_out >= FS_OPEN_MAX_COUNT || fd_list[fd_out].entry == NULL)
+		fs_error("Invalid file descriptor");
 
-	// Check if offset exceeds filesize
-	if ((size_t)file_size < offset)
+	struct file_entry *in = fd_list[fd_in].entry, *out = fd_list[fd_out].entry;
+	if (flush_appends(in, 1) < 0 || flush_appends(out, 1) < 0)
+		fs_error("Couldn't write appended data");
+
+	// Check if offsets exceed file sizes
+	if (off_in > in->file_size || off_out > out->file_size)
 		fs_error("Requested offset surpasses file boundaries");
 
-	/* Perform lseek */
-	fd_list[fd].offset = offset;
+	// Copy at most up to the end of the source
+	if (len > in->file_size - off_in)
+		len = in->file_size - off_in;
 
-	return 0;
+	if (in == out && off_in < off_out + len && off_out < off_in + len)
+		fs_error("Source and destination ranges overlap");
+
+	record_call(fd_out, fd_out, "COPY\tfd%d\t%zu\t%zu\t%zu", fd_in, off_in, off_out, len);
+
+	if (len == 0)
+		return 0;
+
+	/* Begin Copy */
+	int ret = ((in->flags | out->flags) & (FILE_COMPRESSED | FILE_SPARSE)) ?
+		copy_range_buffered(fd_in, off_in, fd_out, off_out, len) :
+		copy_range_blocks(in, off_in, out, off_out, len);
+	if (ret < 0)
+		return -1;
+
+	// Increase file size metadata if the range extends beyond stored size
+	if (out->file_size < off_out + len) {
+		out->file_size = off_out + len;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return len;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_truncate(int fd, size_t new_size)
 {
-	uint32_t counted = 0;
-	uint16_t reduced_offset = fd_list[fd].offset % BLOCK_SIZE;
-	uint16_t remaining_block_count = ((count + reduced_offset) / BLOCK_SIZE) + 1;	// Number of total blocks that must be written, accounting for offset
-	uint16_t current_block_index;
-	uint16_t write_count;
+	STATS_SCOPE(FS_OP_TRUNCATE);
 
 	/* Error Checking */
 	// Check if FS is mounted
@@ -463,117 +3859,306 @@ int fs_write(int fd, void *buf, size_t count)
 		fs_error("Filesystem not mounted");
 
 	// Check if file descriptor is closed or out of bounds
-	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_list[fd].entry == NULL)
 		fs_error("Invalid file descriptor");
 
-	if (buf == NULL)
-		fs_error("buf is NULL");
+	record_call(fd, fd, "TRUNCATE\t%zu", new_size);
 
-	if (count == 0)
+	struct file_entry *entry = fd_list[fd].entry;
+	if (flush_appends(entry, 1) < 0)
+		fs_error("Couldn't write appended data");
+
+	// Compressed files have no reserved blocks to release
+	if (new_size == entry->file_size && (entry->flags & FILE_COMPRESSED))
 		return 0;
 
-	/* Begin Write */
+	/* Extend the file with zeros */
+	if (new_size > entry->file_size) {
+		if (entry->flags & FILE_COMPRESSED) {
+			// An empty write past the end of file pads the file with compressed zeros
+			size_t saved_offset = fd_list[fd].offset;
+			fd_list[fd].offset = new_size;
+			int ret = write_compressed(fd, "", 0);
+			fd_list[fd].offset = saved_offset;
+			return ret;
+		}
 
-	// If data_blk = FAT_EOC, file is new. Otherwise, file exists.
-	current_block_index = (fd_list[fd].entry->data_blk == FAT_EOC) ?
-		create_data_block(fd) : fetch_data_block(fd_list[fd].entry->data_blk, fd_list[fd].offset / BLOCK_SIZE);
+		if (extend_file(entry, new_size) < 0)
+			return -1;
+		if (hole_map.dirty && store_hole_map(entry->hole_blk) < 0)
+			return -1;
 
-	// Special case: If offset is at EOC, extend before write
-	if (reduced_offset == 0 && fd_list[fd].offset > 0 && current_block_index == FAT_EOC) {
-		uint16_t last_data_block = fetch_data_block(fd_list[fd].entry->data_blk, (fd_list[fd].offset / BLOCK_SIZE) - 1);
-		current_block_index = link_data_block(last_data_block);
+		return commit_metadata();
 	}
 
-	for (int i = 0; i < remaining_block_count; ++i, reduced_offset = 0) {
-		// Find if write ends within current block (count - counted) or extends past (BLOCK_SIZE - reduced_offset) [always <= 4096]
-		write_count = ( count - counted < (unsigned)BLOCK_SIZE - reduced_offset) ?
-				count - counted : (unsigned)BLOCK_SIZE - reduced_offset;
+	/* Release the tail */
+	uint32_t kept_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-		/* Step 1: Read the offset'd block of the file into bounce buffer */
-		if (block_read(current_block_index + superblock.data_blk, &bounce) < 0)
-			fs_error("block_read");
+	if (new_size == 0) {
+		// The whole chain goes, including the chunk index of compressed files and the hole map of sparse files
+		release_chain(entry->data_blk);
+		entry->data_blk = FAT_EOC;
+		if (chunk_cache.entry == entry)
+			chunk_cache.entry = NULL;
+		if (entry->flags & FILE_SPARSE) {
+			release_chain(entry->hole_blk);
+			entry->flags &= ~FILE_SPARSE;
+		}
+		if (hole_map.entry == entry)
+			hole_map.entry = NULL;
+	} else if (entry->flags & FILE_COMPRESSED) {
+		// Recompress the chunk holding the new last byte, which releases the blocks past the new end of the stream
+		uint32_t chunk = (new_size - 1) / CHUNK_SIZE;
+		size_t kept = new_size - (size_t)chunk * CHUNK_SIZE;
+		size_t saved_offset = fd_list[fd].offset;
+		uint32_t saved_size = entry->file_size;
+		uint8_t *data = malloc(kept);
 
-		/* Step 2: Modify offset-bytes of bounce */
-		memcpy(&bounce.byte[reduced_offset], buf + counted, write_count);
-		counted += write_count;
-		fd_list[fd].offset += write_count;
+		if (!data)
+			fs_perror("malloc");
+		if (load_chunk(entry, chunk) < 0) {
+			free(data);
+			return -1;
+		}
+		memcpy(data, chunk_cache.data, kept);
 
-		/* Step 3: Write back bounce */
-		if (block_write(current_block_index + superblock.data_blk, &bounce) < 0)
-			fs_error("block_write");
+		// Writing to the end of a file cut at the chunk boundary rewrites that chunk only
+		entry->file_size = (size_t)chunk * CHUNK_SIZE;
+		fd_list[fd].offset = entry->file_size;
+		int ret = write_compressed(fd, data, kept);
+		fd_list[fd].offset = saved_offset;
+		free(data);
+		if (ret < 0) {
+			entry->file_size = saved_size;
+			return -1;
+		}
+	} else {
+		if (load_hole_map(entry) < 0)
+			return -1;
 
-		// Break if an adequate number of bytes were counted
-		if (counted >= count)
-			break;
+		// Holes have no block in the chain
+		uint32_t kept_chain = kept_blocks - count_holes(kept_blocks);
 
-		/* Step 4: Modify FAT to link the next block in entry */
-		current_block_index = (FAT[current_block_index] == FAT_EOC) ?
-			link_data_block(current_block_index) : fetch_data_block(current_block_index, 1);
+		if (kept_chain == 0) {
+			release_chain(entry->data_blk);
+			entry->data_blk = FAT_EOC;
+		} else {
+			// Walk to the new last block, noting whether it is shared
+			uint16_t last = entry->data_blk;
+			int shared = refcount_table[last] != 0;
+			for (uint32_t i = 1; i < kept_chain; ++i) {
+				last = FAT[last];
+				shared |= refcount_table[last] != 0;
+			}
+
+			// Its FAT entry is about to change, so it must not be shared
+			if (shared && FAT[last] != FAT_EOC) {
+				last = unshare_block(entry, kept_chain - 1);
+				if (last == FAT_EOC)
+					return -1;
+			}
+
+			release_chain(FAT[last]);
+			set_fat(last, FAT_EOC);
+		}
+
+		// Forget the holes past the new end of file
+		for (uint32_t position = kept_blocks; position < HOLE_MAP_BITS; ++position) {
+			if (is_hole(position))
+				set_hole(position, 0);
+		}
+		if (hole_map.dirty && store_hole_map(entry->hole_blk) < 0)
+			return -1;
 	}
 
-	// Increase file size metadata if offset extends beyond stored size
-	if (fd_list[fd].entry->file_size < fd_list[fd].offset)
-		fd_list[fd].entry->file_size = fd_list[fd].offset;
+	entry->file_size = new_size;
+	metadata_dirty |= DIRTY_RDIR;
 
-	return counted;
+	// Keep the offsets of every descriptor of the file within bounds
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (fd_list[i].entry == entry && fd_list[i].offset > new_size)
+			fd_list[i].offset = new_size;
+	}
+
+	if (commit_metadata() < 0)
+		fs_error("commit_metadata");
+
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_fallocate(int fd, size_t len)
 {
-	uint32_t counted = 0;
-	uint16_t reduced_offset = fd_list[fd].offset % BLOCK_SIZE;
-	uint16_t remaining_block_count = ((count + reduced_offset) / BLOCK_SIZE) + 1;	// Number of total blocks that must be written, accounting for offset
-	uint16_t current_block_index;
-	uint16_t read_count;
+	STATS_SCOPE(FS_OP_FALLOCATE);
 
 	/* Error Checking */
-
 	// Check if FS is mounted
 	if (superblock.sig != SIGNATURE)
 		fs_error("Filesystem not mounted");
 
 	// Check if file descriptor is closed or out of bounds
-	if (fd_list[fd].entry == NULL || fd >= FS_OPEN_MAX_COUNT)
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_list[fd].entry == NULL)
 		fs_error("Invalid file descriptor");
 
-	// Check if buf is NULL
-	if (buf == NULL)
-		fs_error("buf is NULL");
+	record_call(fd, fd, "FALLOCATE\t%zu", len);
 
-	// Check if file is empty
-	if (fd_list[fd].entry->file_size == 0)
-		remaining_block_count = 0;
+	struct file_entry *entry = fd_list[fd].entry;
+	if (flush_appends(entry, 1) < 0)
+		fs_error("Couldn't write appended data");
 
-	/* Begin Read */
+	// The chain of a compressed file follows its compressed stream
+	if (entry->flags & FILE_COMPRESSED)
+		fs_error("Cannot reserve space for a compressed file");
 
-	// Account for offset possibly extending past first data block
-	current_block_index = fetch_data_block(fd_list[fd].entry->data_blk, fd_list[fd].offset / BLOCK_SIZE);
-	for (int i = 0; i < remaining_block_count; ++i, reduced_offset = 0) {
-		// Find if read ends within current block (count - counted) or extends past (BLOCK_SIZE - reduced_offset)
-		read_count = (  count - counted < (unsigned)BLOCK_SIZE - reduced_offset) ? 
-				count - counted : (unsigned)BLOCK_SIZE - reduced_offset;
+	if (load_hole_map(entry) < 0)
+		return -1;
 
-		// Account for if read_count surpasses file boundary
-		if (read_count > fd_list[fd].entry->file_size - fd_list[fd].offset)
-			read_count = fd_list[fd].entry->file_size - fd_list[fd].offset;
+	/* Find the end of the chain */
+	uint32_t needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE, have = 0;
+	uint16_t last = FAT_EOC;
+	int shared = 0;
+	for (uint16_t index = entry->data_blk; index != FAT_EOC; index = FAT[index], ++have) {
+		last = index;
+		shared |= refcount_table[index] != 0;
+	}
 
-		/* STEP 1: Read the offset'd block of the file into bounce buffer */ 
-		if (block_read(current_block_index + superblock.data_blk, &bounce) < 0)
-			fs_error("block_read");
+	// Holes are left as they are, blocks are only reserved past the last one
+	uint32_t logical = have + count_holes(HOLE_MAP_BITS);
+	if (needed <= logical)
+		return 0;
 
-		/* STEP 2: Copy bytes from bounce buffer to requested pointer */
-		memcpy(buf + counted, &bounce.byte[reduced_offset], read_count);
-		counted += read_count;
-		fd_list[fd].offset += read_count;
+	// The last block's FAT entry is about to change, so it must not be shared
+	if (shared) {
+		last = unshare_block(entry, have - 1);
+		if (last == FAT_EOC)
+			return -1;
+	}
 
-		// Break if no more blocks
-		if (FAT[current_block_index] == FAT_EOC)
+	/* Reserve the missing blocks */
+	if (count_free_blocks(needed - logical) < (int)(needed - logical))
+		fs_error("Not enough space");
+
+	uint16_t first = alloc_extent(last, needed - logical);
+	if (last == FAT_EOC) {
+		entry->data_blk = first;
+		metadata_dirty |= DIRTY_RDIR;
+	}
+
+	return commit_metadata();
+}
+
+int fs_frag_stats(struct fs_frag_stats *stats)
+{
+	STATS_SCOPE(FS_OP_FRAG_STATS);
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	if (stats == NULL)
+		fs_error("stats is NULL");
+
+	memset(stats, 0, sizeof(*stats));
+
+	/* Extents of the files */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct file_entry *entry = &root_dir.file[i];
+		if (entry->file_name[0] == '\0' || entry->data_blk == FAT_EOC)
+			continue;
+
+		uint32_t extents = count_extents(entry);
+		stats->files++;
+		stats->blocks += chain_length(entry);
+		stats->extents += extents;
+		if (extents > 1)
+			stats->fragmented_files++;
+	}
+
+	/* Runs of free blocks */
+	unsigned int run = 0;
+	for (int index = 1; index <= superblock.data_blk_count; ++index) {
+		if (index < superblock.data_blk_count && FAT[index] == 0) {
+			run++;
+			continue;
+		}
+		if (run) {
+			stats->free_extents++;
+			if (run > stats->largest_free_extent)
+				stats->largest_free_extent = run;
+		}
+		run = 0;
+	}
+	stats->free_blocks = free_space.count;
+
+	return 0;
+}
+
+int fs_defrag(unsigned int max_blocks)
+{
+	STATS_SCOPE(FS_OP_DEFRAG);
+	unsigned int moved = 0;
+
+	/* Error Checking */
+	// Check if FS is mounted
+	if (superblock.sig != SIGNATURE)
+		fs_error("Filesystem not mounted");
+
+	record_call(-1, -1, "DEFRAG\t%u", max_blocks);
+
+	if (flush_appends(NULL, 1) < 0)
+		fs_error("Couldn't write appended data");
+
+	/* Move blocks, resuming where the previous call stopped */
+	while (max_blocks == 0 || moved < max_blocks) {
+		if (!defrag_cursor_valid() && !defrag_pick()) {
+			defrag.entry = NULL;
 			break;
+		}
 
-		/* STEP 3: Fetch next data block */
-		current_block_index = fetch_data_block(current_block_index, 1);
+		int step = defrag_step(max_blocks ? max_blocks - moved : DEFRAG_BATCH_BLOCKS);
+		if (step < 0) {
+			defrag.entry = NULL;
+			fs_error("Couldn't move blocks");
+		}
+		moved += step;
 	}
 
-	return counted;
+	return moved;
 }
 
+int fs_check(const char *diskname, int repair, struct fs_check_report *report)
+{
+	STATS_SCOPE(FS_OP_CHECK);
+
+	/* Error Checking */
+	// The image is read directly, so it must not be mounted
+	if (superblock.sig == SIGNATURE)
+		fs_error("A filesystem is mounted");
+
+	if (report == NULL)
+		fs_error("report is NULL");
+
+	memset(report, 0, sizeof(*report));
+
+	if (block_disk_open(diskname) < 0)
+		fs_error("Couldn't open disk");
+
+	/* Check */
+	metadata_dirty = 0;
+	int ret = check_image(repair, report);
+	checker.repair = 0;
+
+	/* Leave nothing that looks mounted behind */
+	superblock = (const struct superblock){ 0 };
+	memset(FAT, 0, sizeof(FAT));
+	free_space = (const struct free_space){ 0 };
+	memset(csum_table, 0, sizeof(csum_table));
+	memset(refcount_table, 0, sizeof(refcount_table));
+	root_dir = (const struct root_dir){ 0 };
+	metadata_dirty = 0;
+
+	if (block_disk_close() < 0)
+		fs_error("Couldn't close disk");
+
+	return ret;
+}
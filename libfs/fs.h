@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +13,9 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** fs_open_flags() flag: every write goes to the end of the file */
+#define FS_O_APPEND 0x1
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -73,6 +77,41 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_create_many - Create several new files
+ * @filenames: Array of file names
+ * @count: Number of names in @filenames
+ * @status: Array of @count entries filled with the result of each creation (0
+ * or -1, as fs_create() would return), or NULL
+ *
+ * Create an empty file for every name of @filenames, as fs_create() does, but
+ * with a single pass over the root directory and a single metadata update. A
+ * name that is invalid, or already used, including earlier in @filenames, or
+ * that doesn't fit in the root directory, fails without affecting the others.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames is NULL while
+ * @count is not 0. Otherwise return the number of files created.
+ */
+int fs_create_many(const char **filenames, size_t count, int *status);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Array of file names
+ * @count: Number of names in @filenames
+ * @status: Array of @count entries filled with the result of each deletion (0
+ * or -1, as fs_delete() would return), or NULL
+ *
+ * Delete every file named in @filenames, as fs_delete() does, but with a
+ * single pass over the root directory and the open files, and a single
+ * metadata update once the data blocks of all deleted files are freed. A name
+ * that is invalid, or that no file has (anymore), or whose file is open, fails
+ * without affecting the others.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames is NULL while
+ * @count is not 0. Otherwise return the number of files deleted.
+ */
+int fs_delete_many(const char **filenames, size_t count, int *status);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +121,37 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * struct fs_dirent - Description of a file, filled by fs_list()
+ * @name: File name, NULL-terminated
+ * @size: Size of the file in bytes
+ * @data_blk: Index of the first data block, 0xFFFF if the file has none
+ * @blocks: Number of data blocks in the file's chain
+ *
+ * Holes of sparse files take no block, while blocks reserved by fs_fallocate()
+ * are counted.
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	uint32_t size;
+	uint16_t data_blk;
+	uint32_t blocks;
+};
+
+/**
+ * fs_list - List files on file system
+ * @out: Array to fill with the description of the files
+ * @max: Number of entries of @out
+ *
+ * Describe the files located in the root directory, in the order of fs_ls(),
+ * without any output. At most @max files are described, so an array of
+ * %FS_FILE_MAX_COUNT entries always holds them all.
+ *
+ * Return: -1 if no FS is currently mounted, or if @out is NULL while @max is
+ * not 0. Otherwise return the number of entries filled.
+ */
+int fs_list(struct fs_dirent *out, size_t max);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -101,6 +171,24 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of FS_O_* flags, 0 for the behavior of fs_open()
+ *
+ * With %FS_O_APPEND, every fs_write() on the returned file descriptor goes to
+ * the end of the file, whatever the file offset, and leaves the offset there.
+ * The descriptor keeps the last block of the file in memory: appended bytes
+ * fill it and it is written once full, so that small appends neither walk the
+ * chain nor read the block back. Bytes still in that block are counted by
+ * fs_stat() and are written by fs_sync(), fs_close(), or any other operation
+ * that reads or modifies the file.
+ *
+ * Return: -1 as fs_open(), or if @flags holds an unknown flag. Otherwise,
+ * return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -133,9 +221,11 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset can be set past the end of the file, in which case a subsequent
+ * write leaves a gap that reads as zeros (see fs_write()).
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -155,6 +245,11 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * When the file offset is past the end of the file, the gap is filled with
+ * zeros. Blocks that lie entirely in the gap are not allocated: they become
+ * holes, recorded in a hole map block owned by the file, and only get a data
+ * block once written to. Sparse files are limited to 128 MiB.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
@@ -173,8 +268,9 @@ int fs_write(int fd, void *buf, size_t count);
  *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * is at or past the end of the file). The file offset of the file descriptor is
+ * implicitly incremented by the number of bytes that were actually read. Holes
+ * read as zeros without any disk access.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
@@ -182,4 +278,544 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * struct fs_flusher_config - Tuning of the write-back cache
+ * @cache_blocks: Number of blocks held by the cache
+ * @dirty_ratio: Percentage of dirty cache blocks that triggers a flush
+ * @max_age_ms: Age in milliseconds after which a dirty block gets flushed
+ * @interval_ms: Period in milliseconds at which the flusher wakes up
+ *
+ * Fields left to 0 take a default value.
+ */
+struct fs_flusher_config {
+	unsigned int cache_blocks;
+	unsigned int dirty_ratio;
+	unsigned int max_age_ms;
+	unsigned int interval_ms;
+};
+
+/**
+ * struct fs_flusher_stats - Activity of the background flusher
+ * @flushes: Number of flush passes that wrote blocks
+ * @blocks_flushed: Number of blocks written by flush passes
+ * @runs: Number of disk writes issued by flush passes
+ * @blocks_coalesced: Number of blocks merged into the run of a preceding block
+ */
+struct fs_flusher_stats {
+	uint64_t flushes;
+	uint64_t blocks_flushed;
+	uint64_t runs;
+	uint64_t blocks_coalesced;
+};
+
+/**
+ * fs_flusher_start - Enable write-back caching and its flusher thread
+ * @config: Cache tuning, or NULL for the defaults
+ *
+ * Once started, fs_write() and metadata updates only modify cached blocks and
+ * return without waiting for the disk. A background thread batches the dirty
+ * blocks, sorts them by block number and writes them back in ascending order,
+ * merging consecutive blocks into single writes. It does so periodically, when
+ * the dirty ratio is exceeded, or when a dirty block becomes too old. The cache
+ * is flushed and disabled by fs_flusher_stop() or fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if the flusher is already
+ * running, or if the cache cannot be allocated. 0 otherwise.
+ */
+int fs_flusher_start(const struct fs_flusher_config *config);
+
+/**
+ * fs_flusher_stop - Flush the cache and stop the flusher thread
+ *
+ * Return: -1 if no FS is currently mounted, or if the flusher is not running,
+ * or if the cache cannot be flushed. 0 otherwise.
+ */
+int fs_flusher_stop(void);
+
+/**
+ * fs_sync - Write all modified data and metadata to disk
+ *
+ * Return: -1 if no FS is currently mounted, or if writing to the disk fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_flusher_stats - Get the activity counters of the flusher
+ * @stats: Structure to fill
+ *
+ * Counters are reset by fs_flusher_start() and kept after fs_flusher_stop().
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_flusher_stats(struct fs_flusher_stats *stats);
+
+/**
+ * fs_csum_enable - Start checksumming data blocks
+ *
+ * Allocate a checksum table in the data region of the mounted file system and
+ * fill it with the CRC32C of every block currently holding file data. From
+ * then on, checksums are updated whenever a data block is written and verified
+ * whenever it is read, so that fs_read() fails instead of returning corrupted
+ * data. The setting is persistent.
+ *
+ * Return: -1 if no FS is currently mounted, or if checksums are already
+ * enabled, or if there is not enough space for the table. 0 otherwise.
+ */
+int fs_csum_enable(void);
+
+/**
+ * fs_csum_disable - Stop checksumming data blocks
+ *
+ * Release the checksum table of the mounted file system.
+ *
+ * Return: -1 if no FS is currently mounted, or if checksums are not enabled.
+ * 0 otherwise.
+ */
+int fs_csum_disable(void);
+
+/**
+ * fs_set_compression - Enable or disable transparent compression of a file
+ * @filename: File name
+ * @enable: Non-zero to compress the file's data, zero to store it as is
+ *
+ * Data of a compressed file is stored as independently compressed chunks of
+ * 32 KiB, so that fs_lseek() and fs_read() keep random access at the cost of
+ * decompressing one chunk. Writing recompresses every chunk from the file
+ * offset up to the end of the file, which makes appending cheap and overwriting
+ * early offsets of large files expensive. A compressed file cannot exceed
+ * 32 MiB, and a write fails as a whole if the disk runs out of space. The mode
+ * can only be changed while the file is empty.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if the file is not empty. 0 otherwise.
+ */
+int fs_set_compression(const char *filename, int enable);
+
+/**
+ * fs_set_dedup - Enable or disable block deduplication
+ * @enable: Non-zero to enable deduplication, zero to disable it
+ *
+ * In dedup mode, the hash of every data block is kept in memory. When a file is
+ * closed, its blocks are compared with blocks of identical content in other
+ * files, and the duplicates are freed in favor of a shared copy. A FAT chain
+ * can only share its end with other chains, so files with identical content
+ * share all their blocks while files with a common prefix share nothing.
+ *
+ * Sharing is tracked by a persistent reference count table allocated the first
+ * time dedup mode is enabled: shared blocks are copied before being modified
+ * through any of the files, and fs_delete() only frees blocks no other file
+ * references. Disabling dedup mode keeps existing blocks shared.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is not enough space
+ * for the reference count table. 0 otherwise.
+ */
+int fs_set_dedup(int enable);
+
+/**
+ * fs_clone - Create a copy-on-write clone of a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the content and mode of @src. No data is
+ * copied: the new root entry shares the data blocks of @src and takes a
+ * reference to its first block, which keeps the whole chain alive. Blocks are
+ * copied when one of the files is later modified, as with fs_set_dedup(). The
+ * first clone of a non-empty file allocates the reference count table.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if a file named @dst already exists, or if
+ * the root directory is full, or if there is not enough space for the
+ * reference count table. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_copy_range - Copy a range of bytes between files
+ * @fd_in: File descriptor to copy from
+ * @off_in: Offset of the range in the file @fd_in
+ * @fd_out: File descriptor to copy to
+ * @off_out: Offset of the range in the file @fd_out
+ * @len: Number of bytes to copy
+ *
+ * Copy up to @len bytes from offset @off_in of file @fd_in to offset @off_out
+ * of file @fd_out, which is extended if needed. Unlike fs_clone(), the data is
+ * copied, but without going through a user buffer: blocks are moved inside the
+ * file system with one disk operation per run of consecutive blocks, and
+ * appended blocks are allocated as a contiguous extent whenever possible.
+ * Blocks fully covered by the range are overwritten without being read. The
+ * file offsets of @fd_in and @fd_out are left unchanged.
+ *
+ * The number of bytes copied can be smaller than @len if the range reaches the
+ * end of file @fd_in.
+ *
+ * Return: -1 if no FS is currently mounted, or if a file descriptor is
+ * invalid, or if @off_in or @off_out is past the end of its file, or if both
+ * ranges overlap within the same file, or if there is not enough space.
+ * Otherwise return the number of bytes actually copied.
+ */
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out, size_t len);
+
+/**
+ * fs_truncate - Change the size of a file
+ * @fd: File descriptor
+ * @new_size: New size of the file, in bytes
+ *
+ * Set the size of the file referenced by file descriptor @fd to @new_size
+ * bytes. A file extended this way reads as zeros past its former end, and the
+ * blocks that did not exist become holes as with fs_write().
+ *
+ * When the file shrinks, the chain is walked once up to the new last block,
+ * and every block past it is released in the same pass (blocks shared with
+ * other files only lose a reference), including blocks reserved by
+ * fs_fallocate(). Offsets of file descriptors pointing past the new end of
+ * file are moved back to it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if the file cannot
+ * be extended. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t new_size);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @len: Number of bytes to reserve from the start of the file
+ *
+ * Allocate the data blocks needed to hold the first @len bytes of the file
+ * referenced by file descriptor @fd, as a single contiguous extent whenever
+ * possible. The file size is left unchanged: reserved blocks past the end of
+ * file cannot be read, and later writes fill them without allocating.
+ * fs_truncate() releases the reserved blocks past the new end of file. Holes
+ * before the last block of the file are left unfilled.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if the file is
+ * compressed, or if there is not enough space. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t len);
+
+/**
+ * struct fs_frag_stats - Fragmentation of the file system
+ * @files: Number of files holding data blocks
+ * @fragmented_files: Number of files made of more than one extent
+ * @blocks: Number of data blocks in the chains of the files
+ * @extents: Number of runs of consecutive blocks in the chains of the files
+ * @free_blocks: Number of unused data blocks
+ * @free_extents: Number of runs of unused data blocks
+ * @largest_free_extent: Length of the longest run of unused data blocks
+ *
+ * Blocks shared by several files are counted once per file.
+ */
+struct fs_frag_stats {
+	unsigned int files;
+	unsigned int fragmented_files;
+	unsigned int blocks;
+	unsigned int extents;
+	unsigned int free_blocks;
+	unsigned int free_extents;
+	unsigned int largest_free_extent;
+};
+
+/**
+ * fs_frag_stats - Measure the fragmentation of the file system
+ * @stats: Structure to fill
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_frag_stats(struct fs_frag_stats *stats);
+
+/**
+ * fs_defrag - Rewrite fragmented files as contiguous extents
+ * @max_blocks: Maximum number of blocks to move, or 0 for no limit
+ *
+ * Files made of several extents are moved, one at a time, to a free run large
+ * enough to hold them, preferably the one following their first extent so that
+ * it stays in place. Blocks are copied to their new place before the chain is
+ * switched over to them, and freed afterwards, each step being written to disk:
+ * a crash leaves every file either in its old or in its new place. The only
+ * extra space needed is therefore the free run a file is moved to. Files
+ * sharing blocks with other files, and files no free run can hold, are left
+ * fragmented.
+ *
+ * With a non-zero @max_blocks, the call stops after moving that many blocks,
+ * possibly in the middle of a file, and the next call resumes from there. Files
+ * can be open, read and written in between.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be moved.
+ * Otherwise return the number of blocks moved, 0 once there is nothing left to
+ * defragment.
+ */
+int fs_defrag(unsigned int max_blocks);
+
+/**
+ * struct fs_check_report - Problems found by fs_check()
+ * @superblock_errors: Superblock fields that don't match the disk layout
+ * @fat_errors: Reserved or out of range FAT entries that are in use
+ * @entry_errors: Root directory entries with an invalid name or flags
+ * @bad_pointers: Chains reaching a block out of the data region or free
+ * @cycles: Chains looping back on themselves
+ * @cross_links: Chains reaching a block of another chain that isn't shared
+ * @short_chains: Chains too short for the size of their file or table
+ * @leaked_blocks: Used blocks that no chain reaches
+ * @bad_refcounts: Reference counts that don't match the references to their
+ *                 block
+ * @repaired: Number of problems repaired
+ * @threads: Number of threads that walked the chains
+ */
+struct fs_check_report {
+	unsigned int superblock_errors;
+	unsigned int fat_errors;
+	unsigned int entry_errors;
+	unsigned int bad_pointers;
+	unsigned int cycles;
+	unsigned int cross_links;
+	unsigned int short_chains;
+	unsigned int leaked_blocks;
+	unsigned int bad_refcounts;
+	unsigned int repaired;
+	unsigned int threads;
+};
+
+/**
+ * fs_check - Check the consistency of a file system image
+ * @diskname: Name of the virtual disk file
+ * @repair: Non-zero to repair the problems found
+ * @report: Structure to fill with the problems found
+ *
+ * Check the superblock of the unmounted file system in @diskname, then walk
+ * the chains of every file, hole map and table from several threads, which
+ * share a map of the blocks already reached to detect cycles and cross-links.
+ * Blocks shared through reference counts are not cross-links. Used blocks no
+ * chain reaches are leaked, and the reference counts must match the references
+ * found. Every problem is described on stderr.
+ *
+ * Repairing cuts every chain before its error, the file listed first in the
+ * root directory keeping a cross-linked block. File sizes are then cut down to
+ * what the chains hold, compressed files that lost blocks are emptied, leaked
+ * blocks are freed and reference counts are fixed. Nothing is repaired when
+ * the superblock or the reference count table is damaged.
+ *
+ * Return: -1 if a file system is currently mounted, or if @report is NULL, or
+ * if @diskname cannot be opened, or if the image cannot be read or written.
+ * Otherwise return the number of problems left unrepaired.
+ */
+int fs_check(const char *diskname, int repair, struct fs_check_report *report);
+
+/**
+ * enum fs_stats_op - Operations timed by the statistics
+ *
+ * Every fs_*() call of this header, apart from the statistics functions, then
+ * every call to the block layer, including those of the flusher thread.
+ * fs_open() is counted as %FS_OP_OPEN through fs_open_flags().
+ */
+enum fs_stats_op {
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_INFO,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_CREATE_MANY,
+	FS_OP_DELETE_MANY,
+	FS_OP_LS,
+	FS_OP_LIST,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_READ,
+	FS_OP_FLUSHER_START,
+	FS_OP_FLUSHER_STOP,
+	FS_OP_SYNC,
+	FS_OP_CSUM_ENABLE,
+	FS_OP_CSUM_DISABLE,
+	FS_OP_SET_COMPRESSION,
+	FS_OP_SET_DEDUP,
+	FS_OP_CLONE,
+	FS_OP_COPY_RANGE,
+	FS_OP_TRUNCATE,
+	FS_OP_FALLOCATE,
+	FS_OP_FRAG_STATS,
+	FS_OP_DEFRAG,
+	FS_OP_CHECK,
+	FS_OP_BLOCK_READ,
+	FS_OP_BLOCK_WRITE,
+	FS_OP_BLOCK_READ_MULTI,
+	FS_OP_BLOCK_WRITE_MULTI,
+	FS_OP_COUNT
+};
+
+/** Number of buckets in the latency histograms */
+#define FS_STATS_BUCKETS 32
+
+/**
+ * struct fs_op_stats - Statistics of an operation
+ * @calls: Number of calls. A call the library makes to its own fs_*()
+ * functions counts as part of the call that made it, not as a call.
+ * @errors: Number of calls during which an error was reported
+ * @timed: Number of calls whose latency was measured, see fs_set_stats_timing()
+ * @total_ns: Sum of the latencies, in nanoseconds
+ * @max_ns: Highest latency, in nanoseconds
+ * @histogram: Number of calls per latency range. Bucket i counts latencies
+ * from 2^i to 2^(i+1) - 1 ns, bucket 0 also counts 0 ns and the last bucket
+ * every longer latency.
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t timed;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t histogram[FS_STATS_BUCKETS];
+};
+
+/**
+ * struct fs_stats - Activity of the library
+ * @ops: Statistics of each operation, indexed by &enum fs_stats_op
+ * @blocks_read: Number of disk blocks read by the block layer
+ * @blocks_written: Number of disk blocks written by the block layer
+ * @fat_steps: Number of FAT entries followed to reach a position in a chain
+ * @bounce_copies: Number of partial blocks copied through the bounce buffer
+ * @cache_hits: Number of block reads served by the write-back cache
+ * @cache_misses: Number of block reads the write-back cache sent to the disk
+ * @alloc_scans: Number of searches of the FAT for free blocks
+ * @alloc_scan_steps: Number of FAT entries examined by these searches
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t fat_steps;
+	uint64_t bounce_copies;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t alloc_scans;
+	uint64_t alloc_scan_steps;
+};
+
+/**
+ * fs_get_stats - Get the statistics of the library
+ * @stats: Structure to fill
+ *
+ * Statistics are collected from the start of the program, across mounts, until
+ * fs_reset_stats(). Calls still in progress are not counted yet.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset the statistics of the library
+ *
+ * Return: 0.
+ */
+int fs_reset_stats(void);
+
+/**
+ * fs_set_stats_timing - Measure the latency of operations
+ * @enable: Non-zero to measure latencies, zero to stop
+ *
+ * Counters are always maintained, at the cost of a few atomic additions per
+ * call. Measuring latencies reads the clock twice per operation, which is
+ * noticeable on calls as short as fs_stat() or small appends, so it is disabled
+ * by default.
+ *
+ * Return: 0.
+ */
+int fs_set_stats_timing(int enable);
+
+/**
+ * fs_stats_op_name - Get the name of a timed operation
+ * @op: Operation, see &enum fs_stats_op
+ *
+ * Return: NULL if @op is not an operation. Otherwise the name of the function
+ * timed by @op.
+ */
+const char *fs_stats_op_name(int op);
+
+/** Number of events kept by the trace ring buffer */
+#define FS_TRACE_CAPACITY 65536
+
+/**
+ * struct fs_trace_event - Event recorded by the trace
+ * @time_ns: Time of the event, in nanoseconds since fs_trace_start()
+ * @block: First disk block of an I/O, file offset of a request
+ * @count: Number of blocks of an I/O, number of bytes of a request
+ * @op: Block-layer operation for an I/O, %FS_OP_READ or %FS_OP_WRITE for a
+ * request to read or write a file (see &enum fs_stats_op)
+ * @caller: fs_*() operation called by the application that issued an I/O,
+ * %FS_OP_COUNT if none, as for the writes of the flusher thread
+ * @file: Root directory index of the file being read or written, -1 if none
+ */
+struct fs_trace_event {
+	uint64_t time_ns;
+	uint32_t block;
+	uint32_t count;
+	uint8_t  op;
+	uint8_t  caller;
+	int16_t  file;
+};
+
+/**
+ * fs_trace_start - Start tracing block-layer I/O
+ *
+ * Empty the trace, then record every call to the block layer as well as every
+ * fs_read() and fs_write() request, in a ring buffer of %FS_TRACE_CAPACITY
+ * events. Recording is lock-free; when the trace is stopped, it costs a single
+ * test per I/O.
+ *
+ * Return: 0.
+ */
+int fs_trace_start(void);
+
+/**
+ * fs_trace_stop - Stop tracing
+ *
+ * Events recorded so far can still be read.
+ *
+ * Return: 0.
+ */
+int fs_trace_stop(void);
+
+/**
+ * fs_trace_read - Read the trace
+ * @events: Array to fill with events, oldest first
+ * @max: Size of @events
+ * @lost: Filled with the number of events overwritten since the previous read
+ * before they could be read, or NULL
+ *
+ * Events are removed from the trace as they are read, so that a long trace
+ * can be drained periodically.
+ *
+ * Return: -1 if @events is NULL and @max is not 0. Otherwise return the number
+ * of events read.
+ */
+int fs_trace_read(struct fs_trace_event *events, size_t max, uint64_t *lost);
+
+/**
+ * fs_record_start - Record the calls made to the library as a test_fs script
+ * @filename: Name of the host file to write the script to
+ *
+ * Stop any previous recording, then write a line of script for every call to
+ * fs_mount(), fs_umount(), fs_create(), fs_delete(), fs_create_many(),
+ * fs_delete_many(), fs_open(), fs_close(), fs_lseek(), fs_write(), fs_read(),
+ * fs_truncate(), fs_fallocate(), fs_set_compression(), fs_clone(),
+ * fs_copy_range() and fs_defrag() whose arguments are valid. Descriptors are
+ * named after their number, written data is replaced by as many random bytes
+ * and read data is not checked. Pauses of the application of a millisecond or
+ * more are recorded as well, so that `test_fs.x replay` can reproduce its
+ * timing.
+ *
+ * Return: -1 if @filename is NULL or cannot be written. 0 otherwise.
+ */
+int fs_record_start(const char *filename);
+
+/**
+ * fs_record_stop - Stop recording calls
+ *
+ * Return: -1 if the script could not be completely written. 0 otherwise.
+ */
+int fs_record_stop(void);
+
 #endif /* _FS_H */
@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+* A compressed stream is a sequence of sequences. Each starts with a token whose high nibble is the literal length and
+* low nibble the match length minus MIN_MATCH; a nibble of 15 is followed by extra length bytes, added up until one is
+* below 255. The literals come next, then a 2-byte little-endian offset and the match. The last sequence only has
+* literals and ends with the input.
+*/
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+* put_length - Write the extra bytes of a length that didn't fit in its nibble
+*
+* Return: pointer past the last byte written, NULL if @end was reached
+*/
+static uint8_t *put_length(uint8_t *op, uint8_t *end, size_t length)
+{
+	for (; length >= 255; length -= 255) {
+		if (op == end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op == end)
+		return NULL;
+	*op++ = length;
+
+	return op;
+}
+
+/*
+* put_sequence - Write literals [@anchor, @anchor + @literals) followed by a match, if @match_len is non-zero
+*
+* Return: pointer past the last byte written, NULL if @end was reached
+*/
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *anchor, size_t literals,
+			     size_t offset, size_t match_len)
+{
+	size_t match_code = match_len ? match_len - MIN_MATCH : 0;
+
+	if (op == end)
+		return NULL;
+	uint8_t *token = op++;
+	*token = ((literals < 15 ? literals : 15) << 4) | (match_code < 15 ? match_code : 15);
+
+	if (literals >= 15 && !(op = put_length(op, end, literals - 15)))
+		return NULL;
+	if ((size_t)(end - op) < literals)
+		return NULL;
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	if (!match_len)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	if (match_code >= 15 && !(op = put_length(op, end, match_code - 15)))
+		return NULL;
+
+	return op;
+}
+
+/*
+* get_length - Add up the extra bytes of a length whose nibble was 15
+*
+* Return: 0 if successful, -1 if the input ended early
+*/
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+	uint8_t byte;
+
+	do {
+		if (*ip == end)
+			return -1;
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+/* Codec Functions */
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	uint32_t table[1 << HASH_BITS] = { 0 };	// Position + 1 of the last occurrence of each hash
+	const uint8_t *base = src, *ip = src, *anchor = src;
+	const uint8_t *end = base + len;
+	uint8_t *op = dst, *op_end = op + cap;
+
+	while (len >= MIN_MATCH && ip <= end - MIN_MATCH) {
+		uint32_t sequence = read32(ip);
+		uint32_t h = hash(sequence);
+		const uint8_t *ref = base + table[h] - 1;
+		int found = table[h] && (size_t)(ip - ref) <= MAX_OFFSET && read32(ref) == sequence;
+
+		table[h] = ip - base + 1;
+		if (!found) {
+			ip++;
+			continue;
+		}
+
+		size_t match_len = MIN_MATCH;
+		while (ip + match_len < end && ref[match_len] == ip[match_len])
+			match_len++;
+
+		op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_len);
+		if (!op)
+			return 0;
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *end = ip + len;
+	uint8_t *op = dst, *op_end = op + cap;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+
+		/* Literals */
+		size_t literals = token >> 4;
+		if (literals == 15 && get_length(&ip, end, &literals) < 0)
+			return -1;
+		if ((size_t)(end - ip) < literals || (size_t)(op_end - op) < literals)
+			return -1;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has no match
+		if (ip == end)
+			break;
+
+		/* Match */
+		if (end - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match_len = token & 0xF;
+		if (match_len == 15 && get_length(&ip, end, &match_len) < 0)
+			return -1;
+		match_len += MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || (size_t)(op_end - op) < match_len)
+			return -1;
+
+		// Matches may overlap their own output, so copy forward byte by byte
+		const uint8_t *ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			while (match_len--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
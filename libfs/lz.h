@@ -0,0 +1,32 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * lz_compress - Compress a buffer with the LZ77 codec
+ * @src: Data to compress
+ * @len: Number of bytes in @src
+ * @dst: Buffer receiving the compressed data
+ * @cap: Capacity of @dst in bytes
+ *
+ * The compressed format is a sequence of literal runs and back-references of
+ * at least 4 bytes within the previous 64 KiB, in the spirit of LZ4.
+ *
+ * Return: Size of the compressed data, or 0 if it doesn't fit in @cap bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer produced by lz_compress()
+ * @src: Compressed data
+ * @len: Number of bytes in @src
+ * @dst: Buffer receiving the decompressed data
+ * @cap: Capacity of @dst in bytes
+ *
+ * Return: Size of the decompressed data, or -1 if @src is malformed or doesn't
+ * fit in @cap bytes.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+#define ram_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* RAM disk instance: the whole image, and the file it was loaded from */
+struct ramdisk {
+	/* Virtual disk file, kept open to save the image back */
+	int fd;
+	/* Blocks of the image */
+	char *data;
+	size_t bcount;
+	/* Whether blocks were written since the image was loaded or saved */
+	int dirty;
+};
+
+static struct ramdisk ram = { .fd = -1 };
+
+/*
+ * Transfer a whole image between the file and memory, going on after short
+ * transfers. Holes of sparse image files read back as zeros.
+ */
+static int transfer_image(int write)
+{
+	size_t size = ram.bcount * BLOCK_SIZE, done = 0;
+
+	while (done < size) {
+		ssize_t ret = write ? pwrite(ram.fd, ram.data + done, size - done, done) :
+				      pread(ram.fd, ram.data + done, size - done, done);
+
+		if (ret < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			ram_error("image file shrunk while in use");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int ram_open(const char *diskname, size_t *bcount)
+{
+	struct stat st;
+
+	if ((ram.fd = open(diskname, O_RDWR, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(ram.fd, &st)) {
+		perror("fstat");
+		goto close_fd;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE != 0) {
+		ram_error("size '%zu' is not multiple of '%d'", st.st_size, BLOCK_SIZE);
+		goto close_fd;
+	}
+
+	ram.bcount = st.st_size / BLOCK_SIZE;
+	ram.data = malloc(st.st_size ? st.st_size : 1);
+	if (!ram.data) {
+		ram_error("cannot hold %zu blocks in memory", ram.bcount);
+		goto close_fd;
+	}
+
+	if (transfer_image(0)) {
+		free(ram.data);
+		goto close_fd;
+	}
+
+	ram.dirty = 0;
+	*bcount = ram.bcount;
+
+	return 0;
+
+close_fd:
+	close(ram.fd);
+	ram.fd = -1;
+	return -1;
+}
+
+int block_ram_save(void)
+{
+	if (ram.fd < 0) {
+		ram_error("no RAM disk currently open");
+		return -1;
+	}
+
+	if (!ram.dirty)
+		return 0;
+
+	if (transfer_image(1))
+		return -1;
+	ram.dirty = 0;
+
+	return 0;
+}
+
+static int ram_close(void)
+{
+	int ret = block_ram_save();
+
+	free(ram.data);
+	ram.data = NULL;
+	close(ram.fd);
+	ram.fd = -1;
+
+	return ret;
+}
+
+static int ram_read(size_t block, size_t count, void *buf)
+{
+	memcpy(buf, ram.data + block * BLOCK_SIZE, count * BLOCK_SIZE);
+
+	return 0;
+}
+
+static int ram_write(size_t block, size_t count, const void *buf)
+{
+	memcpy(ram.data + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	ram.dirty = 1;
+
+	return 0;
+}
+
+const struct block_device block_ram_device = {
+	.name = "ram",
+	.open = ram_open,
+	.close = ram_close,
+	.read = ram_read,
+	.write = ram_write,
+};
@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fs.h"
+#include "record.h"
+
+#define record_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Idle time after which the time of the next call is recorded */
+#define RECORD_IDLE_NS 1000000
+
+/* Recording in progress */
+struct recording {
+	pthread_mutex_t lock;
+	FILE *script;
+	uint64_t start;			// Time (ns) of fs_record_start()
+	uint64_t last;			// Time (ns) of the last call recorded
+	int current_fd;			// Descriptor the script works on, -1 if none
+};
+
+int record_enabled;
+
+static struct recording recording = { .lock = PTHREAD_MUTEX_INITIALIZER, .current_fd = -1 };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void record_line(int fd, int next_fd, const char *fmt, ...)
+{
+	uint64_t now = now_ns();
+	va_list args;
+
+	pthread_mutex_lock(&recording.lock);
+	if (!recording.script)
+		goto unlock;
+
+	// Replays wait until then, to keep the pauses of the application
+	if (now - recording.last >= RECORD_IDLE_NS)
+		fprintf(recording.script, "AT\t%lu\n", (unsigned long)((now - recording.start) / 1000));
+	recording.last = now;
+
+	if (fd >= 0 && fd != recording.current_fd) {
+		fprintf(recording.script, "USE\tfd%d\n", fd);
+		recording.current_fd = fd;
+	}
+
+	va_start(args, fmt);
+	vfprintf(recording.script, fmt, args);
+	va_end(args);
+	fputc('\n', recording.script);
+
+	if (next_fd != fd)
+		recording.current_fd = next_fd;
+
+unlock:
+	pthread_mutex_unlock(&recording.lock);
+}
+
+int fs_record_start(const char *filename)
+{
+	FILE *script;
+
+	if (filename == NULL) {
+		record_error("Filename is NULL");
+		return -1;
+	}
+
+	script = fopen(filename, "w");
+	if (!script) {
+		perror("fopen");
+		return -1;
+	}
+
+	fs_record_stop();
+
+	pthread_mutex_lock(&recording.lock);
+	recording.script = script;
+	recording.start = recording.last = now_ns();
+	recording.current_fd = -1;
+	pthread_mutex_unlock(&recording.lock);
+
+	__atomic_store_n(&record_enabled, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int fs_record_stop(void)
+{
+	int ret = 0;
+
+	__atomic_store_n(&record_enabled, 0, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&recording.lock);
+	if (recording.script && fclose(recording.script)) {
+		perror("fclose");
+		ret = -1;
+	}
+	recording.script = NULL;
+	pthread_mutex_unlock(&recording.lock);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include "stats.h"
+
+/* Calls are recorded, see fs_record_start() */
+extern int record_enabled;
+
+/**
+ * record_call - Record a call as a line of test_fs script, if recording
+ * @fd: File descriptor the call works on, -1 if none
+ * @next_fd: File descriptor the script works on after the call, which differs
+ *           from @fd only for calls that open or close a file
+ * @fmt: Format of the line, without its newline
+ *
+ * Only calls made by the application are recorded, not the ones libfs makes to
+ * itself, which are nested in the STATS_SCOPE() of another call.
+ */
+#define record_call(fd, next_fd, fmt, ...) \
+do { \
+	if (__atomic_load_n(&record_enabled, __ATOMIC_RELAXED) && stats_scope.caller == FS_OP_COUNT) \
+		record_line((fd), (next_fd), fmt, ##__VA_ARGS__); \
+} while (0)
+
+/**
+ * record_line - Write a line of script to the recording
+ * @fd: File descriptor the line works on, -1 if none
+ * @next_fd: File descriptor the script works on after the line
+ * @fmt: Format of the line, without its newline
+ *
+ * The line is preceded by a USE line when @fd is not the current descriptor of
+ * the script, and by an AT line when the application was idle for a while.
+ */
+void record_line(int fd, int next_fd, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#endif /* _RECORD_H */
@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+
+#define sim_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Waits shorter than this are spun, sleeping is not precise enough for them */
+#define SPIN_NS 100000
+
+/* Simulated disk instance */
+struct simdisk {
+	/* Serializes I/O, as on a single-queue device */
+	pthread_mutex_t lock;
+	/* Parameters, the backing device being used from the next open */
+	struct block_sim_config config;
+	/* Backing device of the open disk */
+	const struct block_device *device;
+	/* Block following the last I/O, where the head is */
+	size_t head;
+	/* Faults waiting to fire */
+	struct block_sim_fault faults[BLOCK_SIM_MAX_FAULTS];
+	int fault_count;
+	/* Whether a torn write cut the power */
+	int powered_off;
+	struct block_sim_stats stats;
+};
+
+static struct simdisk sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Delay an I/O of @count blocks at @block by its simulated service time: the
+ * fixed latency, the seek from where the previous I/O ended, and the transfer.
+ */
+static void delay_io(size_t block, size_t count)
+{
+	struct block_sim_config *config = &sim.config;
+	uint64_t delay_ns = (uint64_t)config->latency_us * 1000;
+	uint64_t deadline;
+
+	if (config->seek_ns_per_block) {
+		uint64_t distance = block > sim.head ? block - sim.head : sim.head - block;
+		uint64_t seek_ns = distance * config->seek_ns_per_block;
+
+		if (config->seek_max_us && seek_ns > (uint64_t)config->seek_max_us * 1000)
+			seek_ns = (uint64_t)config->seek_max_us * 1000;
+		delay_ns += seek_ns;
+	}
+	sim.head = block + count;
+
+	// 1 MB/s moves one byte per microsecond
+	if (config->bandwidth_mb_s)
+		delay_ns += (uint64_t)count * BLOCK_SIZE * 1000 / config->bandwidth_mb_s;
+
+	if (delay_ns == 0)
+		return;
+	sim.stats.delay_ns += delay_ns;
+
+	deadline = now_ns() + delay_ns;
+	if (delay_ns > SPIN_NS) {
+		uint64_t sleep_ns = delay_ns - SPIN_NS;
+		struct timespec ts = { .tv_sec = sleep_ns / 1000000000, .tv_nsec = sleep_ns % 1000000000 };
+
+		nanosleep(&ts, NULL);
+	}
+	while (now_ns() < deadline)
+		;
+}
+
+/*
+ * Find the first fault of type @type among blocks @block to @block + @count - 1
+ * that is due to fire, consuming one of the accesses it lets through first.
+ */
+static struct block_sim_fault *find_fault(int type, size_t block, size_t count)
+{
+	for (int i = 0; i < sim.fault_count; i++) {
+		struct block_sim_fault *fault = &sim.faults[i];
+
+		if (fault->type != type || fault->block < block || fault->block >= block + count)
+			continue;
+
+		if (fault->skip) {
+			fault->skip--;
+			continue;
+		}
+
+		return fault;
+	}
+
+	return NULL;
+}
+
+static int sim_open(const char *diskname, size_t *bcount)
+{
+	int ret;
+
+	pthread_mutex_lock(&sim.lock);
+	sim.device = sim.config.device ? sim.config.device : &block_file_device;
+	sim.head = 0;
+	sim.powered_off = 0;
+	ret = sim.device->open(diskname, bcount);
+	pthread_mutex_unlock(&sim.lock);
+
+	return ret;
+}
+
+static int sim_close(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ret = sim.device->close();
+	pthread_mutex_unlock(&sim.lock);
+
+	return ret;
+}
+
+static int sim_read(size_t block, size_t count, void *buf)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&sim.lock);
+	sim.stats.ios++;
+	delay_io(block, count);
+
+	if (find_fault(BLOCK_SIM_READ_ERROR, block, count)) {
+		sim.stats.faults++;
+		sim_error("injected read error in blocks %zu+%zu", block, count);
+		goto unlock;
+	}
+
+	ret = sim.device->read(block, count, buf);
+
+unlock:
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+/*
+ * Write the blocks before the torn one, then the first bytes of the torn one
+ * over its previous content. Nothing written afterwards reaches the disk.
+ */
+static int write_torn(size_t block, const void *buf, const struct block_sim_fault *fault)
+{
+	char torn[BLOCK_SIZE];
+	size_t before = fault->block - block;
+	size_t bytes = fault->bytes < BLOCK_SIZE ? fault->bytes : BLOCK_SIZE;
+
+	if (before && sim.device->write(block, before, buf))
+		return -1;
+
+	if (sim.device->read(fault->block, 1, torn))
+		return -1;
+	memcpy(torn, (const char *)buf + before * BLOCK_SIZE, bytes);
+
+	return sim.device->write(fault->block, 1, torn);
+}
+
+static int sim_write(size_t block, size_t count, const void *buf)
+{
+	struct block_sim_fault *fault;
+	int ret = -1;
+
+	pthread_mutex_lock(&sim.lock);
+	sim.stats.ios++;
+	delay_io(block, count);
+
+	// The writer is not told, as after a power failure
+	if (sim.powered_off) {
+		sim.stats.dropped_writes += count;
+		ret = 0;
+		goto unlock;
+	}
+
+	if (find_fault(BLOCK_SIM_WRITE_ERROR, block, count)) {
+		sim.stats.faults++;
+		sim_error("injected write error in blocks %zu+%zu", block, count);
+		goto unlock;
+	}
+
+	if ((fault = find_fault(BLOCK_SIM_TORN_WRITE, block, count))) {
+		struct block_sim_fault torn = *fault;
+
+		// Power only goes out once
+		*fault = sim.faults[--sim.fault_count];
+
+		sim.stats.faults++;
+		sim.stats.dropped_writes += block + count - torn.block - 1;
+		sim.powered_off = 1;
+		ret = write_torn(block, buf, &torn);
+		goto unlock;
+	}
+
+	ret = sim.device->write(block, count, buf);
+
+unlock:
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+const struct block_device block_sim_device = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.read = sim_read,
+	.write = sim_write,
+};
+
+void block_sim_configure(const struct block_sim_config *config)
+{
+	pthread_mutex_lock(&sim.lock);
+	if (config)
+		sim.config = *config;
+	else
+		memset(&sim.config, 0, sizeof(sim.config));
+	pthread_mutex_unlock(&sim.lock);
+}
+
+int block_sim_inject(const struct block_sim_fault *fault)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&sim.lock);
+	if (!fault || fault->type < BLOCK_SIM_READ_ERROR || fault->type > BLOCK_SIM_TORN_WRITE) {
+		sim_error("invalid fault");
+		goto unlock;
+	}
+
+	if (sim.fault_count == BLOCK_SIM_MAX_FAULTS) {
+		sim_error("too many faults");
+		goto unlock;
+	}
+
+	sim.faults[sim.fault_count++] = *fault;
+	ret = 0;
+
+unlock:
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+void block_sim_clear_faults(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.fault_count = 0;
+	sim.powered_off = 0;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+void block_sim_get_stats(struct block_sim_stats *stats)
+{
+	pthread_mutex_lock(&sim.lock);
+	*stats = sim.stats;
+	stats->powered_off = sim.powered_off;
+	pthread_mutex_unlock(&sim.lock);
+}
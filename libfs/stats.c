@@ -0,0 +1,257 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fs.h"
+#include "stats.h"
+
+/**
+* The trace is a ring buffer indexed by a counter of recorded events. Each slot carries the number of its event plus
+* one, zeroed while the event is being written, so that the reader can tell a complete event from one being
+* overwritten by a writer that went around the ring.
+*/
+struct trace_slot {
+	uint64_t seq;			// Event number + 1, 0 while being written
+	struct fs_trace_event event;
+};
+
+struct trace {
+	uint64_t start;			// Time (ns) of fs_trace_start()
+	uint64_t head;			// Number of events recorded
+	uint64_t tail;			// Number of events read or lost
+	struct trace_slot slots[FS_TRACE_CAPACITY];
+};
+
+struct fs_stats libfs_stats;
+int stats_timing;
+__thread unsigned long stats_errors;
+__thread int stats_caller = FS_OP_COUNT;
+__thread int stats_file = -1;
+
+int trace_enabled;
+static struct trace trace;
+
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT] = "fs_mount",
+	[FS_OP_UMOUNT] = "fs_umount",
+	[FS_OP_INFO] = "fs_info",
+	[FS_OP_CREATE] = "fs_create",
+	[FS_OP_DELETE] = "fs_delete",
+	[FS_OP_CREATE_MANY] = "fs_create_many",
+	[FS_OP_DELETE_MANY] = "fs_delete_many",
+	[FS_OP_LS] = "fs_ls",
+	[FS_OP_LIST] = "fs_list",
+	[FS_OP_OPEN] = "fs_open",
+	[FS_OP_CLOSE] = "fs_close",
+	[FS_OP_STAT] = "fs_stat",
+	[FS_OP_LSEEK] = "fs_lseek",
+	[FS_OP_WRITE] = "fs_write",
+	[FS_OP_READ] = "fs_read",
+	[FS_OP_FLUSHER_START] = "fs_flusher_start",
+	[FS_OP_FLUSHER_STOP] = "fs_flusher_stop",
+	[FS_OP_SYNC] = "fs_sync",
+	[FS_OP_CSUM_ENABLE] = "fs_csum_enable",
+	[FS_OP_CSUM_DISABLE] = "fs_csum_disable",
+	[FS_OP_SET_COMPRESSION] = "fs_set_compression",
+	[FS_OP_SET_DEDUP] = "fs_set_dedup",
+	[FS_OP_CLONE] = "fs_clone",
+	[FS_OP_COPY_RANGE] = "fs_copy_range",
+	[FS_OP_TRUNCATE] = "fs_truncate",
+	[FS_OP_FALLOCATE] = "fs_fallocate",
+	[FS_OP_FRAG_STATS] = "fs_frag_stats",
+	[FS_OP_DEFRAG] = "fs_defrag",
+	[FS_OP_CHECK] = "fs_check",
+	[FS_OP_BLOCK_READ] = "block_read",
+	[FS_OP_BLOCK_WRITE] = "block_write",
+	[FS_OP_BLOCK_READ_MULTI] = "block_read_multi",
+	[FS_OP_BLOCK_WRITE_MULTI] = "block_write_multi",
+};
+
+/* Helper Functions */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+* bucket_of - Find the histogram bucket of a latency, the position of its highest bit set
+*/
+static int bucket_of(uint64_t ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	return (bucket < FS_STATS_BUCKETS) ? bucket : FS_STATS_BUCKETS - 1;
+}
+
+/* Scope Functions */
+
+struct stats_scope stats_scope_begin(int op)
+{
+	struct stats_scope scope = { .op = op, .caller = stats_caller, .file = stats_file, .errors = stats_errors };
+
+	// An fs_*() call made by the library itself is part of the call in progress, which gets its I/O and errors
+	if (op < FS_OP_BLOCK_READ) {
+		if (stats_caller != FS_OP_COUNT) {
+			scope.op = FS_OP_COUNT;
+			return scope;
+		}
+		stats_caller = op;
+	}
+
+	if (__atomic_load_n(&stats_timing, __ATOMIC_RELAXED))
+		scope.start = now_ns();
+
+	return scope;
+}
+
+void stats_scope_end(struct stats_scope *scope)
+{
+	stats_caller = scope->caller;
+	stats_file = scope->file;
+
+	if (scope->op == FS_OP_COUNT)
+		return;
+
+	struct fs_op_stats *op = &libfs_stats.ops[scope->op];
+
+	__atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
+	if (stats_errors != scope->errors)
+		__atomic_fetch_add(&op->errors, 1, __ATOMIC_RELAXED);
+
+	// Timing may have been enabled during the call
+	if (scope->start == 0)
+		return;
+
+	uint64_t ns = now_ns() - scope->start;
+	__atomic_fetch_add(&op->timed, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->histogram[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+
+	// The maximum is seldom raised, so the loop hardly ever runs
+	uint64_t max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&op->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Trace Functions */
+
+void trace_record(int op, size_t block, size_t count, int file)
+{
+	uint64_t seq = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+	struct trace_slot *slot = &trace.slots[seq % FS_TRACE_CAPACITY];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->event.time_ns = now_ns() - trace.start;
+	slot->event.block = block;
+	slot->event.count = count;
+	slot->event.op = op;
+	slot->event.caller = stats_caller;
+	slot->event.file = file;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Statistics Functions */
+
+int fs_get_stats(struct fs_stats *stats)
+{
+	const uint64_t *src = (const uint64_t *)&libfs_stats;
+	uint64_t *dst = (uint64_t *)stats;
+
+	if (stats == NULL)
+		return -1;
+
+	// Every member is a 64-bit counter
+	for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); ++i)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int fs_reset_stats(void)
+{
+	uint64_t *counter = (uint64_t *)&libfs_stats;
+
+	for (size_t i = 0; i < sizeof(libfs_stats) / sizeof(uint64_t); ++i)
+		__atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int fs_set_stats_timing(int enable)
+{
+	__atomic_store_n(&stats_timing, !!enable, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+const char *fs_stats_op_name(int op)
+{
+	if (op < 0 || op >= FS_OP_COUNT)
+		return NULL;
+
+	return op_names[op];
+}
+
+int fs_trace_start(void)
+{
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+
+	trace.start = now_ns();
+	trace.tail = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int fs_trace_stop(void)
+{
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int fs_trace_read(struct fs_trace_event *events, size_t max, uint64_t *lost)
+{
+	uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	uint64_t missed = 0;
+	size_t count = 0;
+
+	if (events == NULL && max > 0)
+		return -1;
+
+	// Events older than a lap of the ring were overwritten
+	if (head - trace.tail > FS_TRACE_CAPACITY) {
+		missed += head - trace.tail - FS_TRACE_CAPACITY;
+		trace.tail = head - FS_TRACE_CAPACITY;
+	}
+
+	for (; trace.tail < head && count < max; trace.tail++) {
+		struct trace_slot *slot = &trace.slots[trace.tail % FS_TRACE_CAPACITY];
+
+		// Skip events still being written, or overwritten meanwhile
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != trace.tail + 1) {
+			missed++;
+			continue;
+		}
+		events[count] = slot->event;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != trace.tail + 1) {
+			missed++;
+			continue;
+		}
+		count++;
+	}
+
+	if (lost)
+		*lost = missed;
+
+	return count;
+}
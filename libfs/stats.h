@@ -0,0 +1,113 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/* Statistics collected so far, only modified with relaxed atomics since the flusher thread does I/O as well */
+extern struct fs_stats libfs_stats;
+
+/* Latencies are measured, see fs_set_stats_timing() */
+extern int stats_timing;
+
+/* Errors reported by the calling thread so far */
+extern __thread unsigned long stats_errors;
+
+/* fs_*() operation in progress in the calling thread, FS_OP_COUNT if none */
+extern __thread int stats_caller;
+
+/* Root directory index of the file accessed by the calling thread, -1 if none */
+extern __thread int stats_file;
+
+/* Block-layer I/O is traced, see fs_trace_start() */
+extern int trace_enabled;
+
+/* Call being timed, see STATS_SCOPE() */
+struct stats_scope {
+	int op;				// FS_OP_COUNT for a call nested in another one, not recorded
+	int caller;			// stats_caller when the call started
+	int file;			// stats_file when the call started
+	unsigned long errors;		// stats_errors when the call started
+	uint64_t start;			// Time (ns) the call started, 0 if not timed
+};
+
+/**
+ * stats_add - Increase a counter of the statistics
+ * @field: Member of struct fs_stats
+ * @n: Amount to add
+ */
+#define stats_add(field, n) \
+	__atomic_fetch_add(&libfs_stats.field, (n), __ATOMIC_RELAXED)
+
+/**
+ * stats_error - Record an error reported by the calling thread
+ *
+ * The calls in progress in the thread are then counted as failed.
+ */
+#define stats_error() (stats_errors++)
+
+/**
+ * STATS_SCOPE - Time the rest of the enclosing block as a call of an operation
+ * @op: Operation, see enum fs_stats_op
+ *
+ * The call is recorded when the block is left, whichever way it returns. Its
+ * latency is only measured while timing is enabled.
+ */
+#define STATS_SCOPE(op) \
+	struct stats_scope stats_scope __attribute__((cleanup(stats_scope_end))) = stats_scope_begin(op)
+
+/**
+ * trace_io - Record an I/O in the trace, if enabled
+ * @op: Block-layer operation
+ * @block: First block
+ * @count: Number of blocks
+ */
+#define trace_io(op, block, count) \
+do { \
+	if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) \
+		trace_record((op), (block), (count), stats_file); \
+} while (0)
+
+/**
+ * trace_request - Record a request to read or write a file, and tag the I/O it causes with the file
+ * @op: %FS_OP_READ or %FS_OP_WRITE
+ * @file: Root directory index of the file
+ * @offset: Offset of the request in the file
+ * @bytes: Number of bytes requested
+ *
+ * The tag lasts until the end of the enclosing STATS_SCOPE(). A request the
+ * library makes to itself, as fs_copy_range() does, is not recorded: the I/O
+ * it causes belongs to the calling operation.
+ */
+#define trace_request(op, file, offset, bytes) \
+do { \
+	stats_file = (file); \
+	if (stats_caller == (op) && __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) \
+		trace_record((op), (offset), (bytes), (file)); \
+} while (0)
+
+/**
+ * trace_record - Add an event to the trace ring buffer
+ * @op: Operation
+ * @block: First block, or file offset
+ * @count: Number of blocks, or of bytes
+ * @file: Root directory index of the file, -1 if none
+ */
+void trace_record(int op, size_t block, size_t count, int file);
+
+/**
+ * stats_scope_begin - Start timing a call
+ * @op: Operation called
+ *
+ * Return: the description of the call, for stats_scope_end().
+ */
+struct stats_scope stats_scope_begin(int op);
+
+/**
+ * stats_scope_end - Record a call
+ * @scope: Description of the call returned by stats_scope_begin()
+ */
+void stats_scope_end(struct stats_scope *scope);
+
+#endif /* _STATS_H */
@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "stream.h"
+
+#define stream_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/**
+* A stream buffers one block of its file, the window starting at file offset base. Written bytes form a single dirty
+* range of the window, which is written with one fs_write() when flushed. Bytes read from the file fill the window up
+* to valid; they are only used while the window isn't dirty, since reads flush writes first.
+*/
+struct fs_stream {
+	int      fd;
+	size_t   offset;		// Stream offset
+	size_t   base;			// File offset of the window, a multiple of BLOCK_SIZE
+	size_t   valid;			// Bytes of the window read from the file, 0 if none
+	size_t   dirty_start;		// Dirty range of the window, empty if dirty_start == dirty_end
+	size_t   dirty_end;
+	uint8_t  buf[BLOCK_SIZE];
+};
+
+/*
+* window_holds - Tell whether the window of @stream covers @offset
+*/
+static int window_holds(struct fs_stream *stream, size_t offset)
+{
+	return offset >= stream->base && offset < stream->base + BLOCK_SIZE;
+}
+
+/*
+* flush - Write the dirty range of the window, and forget the window
+*
+* Return: -1 if the range couldn't be written entirely, 0 otherwise
+*/
+static int flush(struct fs_stream *stream)
+{
+	size_t length = stream->dirty_end - stream->dirty_start;
+	int ret = 0;
+
+	if (length) {
+		if (fs_lseek(stream->fd, stream->base + stream->dirty_start) < 0
+		    || fs_write(stream->fd, &stream->buf[stream->dirty_start], length) != (int)length) {
+			stream_error("cannot write buffered data");
+			ret = -1;
+		}
+	}
+
+	stream->valid = 0;
+	stream->dirty_start = stream->dirty_end = 0;
+
+	return ret;
+}
+
+struct fs_stream *fs_fopen(const char *filename)
+{
+	struct fs_stream *stream = calloc(1, sizeof(*stream));
+
+	if (!stream) {
+		perror("calloc");
+		return NULL;
+	}
+
+	stream->fd = fs_open(filename);
+	if (stream->fd < 0) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+int fs_fclose(struct fs_stream *stream)
+{
+	if (stream == NULL)
+		return -1;
+
+	int ret = flush(stream);
+	if (fs_close(stream->fd) < 0)
+		ret = -1;
+	free(stream);
+
+	return ret;
+}
+
+int fs_fwrite(struct fs_stream *stream, const void *buf, size_t count)
+{
+	size_t counted = 0;
+
+	if (stream == NULL || buf == NULL)
+		return -1;
+
+	while (counted < count) {
+		size_t offset = stream->offset;
+		size_t dirty = stream->dirty_end - stream->dirty_start;
+
+		// The dirty range must stay in one piece within the window
+		if (dirty && (!window_holds(stream, offset) || offset < stream->base + stream->dirty_start
+			      || offset > stream->base + stream->dirty_end)) {
+			if (flush(stream) < 0)
+				break;
+			dirty = 0;
+		}
+
+		/* Whole blocks go straight to the file */
+		if (!dirty && offset % BLOCK_SIZE == 0 && count - counted >= BLOCK_SIZE) {
+			size_t length = (count - counted) / BLOCK_SIZE * BLOCK_SIZE;
+
+			stream->valid = 0;
+			if (fs_lseek(stream->fd, offset) < 0)
+				break;
+			int written = fs_write(stream->fd, (uint8_t *)buf + counted, length);
+			if (written <= 0)
+				break;
+			counted += written;
+			stream->offset += written;
+			if ((size_t)written < length)
+				break;
+			continue;
+		}
+
+		/* Fill the window */
+		if (!dirty) {
+			if (!window_holds(stream, offset))
+				stream->valid = 0;
+			stream->base = offset - offset % BLOCK_SIZE;
+			stream->dirty_start = stream->dirty_end = offset - stream->base;
+		}
+
+		size_t start = offset - stream->base;
+		size_t length = BLOCK_SIZE - start;
+		if (length > count - counted)
+			length = count - counted;
+
+		memcpy(&stream->buf[start], (uint8_t *)buf + counted, length);
+		if (start + length > stream->dirty_end)
+			stream->dirty_end = start + length;
+		counted += length;
+		stream->offset += length;
+
+		// A full block is written right away
+		if (stream->dirty_end == BLOCK_SIZE && flush(stream) < 0) {
+			counted -= length;
+			stream->offset -= length;
+			break;
+		}
+	}
+
+	return (counted || count == 0) ? (int)counted : -1;
+}
+
+int fs_fread(struct fs_stream *stream, void *buf, size_t count)
+{
+	size_t counted = 0;
+
+	if (stream == NULL || buf == NULL)
+		return -1;
+
+	// The window only holds file content when clean
+	if (stream->dirty_end != stream->dirty_start && flush(stream) < 0)
+		return -1;
+
+	while (counted < count) {
+		size_t offset = stream->offset;
+
+		/* Serve from the window */
+		if (stream->valid && window_holds(stream, offset)) {
+			if (offset >= stream->base + stream->valid)
+				break;	// End of file
+
+			size_t length = stream->base + stream->valid - offset;
+			if (length > count - counted)
+				length = count - counted;
+			memcpy((uint8_t *)buf + counted, &stream->buf[offset - stream->base], length);
+			counted += length;
+			stream->offset += length;
+			continue;
+		}
+
+		if (fs_lseek(stream->fd, offset) < 0)
+			return -1;
+
+		/* Whole blocks go straight to the caller */
+		if (offset % BLOCK_SIZE == 0 && count - counted >= BLOCK_SIZE) {
+			size_t length = (count - counted) / BLOCK_SIZE * BLOCK_SIZE;
+			int got = fs_read(stream->fd, (uint8_t *)buf + counted, length);
+			if (got < 0)
+				return -1;
+			counted += got;
+			stream->offset += got;
+			if ((size_t)got < length)
+				break;
+			continue;
+		}
+
+		/* Refill the window */
+		stream->base = offset - offset % BLOCK_SIZE;
+		if (fs_lseek(stream->fd, stream->base) < 0)
+			return -1;
+		int got = fs_read(stream->fd, stream->buf, BLOCK_SIZE);
+		if (got < 0) {
+			stream->valid = 0;
+			return -1;
+		}
+		stream->valid = got;
+		if ((size_t)got <= offset - stream->base)
+			break;	// End of file
+	}
+
+	return counted;
+}
+
+int fs_fseek(struct fs_stream *stream, size_t offset)
+{
+	if (stream == NULL)
+		return -1;
+
+	stream->offset = offset;
+
+	return 0;
+}
+
+long fs_ftell(struct fs_stream *stream)
+{
+	if (stream == NULL)
+		return -1;
+
+	return stream->offset;
+}
+
+int fs_fflush(struct fs_stream *stream)
+{
+	if (stream == NULL)
+		return -1;
+
+	return flush(stream);
+}
@@ -0,0 +1,97 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h> /* for size_t definition */
+
+/* Buffered handle on a file, opaque to users */
+struct fs_stream;
+
+/**
+ * fs_fopen - Open a buffered stream on a file
+ * @filename: File name
+ *
+ * Open file named @filename with fs_open() and attach a block-sized buffer to
+ * the file descriptor. Small writes accumulate in the buffer and reach the
+ * file system as a single fs_write() per block; small reads are served from a
+ * buffer refilled one block at a time. The stream offset starts at 0.
+ *
+ * Return: NULL if the file cannot be opened or the buffer cannot be allocated.
+ * Otherwise the stream.
+ */
+struct fs_stream *fs_fopen(const char *filename);
+
+/**
+ * fs_fclose - Flush and close a stream
+ * @stream: Stream to close
+ *
+ * The stream is released even if flushing fails.
+ *
+ * Return: -1 if @stream is NULL, or if buffered data cannot be written, or if
+ * the file descriptor cannot be closed. 0 otherwise.
+ */
+int fs_fclose(struct fs_stream *stream);
+
+/**
+ * fs_fwrite - Write to a stream
+ * @stream: Stream to write to
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * The data is copied into the stream's buffer, which is written to the file
+ * once a whole block is filled, when the stream moves to another block, or on
+ * fs_fflush(). Until then, fs_stat() and other file descriptors don't see it.
+ * Writes of a block or more bypass the buffer.
+ *
+ * Return: -1 if @stream or @buf is NULL, or if nothing could be written.
+ * Otherwise return the number of bytes written, which can be smaller than
+ * @count if the disk runs out of space.
+ */
+int fs_fwrite(struct fs_stream *stream, const void *buf, size_t count);
+
+/**
+ * fs_fread - Read from a stream
+ * @stream: Stream to read from
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Buffered writes are flushed first. Bytes are then copied from the block held
+ * in the stream's buffer, refilled as the offset leaves it. Reads of a block or
+ * more bypass the buffer.
+ *
+ * Return: -1 if @stream or @buf is NULL, or if the file cannot be read.
+ * Otherwise return the number of bytes read, smaller than @count at the end of
+ * the file.
+ */
+int fs_fread(struct fs_stream *stream, void *buf, size_t count);
+
+/**
+ * fs_fseek - Set the offset of a stream
+ * @stream: Stream to move
+ * @offset: New offset, which can be past the end of the file
+ *
+ * Return: -1 if @stream is NULL. 0 otherwise.
+ */
+int fs_fseek(struct fs_stream *stream, size_t offset);
+
+/**
+ * fs_ftell - Get the offset of a stream
+ * @stream: Stream to query
+ *
+ * Return: -1 if @stream is NULL. Otherwise the offset of the stream.
+ */
+long fs_ftell(struct fs_stream *stream);
+
+/**
+ * fs_fflush - Write buffered data to the file
+ * @stream: Stream to flush
+ *
+ * Hand the buffered writes over to fs_write(), after which they are visible
+ * through fs_stat() and other file descriptors. As with fs_write(), the data
+ * reaches the disk according to the write-back cache, see fs_sync().
+ *
+ * Return: -1 if @stream is NULL, or if the data cannot be written entirely.
+ * 0 otherwise.
+ */
+int fs_fflush(struct fs_stream *stream);
+
+#endif /* _STREAM_H */